@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+"""Creates delta patch of the firmware image, which is applied by OTA_Delta_Sink.
+
+Usage: make_delta.py current.bin new.bin patch.bin
+"""
+
+import struct
+import sys
+
+MAGIC = b'TBDELTA1'
+BLOCK = 16      # Length of the exact match, which starts a diff region
+MISMATCH = 16   # Amount of mismatching bytes, which ends a diff region
+
+
+def find_matches(old, new):
+    index = {}
+    for i in range(len(old) - BLOCK + 1):
+        index.setdefault(old[i:i + BLOCK], i)
+
+    matches = []
+    pos = 0
+    while pos + BLOCK <= len(new):
+        old_pos = index.get(new[pos:pos + BLOCK])
+        if old_pos is None:
+            pos += 1
+            continue
+
+        # Extend the match as long as most bytes are equal, like bsdiff does
+        length = score = best = best_length = 0
+        while pos + length < len(new) and old_pos + length < len(old):
+            score += 1 if new[pos + length] == old[old_pos + length] else -1
+            length += 1
+            if score > best:
+                best, best_length = score, length
+            elif score < best - MISMATCH:
+                break
+
+        matches.append((pos, old_pos, best_length))
+        pos += best_length
+    return matches
+
+
+def encode_diff(diff):
+    # Runs of unchanged bytes and of bytes to add are encoded as tokens
+    tokens = bytearray()
+    i = 0
+    while i < len(diff):
+        j = i
+        if diff[i] == 0:
+            while j < len(diff) and j - i < 128 and diff[j] == 0:
+                j += 1
+            tokens.append(0x80 | (j - i - 1))
+        else:
+            while j < len(diff) and j - i < 128 and (diff[j] != 0 or diff[j + 1:j + 3] not in (b'', b'\0\0')):
+                j += 1
+            tokens.append(j - i - 1)
+            tokens += diff[i:j]
+        i = j
+    return tokens
+
+
+def make_delta(old, new):
+    patch = bytearray(MAGIC + struct.pack('<I', len(new)))
+    matches = find_matches(old, new)
+
+    # Leading bytes, which do not match anything, are a record without diff
+    first = matches[0] if matches else (len(new), 0, 0)
+    patch += struct.pack('<IIi', 0, first[0], first[1])
+    patch += new[:first[0]]
+
+    for i, (pos, old_pos, length) in enumerate(matches):
+        following = matches[i + 1] if i + 1 < len(matches) else (len(new), old_pos + length, 0)
+        extra = new[pos + length:following[0]]
+        patch += struct.pack('<IIi', length, len(extra), following[1] - (old_pos + length))
+        patch += encode_diff(bytes((new[pos + j] - old[old_pos + j]) & 0xFF for j in range(length)))
+        patch += extra
+    return bytes(patch)
+
+
+def main():
+    if len(sys.argv) != 4:
+        sys.exit(__doc__.strip())
+
+    with open(sys.argv[1], 'rb') as f:
+        old = f.read()
+    with open(sys.argv[2], 'rb') as f:
+        new = f.read()
+
+    patch = make_delta(old, new)
+    with open(sys.argv[3], 'wb') as f:
+        f.write(patch)
+    print('Image: %d bytes, patch: %d bytes (%.1f%%)' % (len(new), len(patch), 100.0 * len(patch) / max(len(new), 1)))
+
+
+if __name__ == '__main__':
+    main()
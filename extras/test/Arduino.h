@@ -0,0 +1,105 @@
+/*
+  Arduino.h - Stand-in of the Arduino core for host tests of the library.
+  Only what ThingsBoard.h uses is provided. Time is taken from the host
+  clock and can be moved forward by tests with advanceMillis().
+*/
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <thread>
+
+class __FlashStringHelper;
+#define F(str) (reinterpret_cast<const __FlashStringHelper*>(str))
+#define PROGMEM
+
+// Offset added to the host clock by advanceMillis()
+inline uint32_t& millisOffset() {
+	static uint32_t offset = 0;
+	return offset;
+}
+
+inline uint32_t millis() {
+	using namespace std::chrono;
+	static const steady_clock::time_point start = steady_clock::now();
+	return static_cast<uint32_t>(duration_cast<milliseconds>(steady_clock::now() - start).count()) + millisOffset();
+}
+
+// Moves time forward without waiting
+inline void advanceMillis(uint32_t ms) {
+	millisOffset() += ms;
+}
+
+inline void delay(uint32_t ms) {
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+inline void yield() { }
+
+class String {
+public:
+	String(const char* str = "") :m_str(str ? str : "") { }
+	String(unsigned long value) :m_str(std::to_string(value)) { }
+
+	const char* c_str() const { return m_str.c_str(); }
+	size_t length() const { return m_str.size(); }
+
+	String& operator+=(const String& other) { m_str += other.m_str; return *this; }
+	friend String operator+(String left, const String& right) { return left += right; }
+	friend String operator+(String left, const char* right) { return left += String(right); }
+
+private:
+	std::string m_str;
+};
+
+class Print {
+public:
+	virtual ~Print() { }
+	virtual size_t write(uint8_t c) = 0;
+	virtual size_t write(const uint8_t* buffer, size_t size) {
+		size_t written = 0;
+		while (written < size && write(buffer[written]))
+			++written;
+		return written;
+	}
+
+	size_t print(const char* str) { return write(reinterpret_cast<const uint8_t*>(str), strlen(str)); }
+	size_t print(const __FlashStringHelper* str) { return print(reinterpret_cast<const char*>(str)); }
+	size_t println(const char* str) { return print(str) + print("\n"); }
+};
+
+class Stream : public Print {
+public:
+	virtual int available() = 0;
+	virtual int read() = 0;
+	virtual int peek() = 0;
+	virtual void flush() { }
+};
+
+// Serial port, printed to stderr
+class HardwareSerial : public Stream {
+public:
+	size_t write(uint8_t c) override { return fputc(c, stderr) == EOF ? 0 : 1; }
+	int available() override { return 0; }
+	int read() override { return -1; }
+	int peek() override { return -1; }
+	void begin(unsigned long) { }
+};
+
+static HardwareSerial Serial;
+
+class IPAddress {
+public:
+	IPAddress(uint8_t a = 0, uint8_t b = 0, uint8_t c = 0, uint8_t d = 0) :m_address{ a, b, c, d } { }
+
+private:
+	uint8_t m_address[4];
+};
+
+#endif // Arduino_h
@@ -0,0 +1,83 @@
+/*
+  ArduinoHttpClient.h - Stand-in of the ArduinoHttpClient library for host
+  tests. Requests are recorded and answered with scripted responses, the
+  network client passed in is not used.
+*/
+#ifndef ArduinoHttpClient_h
+#define ArduinoHttpClient_h
+
+#include "Client.h"
+#include <deque>
+#include <vector>
+
+#define HTTP_SUCCESS 0
+#define HTTP_ERROR_API -2
+
+class HttpClient : public Client {
+public:
+	static const int kHttpResponseTimeout = 30 * 1000;
+
+	struct Response {
+		int status;
+		std::string body;
+	};
+
+	// Requests made by all clients, as method and path
+	static std::vector<std::string>& requests() {
+		static std::vector<std::string> list;
+		return list;
+	}
+
+	// Responses to the next requests of all clients
+	static std::deque<Response>& responses() {
+		static std::deque<Response> list;
+		return list;
+	}
+
+	HttpClient(Client&, const char*, uint16_t) :m_connected(false), m_response{ 0, "" }, m_position(0) { }
+
+	void connectionKeepAlive() { }
+
+	int get(const String& path) { return request("GET ", path); }
+	int post(const String& path, const char*, const char*) { return request("POST ", path); }
+	int responseStatusCode() { return m_response.status; }
+	int skipResponseHeaders() { return HTTP_SUCCESS; }
+	int contentLength() { return static_cast<int>(m_response.body.size()); }
+	bool endOfBodyReached() { return m_position == m_response.body.size(); }
+
+	int connect(IPAddress, uint16_t) override { return m_connected = true; }
+	int connect(const char*, uint16_t) override { return m_connected = true; }
+	size_t write(uint8_t) override { return 1; }
+	size_t write(const uint8_t*, size_t size) override { return size; }
+	int available() override { return static_cast<int>(m_response.body.size() - m_position); }
+	int read() override { return available() ? static_cast<uint8_t>(m_response.body[m_position++]) : -1; }
+	int read(uint8_t* buffer, size_t size) override {
+		const size_t length = size < static_cast<size_t>(available()) ? size : available();
+		memcpy(buffer, m_response.body.data() + m_position, length);
+		m_position += length;
+		return static_cast<int>(length);
+	}
+	int peek() override { return available() ? static_cast<uint8_t>(m_response.body[m_position]) : -1; }
+	void flush() override { }
+	void stop() override { m_connected = false; }
+	uint8_t connected() override { return m_connected; }
+	operator bool() override { return m_connected; }
+
+private:
+	int request(const char* method, const String& path) {
+		requests().push_back(std::string(method) + path.c_str());
+		if (responses().empty())
+			return HTTP_ERROR_API;
+		m_response = responses().front();
+		responses().pop_front();
+		m_position = 0;
+		m_connected = true;
+		return HTTP_SUCCESS;
+	}
+
+	bool m_connected;
+	Response m_response;
+	size_t m_position;
+};
+
+#endif // ArduinoHttpClient_h
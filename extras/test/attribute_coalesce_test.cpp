@@ -0,0 +1,110 @@
+// Tests of merging bursts of shared attribute updates
+
+#define THINGSBOARD_ATTRIBUTE_COALESCE 50
+#define THINGSBOARD_ATTRIBUTE_MIRROR_SIZE 4
+
+#include "test.h"
+#include "test_broker.h"
+#include "test_storage.h"
+
+using ThingsBoard_Under_Test = ThingsBoardSized<128, 8, Test_Logger>;
+
+static void test_burst_merged() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	Test_Storage storage;
+	tb.setStorage(&storage);
+	size_t updates = 0;
+	int level = 0;
+	size_t keys = 0;
+	CHECK(tb.connect("broker", "token"));
+	CHECK(tb.Shared_Attribute_Subscribe({ Shared_Attribute_Callback([&](const Shared_Attribute_Data& data) {
+		++updates;
+		level = data.object()["level"].as<int>();
+		keys = data.object().size();
+	}) }));
+
+	broker.publish("v1/devices/me/attributes", "{\"mode\":\"eco\",\"level\":1}");
+	broker.publish("v1/devices/me/attributes", "{\"level\":2}");
+	broker.publish("v1/devices/me/attributes", "{\"level\":3,\"fan\":true}");
+	tb.loop();
+
+	// Mirror is up to date right away, but neither saved nor passed on yet
+	CHECK(!strcmp(tb.Shared_Attribute_Value("level"), "3"));
+	CHECK(updates == 0 && storage.saves == 0);
+
+	advanceMillis(THINGSBOARD_ATTRIBUTE_COALESCE);
+	tb.loop();
+	CHECK(updates == 1 && level == 3 && keys == 3);
+	CHECK(storage.saves == 1);
+
+	// Saved mirror holds the merged values
+	ThingsBoard_Under_Test rebooted(broker);
+	rebooted.setStorage(&storage);
+	CHECK(!strcmp(rebooted.Shared_Attribute_Value("mode"), "\"eco\""));
+	CHECK(!strcmp(rebooted.Shared_Attribute_Value("level"), "3"));
+}
+
+// Serializes the update passed to callbacks
+static Shared_Attribute_Callback::processFn record(std::string& update) {
+	return [&update](const Shared_Attribute_Data& data) {
+		char payload[128];
+		serializeJson(data.object(), payload, sizeof(payload));
+		update = payload;
+	};
+}
+
+static void test_deleted_within_burst() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	Test_Storage storage;
+	tb.setStorage(&storage);
+	std::string update;
+	CHECK(tb.connect("broker", "token"));
+	CHECK(tb.Shared_Attribute_Subscribe({ Shared_Attribute_Callback(record(update)) }));
+
+	broker.publish("v1/devices/me/attributes", "{\"mode\":\"eco\",\"level\":1,\"fan\":true}");
+	broker.publish("v1/devices/me/attributes", "{\"deleted\":[\"mode\"]}");
+	broker.publish("v1/devices/me/attributes", "{\"deleted\":[\"level\",\"mode\"]}");
+	tb.loop();
+	advanceMillis(THINGSBOARD_ATTRIBUTE_COALESCE);
+	tb.loop();
+
+	// Deletions of every message are passed on, values of deleted keys are not
+	CHECK(update == "{\"fan\":true,\"deleted\":[\"mode\",\"level\"]}");
+	CHECK(storage.saves == 1);
+	ThingsBoard_Under_Test rebooted(broker);
+	rebooted.setStorage(&storage);
+	CHECK(!rebooted.Shared_Attribute_Value("mode") && !rebooted.Shared_Attribute_Value("level"));
+	CHECK(!strcmp(rebooted.Shared_Attribute_Value("fan"), "true"));
+}
+
+static void test_set_again_after_delete() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	std::string update;
+	CHECK(tb.connect("broker", "token"));
+	CHECK(tb.Shared_Attribute_Subscribe({ Shared_Attribute_Callback(record(update)) }));
+
+	broker.publish("v1/devices/me/attributes", "{\"deleted\":[\"mode\",\"level\"]}");
+	broker.publish("v1/devices/me/attributes", "{\"mode\":\"boost\"}");
+	tb.loop();
+	advanceMillis(THINGSBOARD_ATTRIBUTE_COALESCE);
+	tb.loop();
+	CHECK(update == "{\"deleted\":[\"level\"],\"mode\":\"boost\"}");
+
+	// List is left out, once every deleted key is set again
+	broker.publish("v1/devices/me/attributes", "{\"deleted\":[\"mode\"]}");
+	broker.publish("v1/devices/me/attributes", "{\"mode\":\"eco\"}");
+	tb.loop();
+	advanceMillis(THINGSBOARD_ATTRIBUTE_COALESCE);
+	tb.loop();
+	CHECK(update == "{\"mode\":\"eco\"}");
+}
+
+int main() {
+	RUN_TEST(test_burst_merged);
+	RUN_TEST(test_deleted_within_burst);
+	RUN_TEST(test_set_again_after_delete);
+	return testResult();
+}
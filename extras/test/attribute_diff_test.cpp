@@ -0,0 +1,88 @@
+// Tests of publishing only changed client attributes
+
+#define THINGSBOARD_ATTRIBUTE_DIFF_SIZE 2
+#define THINGSBOARD_ATTRIBUTE_DIFF_KEY_SIZE 8
+
+#include "test.h"
+#include "test_broker.h"
+#include <ThingsBoard.h>
+
+using ThingsBoard_Under_Test = ThingsBoardSized<64, 8, Test_Logger>;
+
+static void test_unchanged_skipped() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+
+	CHECK(tb.sendAttribute("fw", "1.0"));
+	CHECK(tb.sendAttribute("fw", "1.0"));
+	CHECK(broker.published.size() == 1 && broker.published[0].payload == "{\"fw\":\"1.0\"}");
+	CHECK(tb.sendAttribute("fw", "1.1"));
+	CHECK(broker.published.size() == 2);
+
+	// Same value of another key is published
+	CHECK(tb.sendAttribute("hw", "1.1"));
+	CHECK(broker.published.size() == 3 && broker.published[2].payload == "{\"hw\":\"1.1\"}");
+
+	// Only changed attributes of several are published
+	const Attribute attributes[] = { { "fw", "1.1" }, { "hw", "2.0" } };
+	CHECK(tb.sendAttributes(attributes, 2));
+	CHECK(broker.published.size() == 4 && broker.published[3].payload == "{\"hw\":\"2.0\"}");
+	CHECK(tb.sendAttributes(attributes, 2));
+	CHECK(broker.published.size() == 4);
+}
+
+static void test_long_key_always_published() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+
+	// Longest key, which is compared, and one byte more
+	const std::string key(THINGSBOARD_ATTRIBUTE_DIFF_KEY_SIZE - 1, 'k');
+	CHECK(tb.sendAttribute(key.c_str(), 1));
+	CHECK(tb.sendAttribute(key.c_str(), 1));
+	CHECK(broker.published.size() == 1);
+	const std::string longKey(THINGSBOARD_ATTRIBUTE_DIFF_KEY_SIZE, 'k');
+	CHECK(tb.sendAttribute(longKey.c_str(), 1));
+	CHECK(tb.sendAttribute(longKey.c_str(), 1));
+	CHECK(broker.published.size() == 3);
+}
+
+static void test_oldest_key_forgotten() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+
+	CHECK(tb.sendAttribute("a", 1));
+	CHECK(tb.sendAttribute("b", 1));
+	CHECK(tb.sendAttribute("c", 1));
+	CHECK(tb.sendAttribute("c", 1));
+	CHECK(tb.sendAttribute("b", 1));
+	CHECK(broker.published.size() == 3);
+	CHECK(tb.sendAttribute("a", 1));
+	CHECK(broker.published.size() == 4);
+}
+
+static void test_resend_after_connect() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+
+	CHECK(tb.sendAttribute("fw", "1.0"));
+	tb.disconnect();
+	CHECK(tb.connect("broker", "token"));
+	CHECK(tb.sendAttribute("fw", "1.0"));
+	CHECK(broker.published.size() == 2);
+
+	tb.Attributes_Force_Resend();
+	CHECK(tb.sendAttribute("fw", "1.0"));
+	CHECK(broker.published.size() == 3);
+}
+
+int main() {
+	RUN_TEST(test_unchanged_skipped);
+	RUN_TEST(test_long_key_always_published);
+	RUN_TEST(test_oldest_key_forgotten);
+	RUN_TEST(test_resend_after_connect);
+	return testResult();
+}
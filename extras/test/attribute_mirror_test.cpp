@@ -0,0 +1,68 @@
+// Tests of the mirror of shared attributes
+
+#define THINGSBOARD_ATTRIBUTE_MIRROR_SIZE 4
+
+#include "test.h"
+#include "test_broker.h"
+#include "test_storage.h"
+
+using ThingsBoard_Under_Test = ThingsBoardSized<128, 8, Test_Logger>;
+
+static bool subscribe(ThingsBoard_Under_Test& tb, size_t& updates) {
+	return tb.Shared_Attribute_Subscribe({ Shared_Attribute_Callback([&updates](const Shared_Attribute_Data&) {
+		++updates;
+	}) });
+}
+
+static void test_pushed_values_mirrored() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	size_t updates = 0;
+	CHECK(tb.connect("broker", "token") && subscribe(tb, updates));
+
+	broker.publish("v1/devices/me/attributes", "{\"mode\":\"eco\",\"level\":3}");
+	tb.loop();
+	uint32_t first = 0;
+	uint32_t second = 0;
+	CHECK(tb.Shared_Attribute_Value("mode", &first) && !strcmp(tb.Shared_Attribute_Value("mode"), "\"eco\""));
+	CHECK(!strcmp(tb.Shared_Attribute_Value("level"), "3"));
+
+	broker.publish("v1/devices/me/attributes", "{\"mode\":\"max\"}");
+	tb.loop();
+	CHECK(!strcmp(tb.Shared_Attribute_Value("mode", &second), "\"max\"") && second > first);
+	CHECK(updates == 2);
+}
+
+static void test_deleted_removed() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	Test_Storage storage;
+	tb.setStorage(&storage);
+	size_t updates = 0;
+	CHECK(tb.connect("broker", "token") && subscribe(tb, updates));
+
+	broker.publish("v1/devices/me/attributes", "{\"mode\":\"eco\",\"level\":3}");
+	tb.loop();
+	const size_t saves = storage.saves;
+	broker.publish("v1/devices/me/attributes", "{\"deleted\":[\"mode\",\"missing\"]}");
+	tb.loop();
+	CHECK(!tb.Shared_Attribute_Value("mode") && tb.Shared_Attribute_Value("level"));
+	CHECK(!tb.Shared_Attribute_Value("deleted"));
+	CHECK(storage.saves == saves + 1);
+
+	// Deletion survives a reboot
+	ThingsBoard_Under_Test rebooted(broker);
+	rebooted.setStorage(&storage);
+	CHECK(!rebooted.Shared_Attribute_Value("mode") && !strcmp(rebooted.Shared_Attribute_Value("level"), "3"));
+
+	// Deleting keys, which are not mirrored, changes nothing
+	broker.publish("v1/devices/me/attributes", "{\"deleted\":[\"missing\"]}");
+	tb.loop();
+	CHECK(storage.saves == saves + 1);
+}
+
+int main() {
+	RUN_TEST(test_pushed_values_mirrored);
+	RUN_TEST(test_deleted_removed);
+	return testResult();
+}
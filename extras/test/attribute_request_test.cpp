@@ -0,0 +1,139 @@
+// Tests of attribute requests against the scripted broker
+
+#define THINGSBOARD_MAX_ATTRIBUTE_REQUESTS 2
+
+#include "test.h"
+#include "test_broker.h"
+#include <ThingsBoard.h>
+
+using ThingsBoard_Under_Test = ThingsBoardSized<128, 8, Test_Logger>;
+
+static const char* const ClientKeys[] = { "firmware", "serial" };
+static const char* const SharedKeys[] = { "interval" };
+
+// Outcome of a request, as passed to its callback
+struct Outcome {
+	int  calls = 0;
+	bool timeout = false;
+	int  interval = 0;
+};
+
+static Attribute_Request_Callback record(Outcome& outcome) {
+	return [&outcome](const Attribute_Data& data, bool timeout) {
+		++outcome.calls;
+		outcome.timeout = timeout;
+		outcome.interval = data["shared"]["interval"].as<int>();
+	};
+}
+
+static void test_responses_correlated() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+
+	Outcome first, second;
+	CHECK(tb.Attributes_Request(ClientKeys, SharedKeys, record(first)));
+	CHECK(tb.Attributes_Request(nullptr, 0, SharedKeys, 1, record(second)));
+	CHECK(broker.subscriptions.size() == 1 && broker.subscriptions[0] == "v1/devices/me/attributes/response/+");
+	CHECK(broker.published.size() == 2);
+	CHECK(broker.published[0].topic == "v1/devices/me/attributes/request/1");
+	CHECK(broker.published[0].payload == "{\"clientKeys\":\"firmware,serial\",\"sharedKeys\":\"interval\"}");
+	CHECK(broker.published[1].topic == "v1/devices/me/attributes/request/2");
+	CHECK(broker.published[1].payload == "{\"sharedKeys\":\"interval\"}");
+	CHECK(tb.Attributes_Requests_Pending() == 2);
+
+	// Responses arrive out of order
+	broker.publish("v1/devices/me/attributes/response/2", "{\"shared\":{\"interval\":20}}");
+	tb.loop();
+	CHECK(first.calls == 0 && second.calls == 1 && !second.timeout && second.interval == 20);
+	broker.publish("v1/devices/me/attributes/response/1", "{\"client\":{\"firmware\":\"1.0\"},\"shared\":{\"interval\":10}}");
+	tb.loop();
+	CHECK(first.calls == 1 && !first.timeout && first.interval == 10);
+	CHECK(tb.Attributes_Requests_Pending() == 0);
+}
+
+static void test_timed_out() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+
+	Outcome answered, lost;
+	CHECK(tb.Attributes_Request(ClientKeys, SharedKeys, record(answered), 1000));
+	CHECK(tb.Attributes_Request(ClientKeys, SharedKeys, record(lost), 1000));
+	broker.publish("v1/devices/me/attributes/response/1", "{\"shared\":{\"interval\":10}}");
+	tb.loop();
+	CHECK(answered.calls == 1 && !answered.timeout);
+
+	advanceMillis(999);
+	tb.loop();
+	CHECK(lost.calls == 0);
+	advanceMillis(2);
+	tb.loop();
+	CHECK(lost.calls == 1 && lost.timeout && lost.interval == 0);
+	CHECK(Test_Logger::logged("attribute request timed out"));
+	CHECK(tb.Attributes_Requests_Pending() == 0);
+
+	// Late response is dropped
+	broker.publish("v1/devices/me/attributes/response/2", "{\"shared\":{\"interval\":10}}");
+	tb.loop();
+	CHECK(lost.calls == 1 && answered.calls == 1);
+	CHECK(Test_Logger::logged("no pending attribute request for the response"));
+}
+
+static void test_unknown_response() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+
+	Outcome outcome;
+	CHECK(tb.Attributes_Request(ClientKeys, SharedKeys, record(outcome)));
+	broker.publish("v1/devices/me/attributes/response/7", "{\"shared\":{\"interval\":10}}");
+	tb.loop();
+	CHECK(outcome.calls == 0 && tb.Attributes_Requests_Pending() == 1);
+	CHECK(Test_Logger::logged("no pending attribute request for the response"));
+}
+
+static void test_shared_request_ids() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+
+	// Client-side RPC and attribute requests draw ids from one sequence
+	Outcome outcome;
+	CHECK(tb.RPC_Request("getTime", [](const RPC_Data&, bool) { }));
+	CHECK(tb.Attributes_Request(ClientKeys, SharedKeys, record(outcome)));
+	CHECK(broker.published.size() == 2);
+	CHECK(broker.published[0].topic == "v1/devices/me/rpc/request/1");
+	CHECK(broker.published[1].topic == "v1/devices/me/attributes/request/2");
+
+	// Response to the RPC id does not complete the attribute request
+	broker.publish("v1/devices/me/attributes/response/1", "{\"shared\":{\"interval\":10}}");
+	tb.loop();
+	CHECK(outcome.calls == 0 && Test_Logger::logged("no pending attribute request for the response"));
+	broker.publish("v1/devices/me/attributes/response/2", "{\"shared\":{\"interval\":10}}");
+	tb.loop();
+	CHECK(outcome.calls == 1 && outcome.interval == 10 && tb.RPC_Requests_Pending() == 1);
+}
+
+static void test_table_full() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+
+	Outcome first, second, third;
+	CHECK(tb.Attributes_Request(ClientKeys, SharedKeys, record(first)));
+	CHECK(tb.Attributes_Request(ClientKeys, SharedKeys, record(second)));
+	CHECK(!tb.Attributes_Request(ClientKeys, SharedKeys, record(third)));
+	CHECK(Test_Logger::logged("too many attribute requests in flight"));
+	CHECK(broker.published.size() == 2);
+	CHECK(!tb.Attributes_Request(nullptr, 0, nullptr, 0, record(third)));
+}
+
+int main() {
+	RUN_TEST(test_responses_correlated);
+	RUN_TEST(test_timed_out);
+	RUN_TEST(test_unknown_response);
+	RUN_TEST(test_shared_request_ids);
+	RUN_TEST(test_table_full);
+	return testResult();
+}
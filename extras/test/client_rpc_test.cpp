@@ -0,0 +1,126 @@
+// Tests of client-side RPC requests against the scripted broker
+
+#define THINGSBOARD_MAX_CLIENT_RPC 2
+
+#include "test.h"
+#include "test_broker.h"
+#include <ThingsBoard.h>
+
+using ThingsBoard_Under_Test = ThingsBoardSized<128, 8, Test_Logger>;
+
+// Outcome of a request, as passed to its callback
+struct Outcome {
+	int         calls = 0;
+	bool        timeout = false;
+	std::string value;
+};
+
+static RPC_Request_Callback record(Outcome& outcome) {
+	return [&outcome](const RPC_Data& data, bool timeout) {
+		++outcome.calls;
+		outcome.timeout = timeout;
+		outcome.value = data["time"].as<const char*>() ? data["time"].as<const char*>() : "";
+	};
+}
+
+static void test_responses_correlated() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+
+	Outcome first, second;
+	const Telemetry params[] = { Telemetry("tz", "UTC") };
+	CHECK(tb.RPC_Request("getTime", record(first), params, 1));
+	CHECK(tb.RPC_Request("getTime", record(second)));
+	CHECK(broker.subscriptions.size() == 1 && broker.subscriptions[0] == "v1/devices/me/rpc/response/+");
+	CHECK(broker.published.size() == 2);
+	CHECK(broker.published[0].topic == "v1/devices/me/rpc/request/1");
+	CHECK(broker.published[0].payload == "{\"method\":\"getTime\",\"params\":{\"tz\":\"UTC\"}}");
+	CHECK(broker.published[1].topic == "v1/devices/me/rpc/request/2");
+	CHECK(broker.published[1].payload == "{\"method\":\"getTime\",\"params\":{}}");
+	CHECK(tb.RPC_Requests_Pending() == 2);
+
+	// Responses arrive out of order
+	broker.publish("v1/devices/me/rpc/response/2", "{\"time\":\"12:00\"}");
+	tb.loop();
+	CHECK(first.calls == 0 && second.calls == 1 && !second.timeout && second.value == "12:00");
+	broker.publish("v1/devices/me/rpc/response/1", "{\"time\":\"10:00\"}");
+	tb.loop();
+	CHECK(first.calls == 1 && !first.timeout && first.value == "10:00");
+	CHECK(tb.RPC_Requests_Pending() == 0);
+}
+
+static void test_timed_out() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+
+	Outcome answered, lost;
+	CHECK(tb.RPC_Request("getTime", record(answered), nullptr, 0, 1000));
+	CHECK(tb.RPC_Request("getTime", record(lost), nullptr, 0, 1000));
+	broker.publish("v1/devices/me/rpc/response/1", "{\"time\":\"10:00\"}");
+	tb.loop();
+	CHECK(answered.calls == 1 && !answered.timeout);
+
+	advanceMillis(999);
+	tb.loop();
+	CHECK(lost.calls == 0);
+	advanceMillis(2);
+	tb.loop();
+	CHECK(lost.calls == 1 && lost.timeout && lost.value.empty());
+	CHECK(Test_Logger::logged("client-side RPC timed out"));
+	CHECK(tb.RPC_Requests_Pending() == 0);
+
+	// Late response is dropped
+	broker.publish("v1/devices/me/rpc/response/2", "{\"time\":\"10:01\"}");
+	tb.loop();
+	CHECK(lost.calls == 1 && answered.calls == 1);
+	CHECK(Test_Logger::logged("no pending client-side RPC for the response"));
+}
+
+static void test_unknown_response() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+
+	Outcome outcome;
+	CHECK(tb.RPC_Request("getTime", record(outcome)));
+	broker.publish("v1/devices/me/rpc/response/7", "{\"time\":\"10:00\"}");
+	tb.loop();
+	CHECK(outcome.calls == 0 && tb.RPC_Requests_Pending() == 1);
+	CHECK(Test_Logger::logged("no pending client-side RPC for the response"));
+}
+
+static void test_table_full() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+
+	Outcome first, second, third;
+	CHECK(tb.RPC_Request("a", record(first)) && tb.RPC_Request("b", record(second)));
+	CHECK(!tb.RPC_Request("c", record(third)));
+	CHECK(Test_Logger::logged("too many client-side RPC requests in flight"));
+	CHECK(broker.published.size() == 2);
+
+	// Callback may send the next request, its entry is released already
+	broker.publish("v1/devices/me/rpc/response/1", "{}");
+	tb.loop();
+	CHECK(first.calls == 1);
+	Outcome next;
+	CHECK(tb.RPC_Request("d", [&](const RPC_Data&, bool) {
+		CHECK(tb.RPC_Request("e", record(next)));
+	}));
+	const std::string id = broker.published.back().topic.substr(sizeof("v1/devices/me/rpc/request/") - 1);
+	broker.publish("v1/devices/me/rpc/response/" + id, "{}");
+	tb.loop();
+	CHECK(broker.published.size() == 4 && broker.published[3].payload == "{\"method\":\"e\",\"params\":{}}");
+	CHECK(tb.RPC_Requests_Pending() == 2);
+}
+
+int main() {
+	RUN_TEST(test_responses_correlated);
+	RUN_TEST(test_timed_out);
+	RUN_TEST(test_unknown_response);
+	RUN_TEST(test_table_full);
+	return testResult();
+}
@@ -0,0 +1,146 @@
+// Tests of the connect state machine, driven by loop(), against a slow
+// scripted broker
+
+#define THINGSBOARD_QOS1_WINDOW 2
+
+#include "test.h"
+#include "test_broker.h"
+#include <ThingsBoard.h>
+
+using ThingsBoard_Under_Test = ThingsBoardSized<64, 8, Test_Logger>;
+
+static void test_connack_held_back() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.Connect_Status() == MQTT_STATE_DISCONNECTED);
+	CHECK(!tb.Connect_Begin(nullptr, "token"));
+
+	// Nothing is done on the network until loop()
+	CHECK(tb.Connect_Begin("broker", "token"));
+	CHECK(tb.Connect_Status() == MQTT_STATE_OPENING && broker.opens == 0);
+	CHECK(tb.sendTelemetry("a", 1) && tb.Publish_Pending() == 1);
+
+	broker.holdConnack = true;
+	tb.loop();
+	CHECK(broker.opens == 1 && broker.users.size() == 1 && broker.users[0] == "token");
+	CHECK(tb.Connect_Status() == MQTT_STATE_AWAITING_CONNACK && !tb.connected());
+
+	// Application keeps running while the server is slow
+	for (int i = 0; i < 100; ++i) {
+		tb.loop();
+		advanceMillis(100);
+	}
+	CHECK(tb.Connect_Status() == MQTT_STATE_AWAITING_CONNACK && broker.published.empty());
+
+	broker.release();
+	tb.loop();
+	CHECK(tb.Connect_Status() == MQTT_STATE_CONNECTED && tb.connected());
+
+	// Outbox is sent once connected
+	CHECK(broker.published.size() == 1 && broker.published[0].payload == "{\"a\":1}");
+}
+
+static void test_connack_split() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	broker.holdConnack = true;
+	CHECK(tb.Connect_Begin("broker", "token"));
+	tb.loop();
+
+	const std::string connack = broker.heldConnack;
+	for (size_t i = 0; i < connack.size(); ++i) {
+		CHECK(tb.Connect_Status() == MQTT_STATE_AWAITING_CONNACK);
+		broker.send(connack.substr(i, 1));
+		tb.loop();
+	}
+	CHECK(tb.Connect_Status() == MQTT_STATE_CONNECTED);
+}
+
+static void test_timeout() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	broker.holdConnack = true;
+	CHECK(tb.Connect_Begin("broker", "token"));
+	tb.loop();
+	advanceMillis(THINGSBOARD_MQTT_TIMEOUT - 1000);
+	tb.loop();
+	CHECK(tb.Connect_Status() == MQTT_STATE_AWAITING_CONNACK);
+	advanceMillis(1000);
+	tb.loop();
+	CHECK(tb.Connect_Status() == MQTT_STATE_CONNECTION_TIMEOUT);
+	CHECK(!tb.connected() && !broker.connected());
+
+	// Late CONNACK of the dropped connection is not taken
+	broker.release();
+	tb.loop();
+	CHECK(tb.Connect_Status() == MQTT_STATE_CONNECTION_TIMEOUT);
+}
+
+static void test_refused() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	broker.refuseConnects = 1;
+	CHECK(tb.Connect_Begin("broker", "token"));
+	tb.loop();
+	CHECK(tb.Connect_Status() == MQTT_STATE_CONNECT_FAILED && !tb.connected());
+
+	// Next attempt goes through
+	CHECK(tb.Connect_Begin("broker", "token"));
+	tb.loop();
+	tb.loop();
+	CHECK(tb.Connect_Status() == MQTT_STATE_CONNECTED && broker.opens == 2);
+}
+
+static void test_rejected() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	broker.rejectUser = "bad";
+	CHECK(tb.Connect_Begin("broker", "bad"));
+	tb.loop();
+	tb.loop();
+	CHECK(tb.Connect_Status() == MQTT_STATE_BAD_CREDENTIALS);
+	CHECK(!tb.connected() && !broker.connected());
+	CHECK(!tb.connect("broker", "bad"));
+	CHECK(tb.Connect_Status() == MQTT_STATE_BAD_CREDENTIALS);
+}
+
+static void test_disconnect_while_connecting() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.Connect_Begin("broker", "token"));
+	tb.disconnect();
+	tb.loop();
+	CHECK(tb.Connect_Status() == MQTT_STATE_DISCONNECTED && broker.opens == 0);
+
+	broker.holdConnack = true;
+	CHECK(tb.Connect_Begin("broker", "token"));
+	tb.loop();
+	CHECK(tb.Connect_Status() == MQTT_STATE_AWAITING_CONNACK);
+	tb.disconnect();
+	CHECK(tb.Connect_Status() == MQTT_STATE_DISCONNECTED && !broker.connected());
+	broker.release();
+	tb.loop();
+	CHECK(tb.Connect_Status() == MQTT_STATE_DISCONNECTED);
+}
+
+static void test_blocking_connect() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+	CHECK(tb.Connect_Status() == MQTT_STATE_CONNECTED);
+
+	// Connecting again while connected keeps the connection
+	CHECK(tb.connect("broker", "token"));
+	CHECK(broker.opens == 1);
+}
+
+int main() {
+	RUN_TEST(test_connack_held_back);
+	RUN_TEST(test_connack_split);
+	RUN_TEST(test_timeout);
+	RUN_TEST(test_refused);
+	RUN_TEST(test_rejected);
+	RUN_TEST(test_disconnect_while_connecting);
+	RUN_TEST(test_blocking_connect);
+	return testResult();
+}
@@ -0,0 +1,82 @@
+// Tests of packing telemetry of sub-devices into a single gateway message
+
+#define THINGSBOARD_ENABLE_GATEWAY
+#define THINGSBOARD_GATEWAY_BATCH 1000
+
+#include "test.h"
+#include "test_broker.h"
+#include <ThingsBoard.h>
+
+using ThingsBoard_Under_Test = ThingsBoardSized<128, 8, Test_Logger>;
+using Batch_Under_Test = Gateway_Batch<64, 4>;
+
+static bool append(Batch_Under_Test& batch, const char* device, const std::string& data) {
+	return batch.append(device, data.size(), [&data](char* out, size_t size) {
+		memcpy(out, data.data(), size);
+	});
+}
+
+static void test_devices_rendered_once() {
+	Batch_Under_Test batch;
+	CHECK(batch.empty());
+	CHECK(append(batch, "A", "{\"t\":1}") && append(batch, "B", "{\"h\":2}") && append(batch, "A", "{\"t\":3}"));
+	CHECK(!strcmp(batch.payload(), "{\"A\":[{\"t\":1},{\"t\":3}],\"B\":[{\"h\":2}]}"));
+}
+
+static void test_names_escaped() {
+	Batch_Under_Test batch;
+	CHECK(append(batch, "a\"b\\c", "{}") && append(batch, "d\ne\x01", "{}") && append(batch, "d\ne\x01", "{}"));
+	CHECK(!strcmp(batch.payload(), "{\"a\\\"b\\\\c\":[{}],\"d\\ne\\u0001\":[{},{}]}"));
+
+	// Payload is valid JSON with the original names
+	std::string payload = batch.payload();
+	StaticJsonDocument<JSON_OBJECT_SIZE(2) + 2 * JSON_ARRAY_SIZE(2)> document;
+	CHECK(!deserializeJson(document, &payload[0], payload.size()));
+	CHECK(document.containsKey("a\"b\\c") && document.containsKey("d\ne\x01"));
+}
+
+static void test_full_unchanged() {
+	Batch_Under_Test batch;
+	CHECK(append(batch, "Sensor 1", "{\"temperature\":21}"));
+	const std::string before = batch.payload();
+
+	// Telemetry of a known and of a new device, and too long name
+	CHECK(!append(batch, "Sensor 1", std::string("{\"t\":\"") + std::string(30, 'x') + "\"}"));
+	CHECK(batch.payload() == before);
+	CHECK(!append(batch, "Sensor 2", "{\"temperature\":22}"));
+	CHECK(batch.payload() == before);
+	CHECK(!append(batch, std::string(60, 'n').c_str(), "{}"));
+	CHECK(batch.payload() == before);
+
+	// Rest of the buffer is still usable
+	CHECK(append(batch, "S3", "{\"t\":1}"));
+	CHECK(batch.payload() == before.substr(0, before.size() - 1) + ",\"S3\":[{\"t\":1}]}");
+}
+
+static void test_sent_by_gateway() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+
+	CHECK(tb.Gateway_Send_Telemetry("Line\t1", "t", 1) && tb.Gateway_Send_Telemetry("Line\t1", "t", 2));
+	CHECK(broker.published.empty());
+	CHECK(tb.Gateway_Flush());
+	CHECK(broker.published.size() == 1 && broker.published[0].topic == "v1/gateway/telemetry");
+	CHECK(broker.published[0].payload == "{\"Line\\t1\":[{\"t\":1},{\"t\":2}]}");
+
+	// Batch, which would overflow, is sent first
+	for (int i = 0; i < 10; ++i)
+		CHECK(tb.Gateway_Send_Telemetry("Sensor", "temperature", 20 + i));
+	CHECK(tb.Gateway_Flush());
+	CHECK(broker.published.size() > 2);
+	for (const auto& message : broker.published)
+		CHECK(message.payload.size() < 128);
+}
+
+int main() {
+	RUN_TEST(test_devices_rendered_once);
+	RUN_TEST(test_names_escaped);
+	RUN_TEST(test_full_unchanged);
+	RUN_TEST(test_sent_by_gateway);
+	return testResult();
+}
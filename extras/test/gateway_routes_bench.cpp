@@ -0,0 +1,77 @@
+// Measures dispatch of gateway RPC requests to methods of 500 sub-devices
+// with 10 methods each: routing table against matching names one by one,
+// as a single Gateway_RPC_Subscribe() callback would
+
+#define THINGSBOARD_ENABLE_GATEWAY
+#define THINGSBOARD_GATEWAY_DEVICES 1024
+
+#include "test.h"
+#include <ThingsBoard.h>
+#include <chrono>
+#include <random>
+
+static const size_t Devices = 500;
+static const size_t MethodCount = 10;
+static const size_t Capacity = THINGSBOARD_GATEWAY_DEVICES;
+static const size_t Runs = 2000000;
+
+static RPC_Response answer(const char*, const RPC_Data&) {
+	return RPC_Response();
+}
+
+template <typename Function>
+static double nanosPerRun(size_t runs, Function function) {
+	const auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < runs; ++i)
+		function(i);
+	const auto elapsed = std::chrono::steady_clock::now() - start;
+	return std::chrono::duration<double, std::nano>(elapsed).count() / runs;
+}
+
+int main() {
+	std::vector<std::string> deviceNames;
+	for (size_t i = 0; i < Devices; ++i)
+		deviceNames.push_back("Building 3 sensor " + std::to_string(i));
+	std::vector<std::string> methodNames;
+	for (size_t i = 0; i < MethodCount; ++i)
+		methodNames.push_back("getMeasurement" + std::to_string(i));
+	std::vector<Gateway_RPC_Method> methods;
+	for (const std::string& name : methodNames)
+		methods.push_back(Gateway_RPC_Method(name.c_str(), answer));
+
+	static Gateway_RPC_Routes<Capacity> routes;
+	for (const std::string& name : deviceNames)
+		routes.add(name.c_str(), methods.data(), methods.size());
+
+	// Requests for random devices and methods, names copied like they are
+	// by de-serialization of the request
+	std::mt19937 random(1);
+	std::vector<std::pair<std::string, std::string>> requests;
+	for (size_t i = 0; i < 4096; ++i)
+		requests.push_back({ deviceNames[random() % Devices], methodNames[random() % MethodCount] });
+
+	size_t found = 0;
+	const double table = nanosPerRun(Runs, [&](size_t i) {
+		const auto& request = requests[i % requests.size()];
+		found += routes.find(request.first.c_str(), request.second.c_str()) != nullptr;
+	});
+	const double linear = nanosPerRun(Runs / 50, [&](size_t i) {
+		const auto& request = requests[i % requests.size()];
+		for (const std::string& device : deviceNames) {
+			if (strcmp(device.c_str(), request.first.c_str()))
+				continue;
+			for (const std::string& method : methodNames) {
+				if (!strcmp(method.c_str(), request.second.c_str())) {
+					++found;
+					break;
+				}
+			}
+			break;
+		}
+	});
+
+	printf("%zu devices x %zu methods, table of %zu slots (%zu bytes)\n", Devices, MethodCount, Capacity, sizeof(routes));
+	printf("routing table     %8.1f ns per request\n", table);
+	printf("names one by one  %8.1f ns per request\n", linear);
+	return found ? 0 : 1;
+}
@@ -0,0 +1,87 @@
+// Tests of the routing table of gateway RPC methods
+
+#define THINGSBOARD_ENABLE_GATEWAY
+#define THINGSBOARD_GATEWAY_DEVICES 16
+
+#include "test.h"
+#include <ThingsBoard.h>
+#include <random>
+#include <set>
+
+static RPC_Response answer(const char*, const RPC_Data&) {
+	return RPC_Response();
+}
+
+static const Gateway_RPC_Method Methods[] = {
+	Gateway_RPC_Method("get", answer),
+	Gateway_RPC_Method("set", answer),
+};
+
+static void test_find() {
+	Gateway_RPC_Routes<8> routes;
+	CHECK(routes.add("Relay 1", Methods, 2) && routes.add("Relay 2", Methods, 1));
+	const Gateway_RPC_Routes<8>& constRoutes = routes;
+	CHECK(constRoutes.find("Relay 1", "set") == &Methods[1]);
+	CHECK(constRoutes.find("Relay 2", "get") == &Methods[0]);
+	CHECK(!constRoutes.find("Relay 2", "set") && !constRoutes.find("Relay 3", "get"));
+
+	// Methods are replaced, not added twice
+	CHECK(routes.add("Relay 2", Methods, 2) && routes.size() == 2);
+	CHECK(constRoutes.find("Relay 2", "set") == &Methods[1]);
+	CHECK(routes.remove("Relay 1") && !routes.remove("Relay 1"));
+	CHECK(!constRoutes.find("Relay 1", "get") && routes.size() == 1);
+}
+
+static void test_full() {
+	Gateway_RPC_Routes<4> routes;
+	const char* const names[] = { "a", "b", "c", "d", "e" };
+	for (size_t i = 0; i < 4; ++i)
+		CHECK(routes.add(names[i], Methods, 2));
+	CHECK(!routes.add(names[4], Methods, 2));
+
+	// Slot of a removed device is taken by the next one
+	CHECK(routes.remove("b") && routes.add("e", Methods, 2));
+	for (const char* name : { "a", "c", "d", "e" })
+		CHECK(routes.find(name, "get"));
+}
+
+static void test_churn() {
+	// Devices come and go, so removed slots are left behind and reclaimed
+	// all over the table, which must keep finding every routed device
+	Gateway_RPC_Routes<THINGSBOARD_GATEWAY_DEVICES> routes;
+	std::vector<std::string> names;
+	for (int i = 0; i < 40; ++i)
+		names.push_back("Sensor " + std::to_string(i));
+	std::set<size_t> routed;
+	std::mt19937 random(1);
+
+	for (int step = 0; step < 20000; ++step) {
+		const size_t device = random() % names.size();
+		if (routed.count(device)) {
+			CHECK(routes.remove(names[device].c_str()));
+			routed.erase(device);
+		}
+		else if (routed.size() < THINGSBOARD_GATEWAY_DEVICES * 3 / 4) {
+			CHECK(routes.add(names[device].c_str(), Methods, 2));
+			routed.insert(device);
+		}
+		CHECK(routes.size() == routed.size());
+		for (size_t i = 0; i < names.size(); ++i)
+			CHECK(!routes.find(names[i].c_str(), "get") == !routed.count(i));
+	}
+
+	// Table is usable to the last slot once everything is removed
+	for (size_t device : routed)
+		CHECK(routes.remove(names[device].c_str()));
+	for (size_t i = 0; i < THINGSBOARD_GATEWAY_DEVICES; ++i)
+		CHECK(routes.add(names[i].c_str(), Methods, 2));
+	for (size_t i = 0; i < THINGSBOARD_GATEWAY_DEVICES; ++i)
+		CHECK(routes.find(names[i].c_str(), "set") == &Methods[1]);
+}
+
+int main() {
+	RUN_TEST(test_find);
+	RUN_TEST(test_full);
+	RUN_TEST(test_churn);
+	return testResult();
+}
@@ -0,0 +1,81 @@
+// Tests of the firmware update over HTTP against scripted responses
+
+#define THINGSBOARD_ENABLE_OTA
+
+#include "test.h"
+#include "test_broker.h"
+#include "test_firmware.h"
+#include <ArduinoHttpClient.h>
+
+// Smallest payload size, firmware information is larger than it
+using ThingsBoard_Under_Test = ThingsBoardHttpSized<64, 8, Test_Logger>;
+
+static const size_t ChunkSize = 2000;
+
+static std::string sha256(const std::string& data) {
+	OTA_SHA256 sha;
+	sha.update(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+	uint8_t digest[32];
+	sha.finish(digest);
+	std::string hex;
+	for (uint8_t byte : digest) {
+		char part[3];
+		snprintf(part, sizeof(part), "%02x", byte);
+		hex += part;
+	}
+	return hex;
+}
+
+// Queues responses to the whole update: information, chunks and states
+static void scriptUpdate(const std::string& image, const std::string& title, const std::string& version) {
+	HttpClient::requests().clear();
+	HttpClient::responses().clear();
+	HttpClient::responses().push_back({ 200, "{\"shared\":{\"fw_title\":\"" + title + "\",\"fw_version\":\"" + version
+		+ "\",\"fw_size\":" + std::to_string(image.size()) + ",\"fw_checksum_algorithm\":\"SHA256\""
+		+ ",\"fw_checksum\":\"" + sha256(image) + "\"}}" });
+	HttpClient::responses().push_back({ 200, "" });
+	for (size_t offset = 0; offset < image.size(); offset += ChunkSize)
+		HttpClient::responses().push_back({ 200, image.substr(offset, ChunkSize) });
+	HttpClient::responses().push_back({ 200, "" });
+	HttpClient::responses().push_back({ 200, "" });
+}
+
+static void test_information_larger_than_payload() {
+	Test_Broker network;
+	ThingsBoard_Under_Test tb(network, "token", "server");
+	const std::string image = randomImage(5000, 1);
+	const std::string path = tempPath("image.bin");
+	File_OTA_Sink sink(path.c_str());
+
+	scriptUpdate(image, "app", "2.0");
+	CHECK(HttpClient::responses().front().body.size() > 128);
+	CHECK(tb.OTA_Update("app", "1.0", sink, ChunkSize) == OTA_UPDATED);
+	CHECK(readFile(path) == image);
+	CHECK(HttpClient::responses().empty());
+	remove(path.c_str());
+}
+
+static void test_query_encoded() {
+	Test_Broker network;
+	ThingsBoard_Under_Test tb(network, "token", "server");
+	const std::string image = randomImage(3000, 2);
+	const std::string path = tempPath("image.bin");
+	File_OTA_Sink sink(path.c_str());
+
+	scriptUpdate(image, "Greenhouse app/v2", "2.0 beta+1&x=y");
+	CHECK(tb.OTA_Update("Greenhouse app/v2", "1.0", sink, ChunkSize) == OTA_UPDATED);
+	const std::vector<std::string>& requests = HttpClient::requests();
+	CHECK(requests.size() == 6);
+	CHECK(requests[2] == "GET /api/v1/token/firmware?title=Greenhouse%20app%2Fv2&version=2.0%20beta%2B1%26x%3Dy"
+		"&size=2000&chunk=0");
+	CHECK(requests[3] == "GET /api/v1/token/firmware?title=Greenhouse%20app%2Fv2&version=2.0%20beta%2B1%26x%3Dy"
+		"&size=2000&chunk=1");
+	CHECK(readFile(path) == image);
+	remove(path.c_str());
+}
+
+int main() {
+	RUN_TEST(test_information_larger_than_payload);
+	RUN_TEST(test_query_encoded);
+	return testResult();
+}
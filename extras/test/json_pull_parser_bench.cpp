@@ -0,0 +1,72 @@
+// Compares the streaming JSON pull-parser with ArduinoJson on RPC params of
+// 1 KB and 8 KB: time per document and memory needed besides the payload
+
+#include "test.h"
+#include <ThingsBoard.h>
+#include <chrono>
+
+// Schedule of entries like those sent to a device by a configuration RPC
+static std::string makeParams(size_t size, size_t& entries) {
+	std::string json = "{\"schedule\":[";
+	entries = 0;
+	while (json.size() + 64 < size) {
+		if (entries)
+			json += ',';
+		json += "{\"hour\":" + std::to_string(entries % 24) + ",\"level\":" + std::to_string(entries * 7 % 100)
+			+ ",\"mode\":\"auto\",\"on\":true}";
+		++entries;
+	}
+	json += "]}";
+	return json;
+}
+
+template <typename Function>
+static double nanosPerRun(size_t runs, Function function) {
+	const auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < runs; ++i)
+		function();
+	const auto elapsed = std::chrono::steady_clock::now() - start;
+	return std::chrono::duration<double, std::nano>(elapsed).count() / runs;
+}
+
+static void bench(size_t size) {
+	size_t entries = 0;
+	const std::string json = makeParams(size, entries);
+	std::vector<char> buffer(json.size());
+	const size_t runs = 2000000 / json.size();
+	volatile int64_t sink = 0;
+
+	const double pull = nanosPerRun(runs, [&]() {
+		memcpy(buffer.data(), json.data(), json.size());
+		JSON_Pull_Parser parser(buffer.data(), buffer.size());
+		int64_t sum = 0;
+		while (parser.next()) {
+			if (parser.keyEquals("level"))
+				sum += parser.integer();
+		}
+		sink = sink + sum;
+	});
+
+	// Every entry is an object of 4 members inside the array
+	const size_t capacity = JSON_OBJECT_SIZE(1) + JSON_ARRAY_SIZE(entries) + entries * JSON_OBJECT_SIZE(4);
+	DynamicJsonDocument doc(capacity);
+	const double tree = nanosPerRun(runs, [&]() {
+		memcpy(buffer.data(), json.data(), json.size());
+		if (deserializeJson(doc, buffer.data(), buffer.size()))
+			return;
+		int64_t sum = 0;
+		JsonArray schedule = doc["schedule"];
+		for (JsonObject entry : schedule)
+			sum += entry["level"].as<int64_t>();
+		sink = sink + sum;
+	});
+
+	printf("%5zu bytes, %3zu entries: JSON_Pull_Parser %8.0f ns, %3zu bytes | ArduinoJson %8.0f ns, %5zu bytes\n",
+		json.size(), entries, pull, sizeof(JSON_Pull_Parser), tree, capacity);
+}
+
+int main() {
+	bench(1024);
+	bench(8192);
+	return 0;
+}
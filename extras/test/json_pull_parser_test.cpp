@@ -0,0 +1,105 @@
+// Tests of the streaming JSON pull-parser
+
+#include "test.h"
+#include <ThingsBoard.h>
+
+// Parses a single value, returning the parser positioned at it
+static JSON_Pull_Parser parseValue(std::string& json) {
+	JSON_Pull_Parser parser(&json[0], json.size());
+	CHECK(parser.next());
+	return parser;
+}
+
+static void test_events() {
+	std::string json = "{\"a\":[1,true,null],\"s\":\"x\\ny\",\"o\":{\"n\":-2.5}}";
+	JSON_Pull_Parser parser(&json[0], json.size());
+	const JSON_Pull_Parser::Event events[] = {
+		JSON_Pull_Parser::EVENT_BEGIN_OBJECT, JSON_Pull_Parser::EVENT_BEGIN_ARRAY,
+		JSON_Pull_Parser::EVENT_NUMBER, JSON_Pull_Parser::EVENT_BOOL, JSON_Pull_Parser::EVENT_NULL,
+		JSON_Pull_Parser::EVENT_END_ARRAY, JSON_Pull_Parser::EVENT_STRING,
+		JSON_Pull_Parser::EVENT_BEGIN_OBJECT, JSON_Pull_Parser::EVENT_NUMBER,
+		JSON_Pull_Parser::EVENT_END_OBJECT, JSON_Pull_Parser::EVENT_END_OBJECT,
+	};
+	for (JSON_Pull_Parser::Event event : events) {
+		CHECK(parser.next() && parser.event() == event);
+		if (parser.keyEquals("s"))
+			CHECK(parser.stringEquals("x\ny") && parser.stringLength() == 3);
+		if (parser.keyEquals("n"))
+			CHECK(parser.number() == -2.5 && !parser.isInteger() && parser.integer() == -2);
+	}
+	CHECK(!parser.next() && !parser.error());
+}
+
+static void test_integers() {
+	std::string json = "9223372036854775807";
+	JSON_Pull_Parser parser = parseValue(json);
+	CHECK(parser.isInteger() && parser.integer() == INT64_MAX);
+
+	json = "-9223372036854775808";
+	parser = parseValue(json);
+	CHECK(parser.isInteger() && parser.integer() == INT64_MIN);
+
+	json = "-0";
+	parser = parseValue(json);
+	CHECK(parser.isInteger() && parser.integer() == 0);
+}
+
+static void test_integer_overflow() {
+	// One past the limits
+	std::string json = "9223372036854775808";
+	JSON_Pull_Parser parser = parseValue(json);
+	CHECK(!parser.isInteger() && parser.integer() == INT64_MAX);
+
+	json = "-9223372036854775809";
+	parser = parseValue(json);
+	CHECK(!parser.isInteger() && parser.integer() == INT64_MIN);
+
+	// Far more digits, than fit into the counter of digits of a byte
+	json = std::string(300, '9');
+	parser = parseValue(json);
+	CHECK(!parser.isInteger() && parser.integer() == INT64_MAX);
+	CHECK(parser.number() > 1e299);
+
+	json = "-" + std::string(300, '1');
+	parser = parseValue(json);
+	CHECK(!parser.isInteger() && parser.integer() == INT64_MIN);
+
+	// Exponent out of range of the integer
+	json = "1e30";
+	parser = parseValue(json);
+	CHECK(!parser.isInteger() && parser.integer() == INT64_MAX);
+	json = "-1.5e9999";
+	parser = parseValue(json);
+	CHECK(parser.integer() == INT64_MIN);
+	json = "1e-9999";
+	parser = parseValue(json);
+	CHECK(parser.number() == 0 && parser.integer() == 0);
+}
+
+static void test_malformed() {
+	const char* documents[] = { "{\"a\":}", "[1,]", "-", "1.", "1e", "{\"a\" 1}", "\"abc", "[1 2]" };
+	for (const char* document : documents) {
+		std::string json = document;
+		JSON_Pull_Parser parser(&json[0], json.size());
+		while (parser.next()) { }
+		CHECK(parser.error());
+	}
+}
+
+static void test_skip() {
+	std::string json = "{\"big\":{\"a\":[1,2,{\"b\":3}]},\"after\":7}";
+	JSON_Pull_Parser parser(&json[0], json.size());
+	CHECK(parser.next() && parser.next() && parser.keyEquals("big"));
+	parser.skip();
+	CHECK(parser.next() && parser.keyEquals("after") && parser.integer() == 7);
+	CHECK(parser.next() && parser.event() == JSON_Pull_Parser::EVENT_END_OBJECT);
+}
+
+int main() {
+	RUN_TEST(test_events);
+	RUN_TEST(test_integers);
+	RUN_TEST(test_integer_overflow);
+	RUN_TEST(test_malformed);
+	RUN_TEST(test_skip);
+	return testResult();
+}
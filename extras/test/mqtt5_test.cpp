@@ -0,0 +1,94 @@
+// Tests of MQTT 5 CONNACK properties and topic aliases against the scripted
+// broker
+
+#define THINGSBOARD_ENABLE_MQTT5
+#define THINGSBOARD_QOS1_WINDOW 4
+
+#include "test.h"
+#include "test_broker.h"
+#include <ThingsBoard.h>
+
+using ThingsBoard_Under_Test = ThingsBoardSized<64, 8, Test_Logger>;
+using Client_Under_Test = MQTT_Client<256, Test_Logger>;
+
+// Telemetry payload of 30 bytes
+static const char* const Payload = "{\"temperature\":21.5,\"rh\":40.1}";
+
+static void test_server_keep_alive() {
+	Test_Broker broker;
+	Client_Under_Test client(broker);
+	broker.serverKeepAlive = 4 * THINGSBOARD_MQTT_KEEPALIVE;
+	client.setServer("broker", 1883);
+	CHECK(client.connect("TbDev", "token", nullptr));
+
+	// Keep alive of the server is used instead of ours
+	advanceMillis(THINGSBOARD_MQTT_KEEPALIVE * 1000UL + 1);
+	CHECK(client.loop() && broker.pings == 0);
+	advanceMillis(3 * THINGSBOARD_MQTT_KEEPALIVE * 1000UL);
+	CHECK(client.loop() && broker.pings == 1);
+
+	// Ours again on the next connection, where the server sets none
+	client.disconnect();
+	broker.serverKeepAlive = 0;
+	CHECK(client.connect("TbDev", "token", nullptr));
+	advanceMillis(THINGSBOARD_MQTT_KEEPALIVE * 1000UL + 1);
+	CHECK(client.loop() && broker.pings == 2);
+}
+
+static void test_receive_maximum() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	broker.receiveMaximum = 2;
+	CHECK(tb.connect("broker", "token"));
+
+	// Window of 4 is limited to 2 messages in flight
+	for (int i = 0; i < 4; ++i)
+		CHECK(tb.sendTelemetry("a", i));
+	tb.loop();
+	CHECK(broker.published.size() == 2 && tb.Publish_Pending() == 4);
+	broker.ack(broker.published[0].packetId);
+	tb.loop();
+	CHECK(broker.published.size() == 3);
+
+	// Server without the limit gets the whole window
+	broker.drop();
+	tb.loop();
+	broker.receiveMaximum = 0;
+	broker.published.clear();
+	CHECK(tb.connect("broker", "token"));
+	tb.loop();
+	CHECK(broker.published.size() == 3);
+}
+
+static void test_message_size() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+	CHECK(strlen(Payload) == 30);
+
+	// QoS 1: topic is sent once, then only its alias
+	CHECK(tb.sendTelemetryJson(Payload) && tb.sendTelemetryJson(Payload));
+	CHECK(broker.published.size() == 2 && broker.published[1].aliased);
+	CHECK(broker.published[0].size == 63 && broker.published[1].size == 40);
+
+	// QoS 0, as the client publishes RPC responses and without the outbox
+	Test_Broker plain;
+	Client_Under_Test client(plain);
+	static const char* const topics[] = { "v1/devices/me/telemetry" };
+	client.setTopicAliases(topics, 1);
+	client.setServer("broker", 1883);
+	CHECK(client.connect("TbDev", "token", nullptr));
+	CHECK(client.publish(topics[0], Payload) && client.publish(topics[0], Payload));
+	CHECK(plain.published.size() == 2 && plain.published[0].size == 61 && plain.published[1].size == 38);
+
+	// MQTT 3.1.1 sends 2 + 23 bytes of topic with every message
+	printf("30 byte telemetry: MQTT 3.1.1 %d bytes at QoS 0, %d at QoS 1; MQTT 5 aliased %zu, %zu\n",
+		2 + 2 + 23 + 30, 2 + 2 + 23 + 2 + 30, plain.published[1].size, broker.published[1].size);
+}
+
+int main() {
+	RUN_TEST(test_server_keep_alive);
+	RUN_TEST(test_receive_maximum);
+	RUN_TEST(test_message_size);
+	return testResult();
+}
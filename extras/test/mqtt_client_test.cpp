@@ -0,0 +1,240 @@
+// Tests of the built-in MQTT 3.1.1 client against the scripted broker
+
+#include "test.h"
+#include "test_broker.h"
+#include <ThingsBoard.h>
+
+using Client_Under_Test = MQTT_Client<256, Test_Logger>;
+
+struct Received {
+	std::vector<std::string> topics;
+	std::vector<std::string> payloads;
+};
+
+static bool connect(Client_Under_Test& client, Received& received) {
+	client.setServer("broker", 1883);
+	client.setCallback([&received](char* topic, uint8_t* payload, unsigned int length) {
+		received.topics.push_back(topic);
+		received.payloads.push_back(std::string(reinterpret_cast<char*>(payload), length));
+	});
+	return client.connect("TbDev", "token", nullptr);
+}
+
+static void test_connect_encoding() {
+	Test_Broker broker;
+	Client_Under_Test client(broker);
+	Received received;
+	CHECK(connect(client, received));
+	CHECK(client.connected() && client.state() == MQTT_STATE_CONNECTED);
+
+	// Protocol MQTT level 4, clean session with user name, keep alive 15 s
+	const std::string body = std::string("\x00\x04MQTT\x04\x82\x00\x0F", 10)
+		+ Test_Broker::string("TbDev") + Test_Broker::string("token");
+	CHECK(broker.packets.size() == 1 && broker.packets[0] == Test_Broker::packet(0x10, body));
+}
+
+static void test_connect_refused() {
+	Test_Broker broker;
+	Client_Under_Test client(broker);
+	Received received;
+	broker.connackCode = 5;
+	CHECK(!connect(client, received));
+	CHECK(client.state() == MQTT_STATE_UNAUTHORIZED && !broker.connected());
+
+	broker.connackCode = 0;
+	broker.refuseConnects = 1;
+	CHECK(!client.connect("TbDev", "token", nullptr));
+	CHECK(client.state() == MQTT_STATE_CONNECT_FAILED);
+}
+
+static void test_publish_encoding() {
+	Test_Broker broker;
+	Client_Under_Test client(broker);
+	Received received;
+	CHECK(connect(client, received));
+
+	CHECK(client.publish("t", "{}"));
+	CHECK(broker.packets.back() == Test_Broker::packet(0x30, Test_Broker::string("t") + "{}"));
+
+	// QoS 1, sent again with dup
+	const uint8_t payload[] = { '1' };
+	CHECK(client.publish("t", payload, sizeof(payload), 0x1234, true));
+	CHECK(broker.packets.back() == Test_Broker::packet(0x3A, Test_Broker::string("t") + "\x12\x34" + "1"));
+
+	// Remaining length of two bytes
+	const std::string large(200, 'x');
+	CHECK(client.publish("topic", large.c_str()));
+	const std::string& packet = broker.packets.back();
+	CHECK(packet.size() == 3 + 7 + large.size());
+	CHECK(static_cast<uint8_t>(packet[1]) == ((7 + large.size()) % 128 | 0x80) && packet[2] == 1);
+	CHECK(broker.published.back().payload == large);
+
+	// Does not fit the send buffer
+	const std::string tooLarge(256, 'x');
+	CHECK(!client.publish("topic", tooLarge.c_str()));
+	CHECK(client.connected());
+}
+
+static void test_subscribe_encoding() {
+	Test_Broker broker;
+	Client_Under_Test client(broker);
+	Received received;
+	CHECK(connect(client, received));
+
+	CHECK(client.subscribe("a/+"));
+	const std::string subscribe = broker.packets.back();
+	CHECK(subscribe.size() == 2 + 2 + 5 + 1 && static_cast<uint8_t>(subscribe[0]) == 0x82);
+	CHECK(subscribe.substr(4) == Test_Broker::string("a/+") + '\0');
+	CHECK(client.unsubscribe("a/+"));
+	CHECK(broker.subscriptions.back() == "a/+" && broker.unsubscriptions.back() == "a/+");
+
+	// SUBACK and UNSUBACK are consumed quietly
+	CHECK(client.loop() && broker.pending() == 0);
+}
+
+static void test_receive_split() {
+	Test_Broker broker;
+	Client_Under_Test client(broker);
+	Received received;
+	CHECK(connect(client, received));
+
+	// Packet arrives in pieces, split inside the fixed header too
+	const std::string packet = Test_Broker::packet(0x30, Test_Broker::string("v1/x") + std::string(100, 'p'));
+	const size_t cuts[] = { 1, 2, 9, 60, packet.size() };
+	size_t sent = 0;
+	for (size_t cut : cuts) {
+		CHECK(received.topics.empty());
+		broker.send(packet.substr(sent, cut - sent));
+		sent = cut;
+		CHECK(client.loop());
+	}
+	CHECK(received.topics.size() == 1 && received.topics[0] == "v1/x");
+	CHECK(received.payloads[0] == std::string(100, 'p'));
+
+	// Several packets read by one loop
+	broker.publish("a", "1");
+	broker.publish("b", "2");
+	CHECK(client.loop());
+	CHECK(received.topics.size() == 3 && received.topics[2] == "b" && received.payloads[2] == "2");
+}
+
+static void test_receive_two_byte_length() {
+	Test_Broker broker;
+	Client_Under_Test client(broker);
+	Received received;
+	CHECK(connect(client, received));
+
+	const std::string payload(200, 'z');
+	broker.publish("v1/devices/me/rpc/request/1", payload);
+	CHECK(client.loop());
+	CHECK(received.payloads.size() == 1 && received.payloads[0] == payload);
+	CHECK(received.topics[0] == "v1/devices/me/rpc/request/1");
+}
+
+static void test_receive_oversized() {
+	Test_Broker broker;
+	Client_Under_Test client(broker);
+	Received received;
+	CHECK(connect(client, received));
+	Test_Logger::messages().clear();
+
+	// Skipped as a whole, even if it arrives in pieces
+	const std::string packet = Test_Broker::packet(0x30, Test_Broker::string("big") + std::string(1000, 'b'));
+	broker.send(packet.substr(0, 500));
+	CHECK(client.loop());
+	CHECK(Test_Logger::logged("received packet too large, skipped"));
+	broker.send(packet.substr(500));
+	broker.publish("small", "s");
+	CHECK(client.loop());
+	CHECK(received.topics.size() == 1 && received.topics[0] == "small" && received.payloads[0] == "s");
+	CHECK(client.connected() && Test_Logger::messages().empty());
+
+	// Remaining length of more than 4 bytes is a protocol error
+	broker.send(std::string("\x30\xFF\xFF\xFF\xFF\x01", 6));
+	CHECK(!client.loop());
+	CHECK(client.state() == MQTT_STATE_BAD_PROTOCOL);
+}
+
+static void test_keep_alive() {
+	Test_Broker broker;
+	Client_Under_Test client(broker);
+	Received received;
+	CHECK(connect(client, received));
+
+	// Nothing is sent while the connection is busy
+	CHECK(client.loop() && broker.pings == 0);
+	advanceMillis(THINGSBOARD_MQTT_KEEPALIVE * 1000UL + 1);
+	CHECK(client.loop() && broker.pings == 1);
+	CHECK(client.loop() && broker.pings == 1);
+
+	// PINGRESP arrived, so the next silence only sends another ping
+	advanceMillis(THINGSBOARD_MQTT_KEEPALIVE * 1000UL + 1);
+	CHECK(client.loop() && broker.pings == 2);
+
+	// Server stopped answering
+	broker.answerPings = false;
+	advanceMillis(THINGSBOARD_MQTT_KEEPALIVE * 1000UL + 1);
+	CHECK(client.loop() && broker.pings == 3);
+	advanceMillis(THINGSBOARD_MQTT_KEEPALIVE * 1000UL + 1);
+	CHECK(!client.loop());
+	CHECK(client.state() == MQTT_STATE_CONNECTION_TIMEOUT && !broker.connected());
+}
+
+static void test_qos1_incoming() {
+	Test_Broker broker;
+	Client_Under_Test client(broker);
+	Received received;
+	CHECK(connect(client, received));
+
+	broker.publish("v1/devices/me/attributes", "{\"a\":1}", 1, 7);
+	CHECK(client.loop());
+	CHECK(received.payloads.size() == 1 && received.payloads[0] == "{\"a\":1}");
+	CHECK(broker.acks.size() == 1 && broker.acks[0] == 7);
+	CHECK(broker.packets.back() == Test_Broker::packet(0x40, Test_Broker::id(7)));
+}
+
+static void test_puback() {
+	Test_Broker broker;
+	Client_Under_Test client(broker);
+	Received received;
+	std::vector<uint16_t> acked;
+	client.setAckCallback([&acked](uint16_t packetId) { acked.push_back(packetId); });
+	CHECK(connect(client, received));
+
+	broker.ack(3);
+	broker.ack(1);
+	CHECK(client.loop());
+	CHECK(acked.size() == 2 && acked[0] == 3 && acked[1] == 1);
+}
+
+static void test_connection_lost() {
+	Test_Broker broker;
+	Client_Under_Test client(broker);
+	Received received;
+	CHECK(connect(client, received));
+
+	broker.drop();
+	CHECK(!client.loop());
+	CHECK(client.state() == MQTT_STATE_CONNECTION_LOST);
+	CHECK(!client.publish("t", "{}"));
+
+	CHECK(client.connect("TbDev", "token", nullptr));
+	client.disconnect();
+	CHECK(client.state() == MQTT_STATE_DISCONNECTED);
+	CHECK(broker.packets.back() == Test_Broker::packet(0xE0, ""));
+}
+
+int main() {
+	RUN_TEST(test_connect_encoding);
+	RUN_TEST(test_connect_refused);
+	RUN_TEST(test_publish_encoding);
+	RUN_TEST(test_subscribe_encoding);
+	RUN_TEST(test_receive_split);
+	RUN_TEST(test_receive_two_byte_length);
+	RUN_TEST(test_receive_oversized);
+	RUN_TEST(test_keep_alive);
+	RUN_TEST(test_qos1_incoming);
+	RUN_TEST(test_puback);
+	RUN_TEST(test_connection_lost);
+	return testResult();
+}
@@ -0,0 +1,90 @@
+// Round trip of delta updates: patches made by extras/make_delta.py are
+// downloaded through OTA_Delta_Sink and the result is compared byte by byte
+// with the new image, reporting bytes transferred against the full image
+
+#define THINGSBOARD_ENABLE_OTA
+
+#include "test.h"
+#include "test_broker.h"
+#include "test_firmware.h"
+
+using ThingsBoard_Under_Test = ThingsBoardSized<256, 8, Test_Logger>;
+
+// Downloads the patch from current to next image and checks the result.
+// Returns amount of bytes transferred, 0 if the update failed.
+static size_t roundTrip(const char* name, const std::string& current, const std::string& next) {
+	const std::string patch = makeDelta(current, next);
+	CHECK(!patch.empty());
+	const std::string currentPath = tempPath("current.bin");
+	const std::string imagePath = tempPath("image.bin");
+	writeFile(currentPath, current);
+
+	Test_Broker broker;
+	Test_Firmware_Server server(broker, patch);
+	ThingsBoard_Under_Test tb(broker);
+	File_OTA_Sink file(imagePath.c_str());
+	File_OTA_Source source(currentPath.c_str());
+	OTA_Delta_Sink delta(file, source);
+	bool finished = false;
+	OTA_Result result = OTA_FAILED;
+	CHECK(tb.connect("broker", "token"));
+	CHECK(tb.OTA_Start("fw", "1.0", delta, [&](OTA_Result r) { finished = true; result = r; }, 200));
+	for (int i = 0; i < 1000 && !finished; ++i)
+		tb.loop();
+
+	const bool updated = finished && result == OTA_UPDATED && readFile(imagePath) == next;
+	CHECK(updated);
+	printf("%-24s image %6zu bytes, transferred %6zu bytes (%5.1f%%)\n", name, next.size(), server.bytesSent,
+		100.0 * server.bytesSent / next.size());
+	fflush(stdout);
+	remove(currentPath.c_str());
+	remove(imagePath.c_str());
+	return updated ? server.bytesSent : 0;
+}
+
+static void test_scattered_changes() {
+	const std::string current = randomImage(64000, 1);
+	std::string next = current;
+	for (size_t i = 500; i < next.size(); i += 4000)
+		next[i] = static_cast<char>(next[i] ^ 0x5A);
+	const size_t sent = roundTrip("scattered changes", current, next);
+	CHECK(sent && sent < next.size() / 10);
+}
+
+static void test_inserted_and_removed() {
+	// Code moves: a block is inserted, another one removed
+	const std::string current = randomImage(64000, 2);
+	const std::string next = current.substr(0, 10000) + randomImage(700, 3) + current.substr(10000, 30000)
+		+ current.substr(41000);
+	const size_t sent = roundTrip("inserted and removed", current, next);
+	CHECK(sent && sent < next.size() / 10);
+}
+
+static void test_grown() {
+	const std::string current = randomImage(32000, 4);
+	const std::string next = current + randomImage(8000, 5);
+	const size_t sent = roundTrip("grown", current, next);
+	CHECK(sent && sent < 8000 + next.size() / 10);
+}
+
+static void test_unchanged() {
+	const std::string current = randomImage(32000, 6);
+	const size_t sent = roundTrip("unchanged", current, current);
+	CHECK(sent && sent < current.size() / 100);
+}
+
+static void test_unrelated() {
+	// Nothing to reuse, patch is about the size of the image
+	const std::string next = randomImage(16000, 8);
+	const size_t sent = roundTrip("unrelated", randomImage(16000, 7), next);
+	CHECK(sent && sent < next.size() + next.size() / 20);
+}
+
+int main() {
+	RUN_TEST(test_scattered_changes);
+	RUN_TEST(test_inserted_and_removed);
+	RUN_TEST(test_grown);
+	RUN_TEST(test_unchanged);
+	RUN_TEST(test_unrelated);
+	return testResult();
+}
@@ -0,0 +1,207 @@
+// Tests of the pipelined firmware chunk download against the firmware server
+
+#define THINGSBOARD_ENABLE_OTA
+#define THINGSBOARD_OTA_WINDOW 4
+
+#include "test.h"
+#include "test_broker.h"
+#include "test_firmware.h"
+
+using ThingsBoard_Under_Test = ThingsBoardSized<128, 8, Test_Logger>;
+
+static const size_t ChunkSize = 100;
+
+// Firmware update with its image file and result
+struct Update {
+	Update(Test_Broker& broker, const std::string& image)
+		:server(broker, image), path(tempPath("image.bin")), sink(path.c_str()), finished(false), result(OTA_FAILED) {
+		server.holdChunks = true;
+	}
+
+	~Update() {
+		remove(path.c_str());
+	}
+
+	bool start(ThingsBoard_Under_Test& tb) {
+		return tb.OTA_Start("fw", "1.0", sink, [this](OTA_Result r) { finished = true; result = r; }, ChunkSize);
+	}
+
+	// Index of the held response to the chunk, -1 if none
+	int held(uint32_t number) const {
+		for (size_t i = 0; i < server.held.size(); ++i) {
+			if (server.held[i].number == number)
+				return static_cast<int>(i);
+		}
+		return -1;
+	}
+
+	// Sends held responses in order they were requested, until the update ends
+	void drain(Test_Broker& broker, ThingsBoard_Under_Test& tb) {
+		for (int i = 0; i < 1000 && !finished; ++i) {
+			if (!server.held.empty())
+				server.release(broker, 0);
+			tb.loop();
+		}
+	}
+
+	Test_Firmware_Server server;
+	std::string path;
+	File_OTA_Sink sink;
+	bool finished;
+	OTA_Result result;
+};
+
+static std::vector<uint32_t> range(uint32_t from, uint32_t to) {
+	std::vector<uint32_t> numbers;
+	for (uint32_t i = from; i < to; ++i)
+		numbers.push_back(i);
+	return numbers;
+}
+
+static void test_window() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	Update update(broker, randomImage(1050, 1));
+	CHECK(tb.connect("broker", "token") && update.start(tb));
+	tb.loop();
+
+	// Window of chunks is requested ahead, each written chunk requests the next
+	CHECK(update.server.requests == range(0, 4));
+	update.server.release(broker, 0);
+	tb.loop();
+	CHECK(update.server.requests == range(0, 5));
+	CHECK(tb.OTA_Downloaded() == ChunkSize);
+
+	update.drain(broker, tb);
+	CHECK(update.finished && update.result == OTA_UPDATED);
+	CHECK(readFile(update.path) == update.server.image);
+
+	// Every chunk is requested once, last one is shorter
+	CHECK(update.server.requests == range(0, 11));
+	CHECK(!tb.OTA_Running());
+}
+
+static void test_out_of_order() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	Update update(broker, randomImage(1050, 2));
+	CHECK(tb.connect("broker", "token") && update.start(tb));
+	tb.loop();
+	Test_Logger::messages().clear();
+
+	// Chunk 1 overtakes chunk 0, so chunks from 0 on are requested again
+	// right away, without waiting for the timeout
+	update.server.release(broker, update.held(1));
+	tb.loop();
+	CHECK(Test_Logger::logged("firmware chunk out of order, requesting again"));
+	std::vector<uint32_t> expected = range(0, 4);
+	const std::vector<uint32_t> again = range(0, 4);
+	expected.insert(expected.end(), again.begin(), again.end());
+	CHECK(update.server.requests == expected);
+
+	// Only once for the same gap
+	update.server.release(broker, update.held(2));
+	tb.loop();
+	CHECK(update.server.requests == expected && Test_Logger::messages().empty());
+
+	// Late original and duplicates are taken quietly
+	update.drain(broker, tb);
+	CHECK(update.finished && update.result == OTA_UPDATED);
+	CHECK(readFile(update.path) == update.server.image);
+}
+
+static void test_lost_chunk() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	Update update(broker, randomImage(1050, 3));
+	CHECK(tb.connect("broker", "token") && update.start(tb));
+	tb.loop();
+
+	// Chunk 0 is lost, others arrive
+	update.server.held.erase(update.server.held.begin());
+	update.drain(broker, tb);
+	CHECK(update.finished && update.result == OTA_UPDATED);
+	CHECK(readFile(update.path) == update.server.image);
+}
+
+static void test_timeout() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	Update update(broker, randomImage(1050, 4));
+	CHECK(tb.connect("broker", "token") && update.start(tb));
+	tb.loop();
+	update.server.release(broker, 0);
+	tb.loop();
+	Test_Logger::messages().clear();
+
+	// Nothing arrives, chunks in flight are requested again upon timeout
+	update.server.held.clear();
+	update.server.requests.clear();
+	advanceMillis(THINGSBOARD_OTA_TIMEOUT - 100);
+	tb.loop();
+	CHECK(update.server.requests.empty());
+	advanceMillis(200);
+	tb.loop();
+	CHECK(Test_Logger::logged("firmware chunks timed out, requesting again"));
+	CHECK(update.server.requests == range(1, 5));
+
+	// Download continues once chunks arrive
+	update.drain(broker, tb);
+	CHECK(update.finished && update.result == OTA_UPDATED);
+	CHECK(readFile(update.path) == update.server.image);
+}
+
+static void test_retries_exhausted() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	Update update(broker, randomImage(1050, 5));
+	CHECK(tb.connect("broker", "token") && update.start(tb));
+	tb.loop();
+
+	for (int i = 0; i <= THINGSBOARD_OTA_RETRIES; ++i) {
+		update.server.held.clear();
+		CHECK(!update.finished);
+		advanceMillis(THINGSBOARD_OTA_TIMEOUT + 1);
+		tb.loop();
+	}
+	CHECK(update.finished && update.result == OTA_FAILED);
+	CHECK(Test_Logger::logged("download timed out"));
+	CHECK(update.server.requests.size() == 4 * (THINGSBOARD_OTA_RETRIES + 1));
+}
+
+static void test_resume_after_reconnect() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	Update update(broker, randomImage(1050, 6));
+	CHECK(tb.connect("broker", "token") && update.start(tb));
+	tb.loop();
+	for (int i = 0; i < 3; ++i) {
+		update.server.release(broker, 0);
+		tb.loop();
+	}
+
+	// Responses in flight are lost with the connection
+	broker.drop();
+	update.server.held.clear();
+	tb.loop();
+	CHECK(!tb.connected() && tb.OTA_Running());
+
+	// Download continues from the next chunk to be written
+	update.server.requests.clear();
+	CHECK(tb.connect("broker", "token"));
+	CHECK(update.server.requests == range(3, 7));
+	CHECK(broker.subscriptions.back() == "v2/fw/response/+/chunk/+");
+	update.drain(broker, tb);
+	CHECK(update.finished && update.result == OTA_UPDATED);
+	CHECK(readFile(update.path) == update.server.image);
+}
+
+int main() {
+	RUN_TEST(test_window);
+	RUN_TEST(test_out_of_order);
+	RUN_TEST(test_lost_chunk);
+	RUN_TEST(test_timeout);
+	RUN_TEST(test_retries_exhausted);
+	RUN_TEST(test_resume_after_reconnect);
+	return testResult();
+}
@@ -0,0 +1,111 @@
+// Tests of resuming firmware downloads, killed at random points as if the
+// device lost power, with and without delta updates
+
+#define THINGSBOARD_ENABLE_OTA
+#define THINGSBOARD_OTA_SAVE_INTERVAL 1024
+
+#include "test.h"
+#include "test_broker.h"
+#include "test_storage.h"
+#include "test_firmware.h"
+
+using ThingsBoard_Under_Test = ThingsBoardSized<256, 8, Test_Logger>;
+
+// Downloads the firmware, killing the device after a random amount of chunks
+// until the update ends. Returns amount of boots it took, 0 if it failed.
+static size_t downloadWithKills(Test_Broker& broker, Test_Firmware_Server& server, Test_Storage& storage,
+	const std::string& imagePath, const std::string& currentPath, size_t chunkSize, uint32_t seed) {
+	std::mt19937 random(seed);
+	for (size_t boot = 1; boot <= 500; ++boot) {
+		// Everything but the storage and the image file is lost on reboot
+		ThingsBoard_Under_Test tb(broker);
+		File_OTA_Sink file(imagePath.c_str());
+		File_OTA_Source current(currentPath.c_str());
+		OTA_Delta_Sink delta(file, current);
+		OTA_Sink& sink = currentPath.empty() ? static_cast<OTA_Sink&>(file) : delta;
+		tb.setStorage(&storage);
+
+		bool finished = false;
+		OTA_Result result = OTA_FAILED;
+		// Killed within three save intervals, so progress is saved now and then
+		server.chunkLimit = server.chunksSent + random() % (3 * THINGSBOARD_OTA_SAVE_INTERVAL / chunkSize);
+		if (!tb.connect("broker", "token")
+			|| !tb.OTA_Start("fw", "1.0", sink, [&](OTA_Result r) { finished = true; result = r; }, chunkSize))
+			return 0;
+		for (int i = 0; i < 4 && !finished; ++i)
+			tb.loop();
+
+		if (finished)
+			return result == OTA_UPDATED ? boot : 0;
+		broker.drop();
+	}
+	return 0;
+}
+
+static void test_file_sink_killed() {
+	const std::string image = randomImage(40000, 1);
+	const std::string imagePath = tempPath("image.bin");
+	for (uint32_t seed = 1; seed <= 5; ++seed) {
+		Test_Broker broker;
+		Test_Firmware_Server server(broker, image);
+		Test_Storage storage;
+		const size_t boots = downloadWithKills(broker, server, storage, imagePath, "", 256, seed);
+		CHECK(boots > 5);
+		CHECK(readFile(imagePath) == image);
+
+		// Chunks before the last saved progress are not downloaded again
+		CHECK(server.bytesSent < image.size() + boots * THINGSBOARD_OTA_SAVE_INTERVAL);
+	}
+	remove(imagePath.c_str());
+}
+
+static void test_delta_sink_killed() {
+	// New image differs from the current one in a few places and grows
+	const std::string current = randomImage(40000, 2);
+	std::string next = current;
+	for (size_t i = 1000; i < next.size(); i += 3000)
+		next[i] = static_cast<char>(next[i] + 1);
+	next.replace(20000, 100, randomImage(300, 3));
+	next += randomImage(2000, 4);
+
+	const std::string patch = makeDelta(current, next);
+	CHECK(!patch.empty() && patch.size() < next.size() / 4);
+	const std::string currentPath = tempPath("current.bin");
+	const std::string imagePath = tempPath("image.bin");
+	writeFile(currentPath, current);
+
+	for (uint32_t seed = 1; seed <= 5; ++seed) {
+		Test_Broker broker;
+		Test_Firmware_Server server(broker, patch);
+		Test_Storage storage;
+		// Small chunks, so the patch takes many of them
+		const size_t boots = downloadWithKills(broker, server, storage, imagePath, currentPath, 16, seed);
+		CHECK(boots > 1);
+		CHECK(readFile(imagePath) == next);
+	}
+	remove(currentPath.c_str());
+	remove(imagePath.c_str());
+}
+
+static void test_full_image_through_delta_sink_killed() {
+	// Image, which is not a patch, is written as is
+	const std::string image = randomImage(20000, 5);
+	const std::string currentPath = tempPath("current.bin");
+	const std::string imagePath = tempPath("image.bin");
+	writeFile(currentPath, randomImage(20000, 6));
+
+	Test_Broker broker;
+	Test_Firmware_Server server(broker, image);
+	Test_Storage storage;
+	CHECK(downloadWithKills(broker, server, storage, imagePath, currentPath, 256, 7) > 2);
+	CHECK(readFile(imagePath) == image);
+	remove(currentPath.c_str());
+	remove(imagePath.c_str());
+}
+
+int main() {
+	RUN_TEST(test_file_sink_killed);
+	RUN_TEST(test_delta_sink_killed);
+	RUN_TEST(test_full_image_through_delta_sink_killed);
+	return testResult();
+}
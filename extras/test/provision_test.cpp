@@ -0,0 +1,62 @@
+// Tests of device provisioning against the scripted broker
+
+#define THINGSBOARD_ENABLE_PROVISIONING
+
+#include "test.h"
+#include "test_broker.h"
+#include "test_storage.h"
+
+// Smallest payload size, provisioning request is larger than it
+using ThingsBoard_Under_Test = ThingsBoardSized<64, 8, Test_Logger>;
+
+static const char* const Key = "x2m9kq7vbn4lw8jd3hrt";
+static const char* const Secret = "p5zc1yf6gu0se7ao2nwi";
+
+// Answers provisioning requests with the access token
+static void provisionServer(Test_Broker& broker, const char* token) {
+	broker.onPublish = [token](Test_Broker& b, const Test_Broker::Message& message) {
+		if (message.topic == "/provision")
+			b.publish("/provision/response", std::string("{\"status\":\"SUCCESS\",\"credentialsType\":\"ACCESS_TOKEN\""
+				",\"credentialsValue\":\"") + token + "\"}");
+	};
+}
+
+static void test_request_larger_than_payload() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	Test_Storage storage;
+	tb.setStorage(&storage);
+	provisionServer(broker, "issuedtoken123456789");
+
+	// Name is generated by the server
+	CHECK(tb.Provision_Connect("broker", nullptr, Key, Secret));
+	CHECK(broker.published.size() == 1 && broker.published[0].topic == "/provision");
+	const std::string request = std::string("{\"provisionDeviceKey\":\"") + Key
+		+ "\",\"provisionDeviceSecret\":\"" + Secret + "\"}";
+	CHECK(request.size() > 64 && broker.published[0].payload == request);
+	CHECK(broker.users.size() == 2 && broker.users[0] == "provision" && broker.users[1] == "issuedtoken123456789");
+	CHECK(tb.connected());
+
+	// Next boot connects with the cached token
+	ThingsBoard_Under_Test rebooted(broker);
+	rebooted.setStorage(&storage);
+	CHECK(rebooted.Provision_Connect("broker", nullptr, Key, Secret));
+	CHECK(broker.published.size() == 1 && broker.users.back() == "issuedtoken123456789");
+}
+
+static void test_request_too_large() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	provisionServer(broker, "issuedtoken123456789");
+
+	// Request with the name does not fit into the buffer of the MQTT client
+	CHECK(!tb.Provision_Connect("broker", "greenhouse-sensor-0042", Key, Secret));
+	CHECK(Test_Logger::logged("unable to send provisioning request"));
+	CHECK(broker.published.empty());
+}
+
+int main() {
+	RUN_TEST(test_request_larger_than_payload);
+	RUN_TEST(test_request_too_large);
+	return testResult();
+}
@@ -0,0 +1,142 @@
+// Tests of QoS 1 publishing through the outbox against the scripted broker
+
+#define THINGSBOARD_QOS1_WINDOW 2
+#define THINGSBOARD_QOS1_OUTBOX 4
+#define THINGSBOARD_ENABLE_GATEWAY
+
+#include "test.h"
+#include "test_broker.h"
+#include <ThingsBoard.h>
+
+using ThingsBoard_Under_Test = ThingsBoardSized<64, 8, Test_Logger>;
+
+static void test_window_limit() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+
+	CHECK(tb.sendTelemetry("a", 1));
+	CHECK(tb.sendTelemetry("a", 2));
+	CHECK(tb.sendTelemetry("a", 3));
+	tb.loop();
+	CHECK(broker.published.size() == 2 && tb.Publish_Pending() == 3);
+	CHECK(broker.published[0].qos == 1 && broker.published[1].qos == 1);
+	CHECK(broker.published[0].packetId != broker.published[1].packetId);
+	CHECK(!broker.published[0].dup && broker.published[0].payload == "{\"a\":1}");
+
+	// Each PUBACK makes room for the next message
+	broker.ack(broker.published[0].packetId);
+	tb.loop();
+	CHECK(broker.published.size() == 3 && broker.published[2].payload == "{\"a\":3}");
+	CHECK(tb.Publish_Pending() == 2);
+}
+
+static void test_acks_out_of_order() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+
+	CHECK(tb.sendTelemetry("a", 1));
+	CHECK(tb.sendTelemetry("a", 2));
+	CHECK(tb.sendTelemetry("a", 3));
+	const uint16_t first = broker.published[0].packetId;
+	const uint16_t second = broker.published[1].packetId;
+
+	// Second message is acknowledged first, it is kept until the first one is
+	broker.ack(second);
+	tb.loop();
+	CHECK(broker.published.size() == 3 && tb.Publish_Pending() == 3);
+	broker.ack(first);
+	tb.loop();
+	CHECK(tb.Publish_Pending() == 1);
+	broker.ack(broker.published[2].packetId);
+	tb.loop();
+	CHECK(tb.Publish_Pending() == 0);
+
+	// PUBACK for a message not in flight
+	Test_Logger::messages().clear();
+	broker.ack(first);
+	tb.loop();
+	CHECK(Test_Logger::logged("PUBACK for unknown packet id"));
+}
+
+static void test_outbox_full() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+	Test_Logger::messages().clear();
+
+	for (int i = 0; i < THINGSBOARD_QOS1_OUTBOX; ++i)
+		CHECK(tb.sendTelemetry("a", i));
+	CHECK(!tb.sendTelemetry("a", 100));
+	CHECK(Test_Logger::logged("QoS 1 outbox is full"));
+	CHECK(!tb.sendAttribute("b", 1));
+	CHECK(broker.published.size() == THINGSBOARD_QOS1_WINDOW);
+
+	// Room again once acknowledged
+	broker.ack(broker.published[0].packetId);
+	tb.loop();
+	CHECK(tb.sendTelemetry("a", 100));
+}
+
+static void test_resend_after_reconnect() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+
+	CHECK(tb.sendTelemetry("a", 1));
+	CHECK(tb.sendTelemetry("a", 2));
+	CHECK(tb.sendTelemetry("a", 3));
+	const Test_Broker::Message first = broker.published[0];
+	const Test_Broker::Message second = broker.published[1];
+
+	// Connection lost before any PUBACK, messages published offline wait too
+	broker.drop();
+	tb.loop();
+	CHECK(!tb.connected());
+	CHECK(tb.sendTelemetry("a", 4));
+	CHECK(broker.published.size() == 2 && tb.Publish_Pending() == 4);
+
+	// Messages in flight are sent again with dup and the same packet id
+	broker.published.clear();
+	CHECK(tb.connect("broker", "token"));
+	CHECK(broker.published.size() == 2);
+	CHECK(broker.published[0].dup && broker.published[0].packetId == first.packetId);
+	CHECK(broker.published[0].payload == first.payload);
+	CHECK(broker.published[1].dup && broker.published[1].packetId == second.packetId);
+
+	broker.ack(first.packetId);
+	broker.ack(second.packetId);
+	tb.loop();
+	CHECK(broker.published.size() == 4);
+	CHECK(!broker.published[2].dup && broker.published[2].payload == "{\"a\":3}");
+	CHECK(!broker.published[3].dup && broker.published[3].payload == "{\"a\":4}");
+	broker.ack(broker.published[2].packetId);
+	broker.ack(broker.published[3].packetId);
+	tb.loop();
+	CHECK(tb.Publish_Pending() == 0);
+}
+
+static void test_gateway_data() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+	broker.autoAck = true;
+
+	CHECK(tb.Gateway_Send_Telemetry("dev", "t", 5));
+	CHECK(tb.Gateway_Send_Attribute("dev", "fw", "1.0"));
+	tb.loop();
+	CHECK(broker.published.size() == 2);
+	CHECK(broker.published[0].topic == "v1/gateway/telemetry" && broker.published[0].qos == 1);
+	CHECK(broker.published[1].topic == "v1/gateway/attributes" && broker.published[1].qos == 1);
+	CHECK(tb.Publish_Pending() == 0);
+}
+
+int main() {
+	RUN_TEST(test_window_limit);
+	RUN_TEST(test_acks_out_of_order);
+	RUN_TEST(test_outbox_full);
+	RUN_TEST(test_resend_after_reconnect);
+	RUN_TEST(test_gateway_data);
+	return testResult();
+}
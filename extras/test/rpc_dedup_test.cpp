@@ -0,0 +1,125 @@
+// Tests of dropping redelivered RPC requests, rejecting deferred ones and
+// answering idempotent ones from the cache
+
+#define THINGSBOARD_MAX_PENDING_RPC 1
+#define THINGSBOARD_RPC_DEDUP_SIZE 4
+#define THINGSBOARD_RPC_CACHE_SIZE 2
+
+#include "test.h"
+#include "test_broker.h"
+#include <ThingsBoard.h>
+
+using ThingsBoard_Under_Test = ThingsBoardSized<64, 8, Test_Logger>;
+
+static int calls = 0;
+
+static RPC_Response counted(const RPC_Data& data) {
+	++calls;
+	return RPC_Response(nullptr, data["a"].as<int>());
+}
+
+static void request(Test_Broker& broker, ThingsBoard_Under_Test& tb, uint32_t id, const std::string& payload) {
+	broker.publish("v1/devices/me/rpc/request/" + std::to_string(id), payload);
+	tb.loop();
+}
+
+static void test_redelivered_dropped() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	calls = 0;
+	CHECK(tb.connect("broker", "token"));
+	CHECK(tb.RPC_Subscribe({ RPC_Callback("get", counted) }));
+
+	request(broker, tb, 5, "{\"method\":\"get\",\"params\":{\"a\":1}}");
+	request(broker, tb, 5, "{\"method\":\"get\",\"params\":{\"a\":1}}");
+	CHECK(calls == 1 && broker.published.size() == 1);
+	CHECK(Test_Logger::logged("dropped redelivered RPC"));
+	CHECK(tb.RPC_Cache_Statistics().duplicates == 1);
+}
+
+static void test_forgotten_on_connect() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	calls = 0;
+	CHECK(tb.connect("broker", "token"));
+	CHECK(tb.RPC_Subscribe({ RPC_Callback("get", counted) }));
+	request(broker, tb, 1, "{\"method\":\"get\",\"params\":{\"a\":1}}");
+
+	// Server numbers requests of the new connection from the start again
+	broker.drop();
+	tb.loop();
+	CHECK(tb.connect("broker", "token"));
+	CHECK(tb.RPC_Subscribe({ RPC_Callback("get", counted) }));
+	request(broker, tb, 1, "{\"method\":\"get\",\"params\":{\"a\":2}}");
+	CHECK(calls == 2 && broker.published.back().payload == "2");
+}
+
+static void test_not_dispatched_not_remembered() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	calls = 0;
+	CHECK(tb.connect("broker", "token"));
+	CHECK(tb.RPC_Subscribe({ RPC_Callback("get", counted) }));
+
+	// Request, which could not be processed, is taken when delivered again
+	request(broker, tb, 3, "{\"params\":{\"a\":1}}");
+	CHECK(Test_Logger::logged("RPC method is nullptr"));
+	request(broker, tb, 3, "{\"method\":\"get\",\"params\":{\"a\":1}}");
+	CHECK(calls == 1 && tb.RPC_Cache_Statistics().duplicates == 0);
+}
+
+static void test_pending_full_rejected() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	RPC_Token token;
+	CHECK(tb.connect("broker", "token"));
+	CHECK(tb.RPC_Subscribe({ RPC_Callback("later", RPC_Callback::deferredFn([&token](const RPC_Data&, RPC_Token t) {
+		token = t;
+	})) }));
+
+	// Only pending slot is taken, the next request is answered with an error
+	request(broker, tb, 1, "{\"method\":\"later\"}");
+	CHECK(broker.published.empty());
+	request(broker, tb, 2, "{\"method\":\"later\"}");
+	CHECK(Test_Logger::logged("rejected RPC, too many pending requests"));
+	CHECK(broker.published.size() == 1 && broker.published[0].topic == "v1/devices/me/rpc/response/2");
+	CHECK(broker.published[0].payload == "{\"error\":\"too many pending RPC requests\"}");
+
+	// Rejected request is taken when delivered again after the slot is free
+	CHECK(tb.RPC_Respond(token, RPC_Response(nullptr, 1)));
+	request(broker, tb, 2, "{\"method\":\"later\"}");
+	CHECK(tb.RPC_Cache_Statistics().duplicates == 0);
+	CHECK(tb.RPC_Respond(token, RPC_Response(nullptr, 2)));
+	CHECK(broker.published.size() == 3 && broker.published[2].topic == "v1/devices/me/rpc/response/2");
+}
+
+static void test_cache_ignores_whitespace() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	calls = 0;
+	CHECK(tb.connect("broker", "token"));
+	CHECK(tb.RPC_Subscribe({ RPC_Callback("get", counted).idempotent(1000),
+		RPC_Callback("other", counted).idempotent(1000) }));
+
+	request(broker, tb, 1, "{\"method\":\"get\",\"params\":{\"a\":1,\"b\":2}}");
+	request(broker, tb, 2, "{ \"params\" : { \"a\" : 1, \"b\" : 2 }, \"method\" : \"get\" }");
+	CHECK(calls == 1 && tb.RPC_Cache_Statistics().hits == 1);
+	CHECK(broker.published.size() == 2 && broker.published[1].payload == "1");
+
+	// Other method with the same params is not answered from the cache
+	request(broker, tb, 3, "{\"method\":\"other\",\"params\":{\"a\":1,\"b\":2}}");
+	CHECK(calls == 2);
+
+	// Order of keys in params matters, as documented
+	request(broker, tb, 4, "{\"method\":\"get\",\"params\":{\"b\":2,\"a\":1}}");
+	CHECK(calls == 3 && tb.RPC_Cache_Statistics().misses == 3);
+}
+
+int main() {
+	RUN_TEST(test_redelivered_dropped);
+	RUN_TEST(test_forgotten_on_connect);
+	RUN_TEST(test_not_dispatched_not_remembered);
+	RUN_TEST(test_pending_full_rejected);
+	RUN_TEST(test_cache_ignores_whitespace);
+	return testResult();
+}
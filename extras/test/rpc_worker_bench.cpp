@@ -0,0 +1,65 @@
+// Measures latency of loop() under bursts of slow RPC requests, with
+// callbacks executed by the worker thread and in the network loop
+
+#define THINGSBOARD_ENABLE_RPC_WORKER
+
+#include "test.h"
+#include "test_broker.h"
+#include <ThingsBoard.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+using ThingsBoard_Under_Test = ThingsBoardSized<64, 8, Test_Logger>;
+
+static const int Bursts = 50;
+static const int BurstSize = 4;
+static const auto CallbackTime = std::chrono::microseconds(2000);
+
+static RPC_Response slow(const RPC_Data& data) {
+	std::this_thread::sleep_for(CallbackTime);
+	return RPC_Response(nullptr, data.as<int>());
+}
+
+static void bench(const char* name, bool inLoop) {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	RPC_Callback callback("slow", RPC_Callback::processFn(slow));
+	if (inLoop)
+		callback.inLoop();
+	if (!tb.connect("broker", "token") || !tb.RPC_Subscribe({ callback }))
+		return;
+
+	std::vector<double> latencies;
+	size_t responses = 0;
+	const auto start = std::chrono::steady_clock::now();
+	for (int burst = 0; burst < Bursts; ++burst) {
+		for (int i = 0; i < BurstSize; ++i) {
+			const int id = burst * BurstSize + i + 1;
+			broker.publish("v1/devices/me/rpc/request/" + std::to_string(id),
+				"{\"method\":\"slow\",\"params\":" + std::to_string(id) + "}");
+		}
+		// Application calls loop() every 100 us between bursts
+		for (int i = 0; i < 100; ++i) {
+			const auto before = std::chrono::steady_clock::now();
+			tb.loop();
+			latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - before).count());
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+		responses = broker.published.size();
+	}
+	const double total = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	std::sort(latencies.begin(), latencies.end());
+	printf("%-16s loop() latency p50 %7.1f us, p99 %7.1f us, max %7.1f us | %zu/%d responses in %.0f ms\n",
+		name, latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100], latencies.back(),
+		responses, Bursts * BurstSize, total);
+}
+
+int main() {
+	printf("%d bursts of %d requests, callback takes %lld us\n", Bursts, BurstSize,
+		static_cast<long long>(CallbackTime.count()));
+	bench("RPC worker", false);
+	bench("network loop", true);
+	return 0;
+}
@@ -0,0 +1,116 @@
+// Tests of RPC callbacks executed by the worker thread
+
+#define THINGSBOARD_ENABLE_RPC_WORKER
+#define THINGSBOARD_RPC_WORKER_QUEUE 4
+
+#include "test.h"
+#include "test_broker.h"
+#include <ThingsBoard.h>
+#include <atomic>
+#include <thread>
+
+// Logger, which checks that it is called from the network loop only
+class Loop_Logger {
+public:
+	static std::thread::id& loopThread() {
+		static std::thread::id id = std::this_thread::get_id();
+		return id;
+	}
+
+	static std::atomic<int>& foreignCalls() {
+		static std::atomic<int> calls(0);
+		return calls;
+	}
+
+	static void log(const char* msg) {
+		if (std::this_thread::get_id() != loopThread())
+			++foreignCalls();
+		else
+			Test_Logger::log(msg);
+	}
+};
+
+using ThingsBoard_Under_Test = ThingsBoardSized<64, 8, Loop_Logger>;
+
+// Sends RPC requests with ids from..to, calls loop() until all are answered.
+// Returns responses by id.
+static std::map<uint32_t, std::string> requests(Test_Broker& broker, ThingsBoard_Under_Test& tb,
+	uint32_t from, uint32_t to, const char* method) {
+	for (uint32_t id = from; id < to; ++id) {
+		broker.publish("v1/devices/me/rpc/request/" + std::to_string(id),
+			std::string("{\"method\":\"") + method + "\",\"params\":" + std::to_string(id) + "}");
+	}
+	std::map<uint32_t, std::string> responses;
+	for (int i = 0; i < 2000 && responses.size() < to - from; ++i) {
+		tb.loop();
+		for (const auto& message : broker.published) {
+			const std::string prefix = "v1/devices/me/rpc/response/";
+			if (!message.topic.compare(0, prefix.size(), prefix))
+				responses[strtoul(message.topic.c_str() + prefix.size(), nullptr, 10)] = message.payload;
+		}
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+	return responses;
+}
+
+static void test_executed_by_worker() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	std::atomic<bool> onWorker(true);
+	CHECK(tb.connect("broker", "token"));
+	CHECK(tb.RPC_Subscribe({ RPC_Callback("twice", RPC_Callback::processFn([&onWorker](const RPC_Data& data) {
+		if (std::this_thread::get_id() == Loop_Logger::loopThread())
+			onWorker = false;
+		return RPC_Response(nullptr, data.as<int>() * 2);
+	})) }));
+
+	const std::map<uint32_t, std::string> responses = requests(broker, tb, 1, 3, "twice");
+	CHECK(responses.size() == 2 && responses.at(1) == "2" && responses.at(2) == "4");
+	CHECK(onWorker);
+}
+
+static void test_error_response() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+	CHECK(tb.RPC_Subscribe({ RPC_Callback("large", RPC_Callback::processFn([](const RPC_Data&) {
+		static const std::string large(100, 'x');
+		return RPC_Response(nullptr, large.c_str());
+	})) }));
+	Test_Logger::messages().clear();
+
+	// Response does not fit, an error is answered instead of nothing
+	const std::map<uint32_t, std::string> responses = requests(broker, tb, 7, 8, "large");
+	CHECK(responses.size() == 1 && responses.at(7) == "{\"error\":\"too small buffer for JSON data\"}");
+	CHECK(Test_Logger::logged("too small buffer for JSON data"));
+	CHECK(Loop_Logger::foreignCalls() == 0);
+}
+
+static void test_bursts() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+	CHECK(tb.RPC_Subscribe({ RPC_Callback("slow", RPC_Callback::processFn([](const RPC_Data& data) {
+		std::this_thread::sleep_for(std::chrono::microseconds(200));
+		return RPC_Response(nullptr, data.as<int>());
+	})) }));
+
+	// Bursts longer than the queue, the rest is executed in place
+	for (uint32_t burst = 0; burst < 20; ++burst) {
+		const uint32_t from = burst * 10 + 1;
+		const std::map<uint32_t, std::string> responses = requests(broker, tb, from, from + 10, "slow");
+		CHECK(responses.size() == 10);
+		for (const auto& response : responses)
+			CHECK(response.second == std::to_string(response.first));
+		broker.published.clear();
+	}
+	CHECK(Loop_Logger::foreignCalls() == 0);
+}
+
+int main() {
+	Loop_Logger::loopThread();
+	RUN_TEST(test_executed_by_worker);
+	RUN_TEST(test_error_response);
+	RUN_TEST(test_bursts);
+	return testResult();
+}
@@ -0,0 +1,60 @@
+#!/bin/bash
+
+# Builds and runs host tests of the library against stand-ins of the Arduino
+# core and a scripted MQTT broker. Tests, which check that misuse does not
+# compile, are built once more with EXPECT_COMPILE_ERROR defined and must fail
+# with the message given in their EXPECT_COMPILE_ERROR comment. Benchmarks run
+# too, if --bench is passed.
+# ArduinoJson sources are taken from ARDUINOJSON, by default the library
+# installed by arduino-cli.
+
+set -e
+
+cd "$(dirname "$0")"
+
+ARDUINOJSON="${ARDUINOJSON:-$HOME/Arduino/libraries/ArduinoJson/src}"
+CXX="${CXX:-g++}"
+BUILD_DIR="$(mktemp -d)"
+trap 'rm -rf "${BUILD_DIR}"' EXIT
+
+do_build() {
+    "${CXX}" -std=gnu++11 -Wall -Wextra -O2 -pthread -I. -I../../src -I"${ARDUINOJSON}" \
+        -o "${BUILD_DIR}/${1%.cpp}" "$1" "${@:2}"
+}
+
+FAILED=0
+
+for path in *_test.cpp
+do
+    echo "== ${path}"
+    do_build "${path}"
+    "${BUILD_DIR}/${path%.cpp}" || FAILED=1
+done
+
+for path in $(grep -l "^// EXPECT_COMPILE_ERROR: " *_test.cpp)
+do
+    echo "== ${path} (must not compile)"
+    expected="$(sed -n 's|^// EXPECT_COMPILE_ERROR: ||p' "${path}")"
+    if do_build "${path}" -DEXPECT_COMPILE_ERROR > "${BUILD_DIR}/errors" 2>&1
+    then
+        echo "${path}: compiled, expected: ${expected}"
+        FAILED=1
+    elif ! grep -qF "${expected}" "${BUILD_DIR}/errors"
+    then
+        cat "${BUILD_DIR}/errors"
+        echo "${path}: failed to compile, expected: ${expected}"
+        FAILED=1
+    fi
+done
+
+if [ "$1" == "--bench" ]
+then
+    for path in *_bench.cpp
+    do
+        echo "== ${path}"
+        do_build "${path}"
+        "${BUILD_DIR}/${path%.cpp}"
+    done
+fi
+
+exit ${FAILED}
@@ -0,0 +1,83 @@
+// Tests of dispatching shared attribute updates to key-filtered callbacks
+
+#include "test.h"
+#include "test_broker.h"
+#include <ThingsBoard.h>
+
+using ThingsBoard_Under_Test = ThingsBoardSized<128, 8, Test_Logger>;
+
+static const char* const NetworkKeys[] = { "ssid", "password" };
+static const char* const DisplayKeys[] = { "brightness" };
+
+// Values passed to a callback, "null" for keys missing from the update
+struct Received {
+	int         calls = 0;
+	std::string values;
+};
+
+static Shared_Attribute_Callback::processFn record(Received& received) {
+	return [&received](const Shared_Attribute_Data& data) {
+		++received.calls;
+		received.values.clear();
+		for (size_t i = 0; i < data.size(); ++i) {
+			char value[32];
+			serializeJson(data[i], value, sizeof(value));
+			received.values += std::string(i ? "," : "") + data.key(i) + "=" + value;
+		}
+	};
+}
+
+static void test_only_matching_called() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	Received network, display;
+	CHECK(tb.connect("broker", "token"));
+	CHECK(tb.Shared_Attribute_Subscribe({
+		Shared_Attribute_Callback(NetworkKeys, record(network)),
+		Shared_Attribute_Callback(DisplayKeys, record(display))
+	}));
+	CHECK(broker.subscriptions.size() == 1 && broker.subscriptions[0] == "v1/devices/me/attributes");
+
+	// Values are passed in the order of the keys
+	broker.publish("v1/devices/me/attributes", "{\"volume\":3,\"password\":\"secret\",\"ssid\":\"home\"}");
+	tb.loop();
+	CHECK(network.calls == 1 && network.values == "ssid=\"home\",password=\"secret\"");
+	CHECK(display.calls == 0);
+
+	broker.publish("v1/devices/me/attributes", "{\"brightness\":70}");
+	tb.loop();
+	CHECK(network.calls == 1);
+	CHECK(display.calls == 1 && display.values == "brightness=70");
+
+	// Missing keys are null
+	broker.publish("v1/devices/me/attributes", "{\"ssid\":\"office\",\"brightness\":40}");
+	tb.loop();
+	CHECK(network.calls == 2 && network.values == "ssid=\"office\",password=null");
+	CHECK(display.calls == 2 && display.values == "brightness=40");
+}
+
+static void test_unlisted_keys_ignored() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	Received network, display, all;
+	CHECK(tb.connect("broker", "token"));
+	CHECK(tb.Shared_Attribute_Subscribe({
+		Shared_Attribute_Callback(NetworkKeys, record(network)),
+		Shared_Attribute_Callback(DisplayKeys, record(display)),
+		Shared_Attribute_Callback(record(all))
+	}));
+
+	// Keys sharing a prefix with subscribed ones do not match either
+	broker.publish("v1/devices/me/attributes", "{\"volume\":3,\"ssid2\":\"guest\",\"bright\":1}");
+	tb.loop();
+	CHECK(network.calls == 0 && display.calls == 0);
+
+	// Callback without keys gets every update
+	CHECK(all.calls == 1 && all.values.empty());
+}
+
+int main() {
+	RUN_TEST(test_only_matching_called);
+	RUN_TEST(test_unlisted_keys_ignored);
+	return testResult();
+}
@@ -0,0 +1,69 @@
+// Tests of answering RPC requests from the last sent telemetry
+
+#define THINGSBOARD_TELEMETRY_CACHE_SIZE 2
+#define THINGSBOARD_MAX_PENDING_RPC 1
+#define THINGSBOARD_ENABLE_RPC_WORKER
+
+#include "test.h"
+#include "test_broker.h"
+#include <ThingsBoard.h>
+
+using ThingsBoard_Under_Test = ThingsBoardSized<128, 8, Test_Logger>;
+
+static const char* const ResponseTopic = "v1/devices/me/rpc/response/";
+
+// Publishes RPC request and returns its response, empty if there is none
+static std::string request(Test_Broker& broker, ThingsBoard_Under_Test& tb, int id, const char* payload) {
+	const std::string topic = std::string(ResponseTopic) + std::to_string(id);
+	broker.publish("v1/devices/me/rpc/request/" + std::to_string(id), payload);
+	tb.loop();
+	for (const auto& message : broker.published) {
+		if (message.topic == topic)
+			return message.payload;
+	}
+	return std::string();
+}
+
+static void test_answered_from_cache() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+	CHECK(tb.RPC_Subscribe({ tb.Telemetry_Cache_RPC("getTelemetry") }));
+
+	CHECK(tb.sendTelemetry("t", 21));
+	CHECK(tb.sendTelemetry("h", 40));
+	advanceMillis(1200);
+	const std::string response = request(broker, tb, 1, "{\"method\":\"getTelemetry\",\"params\":{\"keys\":[\"t\"]}}");
+	CHECK(response.find("\"t\":{\"value\":21,\"age\":12") == 1 && response.find("\"h\"") == std::string::npos);
+
+	// Keys longer than the cache takes are not cached
+	const std::string key(THINGSBOARD_TELEMETRY_KEY_SIZE, 'k');
+	CHECK(tb.sendTelemetry(key.c_str(), 1));
+	CHECK(request(broker, tb, 2, "{\"method\":\"getTelemetry\"}").find(key) == std::string::npos);
+}
+
+static void test_no_pending_slot_taken() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+	const RPC_Callback callbacks[] = {
+		RPC_Callback("slow", RPC_Callback::deferredFn([](const RPC_Data&, RPC_Token) { })),
+		tb.Telemetry_Cache_RPC("getTelemetry"),
+	};
+	CHECK(tb.RPC_Subscribe(std::vector<RPC_Callback>(callbacks, callbacks + 2)));
+	CHECK(tb.sendTelemetry("t", 1));
+
+	// Only pending slot is taken by a deferred request, which is never answered
+	CHECK(request(broker, tb, 1, "{\"method\":\"slow\"}").empty());
+
+	// Answered within the same loop, not by the worker
+	const std::string response = request(broker, tb, 2, "{\"method\":\"getTelemetry\"}");
+	CHECK(response.find("{\"t\":{\"value\":1,") == 0);
+	CHECK(!Test_Logger::logged("rejected RPC, too many pending requests"));
+}
+
+int main() {
+	RUN_TEST(test_answered_from_cache);
+	RUN_TEST(test_no_pending_slot_taken);
+	return testResult();
+}
@@ -0,0 +1,63 @@
+/*
+  test.h - Checks and logger shared by host tests of the library.
+*/
+#ifndef test_h
+#define test_h
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Amount of failed checks
+inline int& testFailures() {
+	static int failures = 0;
+	return failures;
+}
+
+// Reports the condition if it does not hold and carries on
+#define CHECK(condition) do { \
+		if (!(condition)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+			++testFailures(); \
+		} \
+	} while (0)
+
+// Runs the test function, reporting its name
+#define RUN_TEST(test) do { \
+		const int failed = testFailures(); \
+		test(); \
+		fprintf(stderr, "%-50s %s\n", #test, failed == testFailures() ? "ok" : "FAILED"); \
+	} while (0)
+
+// Exit code of the test program
+inline int testResult() {
+	return testFailures() ? 1 : 0;
+}
+
+// Logger, which keeps messages for checks
+class Test_Logger {
+public:
+	static std::vector<std::string>& messages() {
+		static std::vector<std::string> list;
+		return list;
+	}
+
+	static void log(const char* msg) {
+		messages().push_back(msg);
+	}
+
+	// Returns true if the message was logged, and forgets it
+	static bool logged(const char* msg) {
+		std::vector<std::string>& list = messages();
+		for (size_t i = 0; i < list.size(); ++i) {
+			if (list[i] == msg) {
+				list.erase(list.begin() + i);
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+#endif // test_h
@@ -0,0 +1,289 @@
+/*
+  test_broker.h - Network client connected to a scripted MQTT broker, for
+  host tests of the library. Packets written by the library are parsed and
+  answered right away. Packets for the library wait in the receive queue
+  until it reads them, so tests decide when and in how many pieces they
+  arrive. Speaks MQTT 3.1.1, or MQTT 5 if the library connects with it.
+*/
+#ifndef test_broker_h
+#define test_broker_h
+
+#include "Client.h"
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+class Test_Broker : public Client {
+public:
+	// Message published by the library
+	struct Message {
+		std::string topic;
+		std::string payload;
+		uint8_t     qos;
+		bool        dup;
+		uint16_t    packetId;
+		bool        aliased;    // Sent with a topic alias
+		size_t      size;       // Size of the whole packet
+	};
+
+	Test_Broker()
+		:refuseConnects(0), holdConnack(false), connackCode(0), answerPings(true), autoAck(false)
+		, aliasMaximum(10), receiveMaximum(0), serverKeepAlive(0)
+		, opens(0), pings(0), v5(false), m_connected(false) { }
+
+	// Script of the broker
+	int         refuseConnects;     // Amount of network connections to refuse
+	bool        holdConnack;        // Keep CONNACK in heldConnack until release()
+	uint8_t     connackCode;        // CONNACK return code, reason code on MQTT 5
+	std::string rejectUser;         // User rejected with bad credentials
+	bool        answerPings;        // Answer PINGREQ with PINGRESP
+	bool        autoAck;            // Acknowledge QoS 1 messages right away
+	uint16_t    aliasMaximum;       // MQTT 5 CONNACK properties, left out if 0
+	uint16_t    receiveMaximum;
+	uint16_t    serverKeepAlive;
+	std::function<void(Test_Broker&, const Message&)> onPublish;
+
+	// What the library did
+	int         opens;              // Network connections attempted
+	int         pings;              // PINGREQ packets received
+	bool        v5;                 // Did the last CONNECT ask for MQTT 5?
+	std::string heldConnack;        // CONNACK kept back by holdConnack
+	std::vector<std::string> packets;           // Raw packets written by the library
+	std::vector<std::string> users;             // User of each CONNECT
+	std::vector<std::string> subscriptions;
+	std::vector<std::string> unsubscriptions;
+	std::vector<Message>     published;
+	std::vector<uint16_t>    acks;              // PUBACKs for messages from the broker
+
+	// Queues raw bytes for the library
+	void send(const std::string& bytes) { m_rx += bytes; }
+
+	// Queues a message for the library
+	void publish(const std::string& topic, const std::string& payload, uint8_t qos = 0, uint16_t packetId = 0) {
+		std::string body = string(topic);
+		if (qos)
+			body += id(packetId);
+		if (v5)
+			body += '\0';
+		send(packet(0x30 | (qos << 1), body + payload));
+	}
+
+	// Acknowledges QoS 1 message of the library
+	void ack(uint16_t packetId) { send(packet(0x40, id(packetId))); }
+
+	// Sends CONNACK kept back by holdConnack
+	void release() {
+		send(heldConnack);
+		heldConnack.clear();
+	}
+
+	// Drops the network connection, as if it was lost
+	void drop() {
+		m_connected = false;
+		m_rx.clear();
+	}
+
+	// Bytes queued for the library
+	size_t pending() const { return m_rx.size(); }
+
+	// Returns MQTT packet with given first byte and body
+	static std::string packet(uint8_t type, const std::string& body) {
+		std::string bytes(1, static_cast<char>(type));
+		size_t remaining = body.size();
+		do {
+			const uint8_t digit = remaining % 128;
+			remaining /= 128;
+			bytes += static_cast<char>(remaining ? digit | 0x80 : digit);
+		} while (remaining);
+		return bytes + body;
+	}
+
+	static std::string id(uint16_t packetId) {
+		return std::string(1, static_cast<char>(packetId >> 8)) + static_cast<char>(packetId & 0xFF);
+	}
+
+	static std::string string(const std::string& str) {
+		return id(static_cast<uint16_t>(str.size())) + str;
+	}
+
+	int connect(IPAddress, uint16_t) override { return connect("", 0); }
+
+	int connect(const char*, uint16_t) override {
+		++opens;
+		if (refuseConnects) {
+			--refuseConnects;
+			return 0;
+		}
+		m_connected = true;
+		m_rx.clear();
+		m_tx.clear();
+		return 1;
+	}
+
+	size_t write(uint8_t c) override { return write(&c, 1); }
+
+	size_t write(const uint8_t* buffer, size_t size) override {
+		if (!m_connected)
+			return 0;
+		m_tx.append(reinterpret_cast<const char*>(buffer), size);
+		receive();
+		return size;
+	}
+
+	int available() override { return m_connected || !m_rx.empty() ? static_cast<int>(m_rx.size()) : 0; }
+
+	int read() override {
+		if (m_rx.empty())
+			return -1;
+		const uint8_t c = m_rx[0];
+		m_rx.erase(0, 1);
+		return c;
+	}
+
+	int read(uint8_t* buffer, size_t size) override {
+		const size_t length = size < m_rx.size() ? size : m_rx.size();
+		memcpy(buffer, m_rx.data(), length);
+		m_rx.erase(0, length);
+		return static_cast<int>(length);
+	}
+
+	int peek() override { return m_rx.empty() ? -1 : static_cast<uint8_t>(m_rx[0]); }
+	void flush() override { }
+	void stop() override { m_connected = false; }
+	uint8_t connected() override { return m_connected; }
+	operator bool() override { return m_connected; }
+
+private:
+	// Handles complete packets written by the library
+	void receive() {
+		for (;;) {
+			size_t header = 1;
+			size_t remaining = 0;
+			size_t multiplier = 1;
+			uint8_t digit;
+			do {
+				if (header >= m_tx.size())
+					return;
+				digit = m_tx[header++];
+				remaining += (digit & 0x7F) * multiplier;
+				multiplier *= 128;
+			} while (digit & 0x80);
+			if (m_tx.size() < header + remaining)
+				return;
+
+			const uint8_t type = m_tx[0];
+			const std::string body = m_tx.substr(header, remaining);
+			packets.push_back(m_tx.substr(0, header + remaining));
+			m_tx.erase(0, header + remaining);
+			handle(type, body, header + remaining);
+		}
+	}
+
+	void handle(uint8_t type, const std::string& body, size_t size) {
+		size_t offset = 0;
+		switch (type & 0xF0) {
+		case 0x10: {
+			// Protocol name, level, flags, keep alive, properties
+			v5 = body[6] == 5;
+			const uint8_t flags = body[7];
+			offset = 10;
+			if (v5)
+				offset += 1 + static_cast<uint8_t>(body[offset]);
+			readString(body, offset);
+			const std::string user = (flags & 0x80) ? readString(body, offset) : "";
+			users.push_back(user);
+			m_aliases.clear();
+			const uint8_t code = !rejectUser.empty() && user == rejectUser ? (v5 ? 0x86 : 4) : connackCode;
+			const std::string connack = v5 ? packet(0x20, std::string(1, '\0') + static_cast<char>(code) + properties())
+				: packet(0x20, std::string(1, '\0') + static_cast<char>(code));
+			if (holdConnack)
+				heldConnack = connack;
+			else
+				send(connack);
+			break;
+		}
+		case 0x30: {
+			Message message;
+			message.qos = (type >> 1) & 0x03;
+			message.dup = type & 0x08;
+			message.size = size;
+			message.aliased = false;
+			message.topic = readString(body, offset);
+			message.packetId = 0;
+			if (message.qos) {
+				message.packetId = (static_cast<uint8_t>(body[offset]) << 8) | static_cast<uint8_t>(body[offset + 1]);
+				offset += 2;
+			}
+			if (v5) {
+				const size_t end = offset + 1 + static_cast<uint8_t>(body[offset]);
+				for (++offset; offset < end; offset += 3) {
+					// Topic alias is the only property sent by the library
+					const uint16_t alias = (static_cast<uint8_t>(body[offset + 1]) << 8) | static_cast<uint8_t>(body[offset + 2]);
+					message.aliased = true;
+					if (message.topic.empty())
+						message.topic = m_aliases[alias];
+					else
+						m_aliases[alias] = message.topic;
+				}
+			}
+			message.payload = body.substr(offset);
+			published.push_back(message);
+			if (autoAck && message.qos)
+				ack(message.packetId);
+			if (onPublish)
+				onPublish(*this, message);
+			break;
+		}
+		case 0x40:
+			acks.push_back((static_cast<uint8_t>(body[0]) << 8) | static_cast<uint8_t>(body[1]));
+			break;
+		case 0x80:
+			offset = v5 ? 3 : 2;
+			subscriptions.push_back(readString(body, offset));
+			send(packet(0x90, body.substr(0, 2) + '\0'));
+			break;
+		case 0xA0:
+			offset = v5 ? 3 : 2;
+			unsubscriptions.push_back(readString(body, offset));
+			send(packet(0xB0, body.substr(0, 2)));
+			break;
+		case 0xC0:
+			++pings;
+			if (answerPings)
+				send(packet(0xD0, ""));
+			break;
+		case 0xE0:
+			m_connected = false;
+			break;
+		}
+	}
+
+	// Returns MQTT 5 CONNACK properties
+	std::string properties() const {
+		std::string list;
+		if (serverKeepAlive)
+			list += '\x13' + id(serverKeepAlive);
+		if (receiveMaximum)
+			list += '\x21' + id(receiveMaximum);
+		// User property, which the library must skip
+		list += '\x26' + string("broker") + string("test");
+		if (aliasMaximum)
+			list += '\x22' + id(aliasMaximum);
+		return static_cast<char>(list.size()) + list;
+	}
+
+	static std::string readString(const std::string& body, size_t& offset) {
+		const size_t length = (static_cast<uint8_t>(body[offset]) << 8) | static_cast<uint8_t>(body[offset + 1]);
+		const std::string str = body.substr(offset + 2, length);
+		offset += 2 + length;
+		return str;
+	}
+
+	bool        m_connected;    // Is network connection open?
+	std::string m_rx;           // Bytes for the library
+	std::string m_tx;           // Bytes written by the library, not parsed yet
+	std::map<uint16_t, std::string> m_aliases;  // Topic aliases of the connection
+};
+
+#endif // test_broker_h
@@ -0,0 +1,150 @@
+/*
+  test_firmware.h - Firmware server for host tests of firmware updates. It
+  answers attribute requests with the firmware assigned to the device and
+  chunk requests with parts of the image, through the scripted broker.
+  Chunk responses can be held back, so tests decide their order.
+*/
+#ifndef test_firmware_h
+#define test_firmware_h
+
+#include "test_broker.h"
+#include <ThingsBoard.h>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <unistd.h>
+
+class Test_Firmware_Server {
+public:
+	// Chunk response, which is not sent yet
+	struct Chunk {
+		uint32_t    number;
+		std::string topic;
+		std::string payload;
+	};
+
+	Test_Firmware_Server(Test_Broker& broker, const std::string& image)
+		:image(image), title("fw"), version("2.0"), holdChunks(false), chunkLimit(SIZE_MAX)
+		, chunksSent(0), bytesSent(0) {
+		broker.onPublish = [this](Test_Broker& b, const Test_Broker::Message& message) {
+			handle(b, message);
+		};
+	}
+
+	// Firmware assigned to the device
+	std::string image;
+	std::string title;
+	std::string version;
+
+	// Script of the server
+	bool        holdChunks;         // Keep chunk responses in held instead of sending them
+	size_t      chunkLimit;         // Amount of chunks to send, later requests are ignored
+
+	// What the library did
+	std::vector<uint32_t> requests; // Numbers of requested chunks, in order
+	std::vector<Chunk> held;        // Chunk responses kept back by holdChunks
+	size_t      chunksSent;         // Amount of chunk responses sent
+	size_t      bytesSent;          // Amount of image bytes sent
+
+	// Sends held chunk response
+	void release(Test_Broker& broker, size_t index) {
+		const Chunk chunk = held[index];
+		held.erase(held.begin() + index);
+		send(broker, chunk);
+	}
+
+	// Returns CRC-32 of the data, formatted like the server does
+	static std::string crc32(const std::string& data) {
+		OTA_CRC32 crc;
+		crc.update(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+		char hex[9];
+		const uint32_t value = crc.value();
+		snprintf(hex, sizeof(hex), "%02x%02x%02x%02x", value & 0xFF, (value >> 8) & 0xFF,
+			(value >> 16) & 0xFF, value >> 24);
+		return hex;
+	}
+
+private:
+	void handle(Test_Broker& broker, const Test_Broker::Message& message) {
+		static const std::string attributeRequest = "v1/devices/me/attributes/request/";
+		static const std::string chunkRequest = "v2/fw/request/";
+
+		if (!message.topic.compare(0, attributeRequest.size(), attributeRequest)) {
+			std::ostringstream response;
+			response << "{\"shared\":{\"fw_title\":\"" << title << "\",\"fw_version\":\"" << version
+				<< "\",\"fw_size\":" << image.size() << ",\"fw_checksum_algorithm\":\"CRC32\""
+				<< ",\"fw_checksum\":\"" << crc32(image) << "\"}}";
+			broker.publish("v1/devices/me/attributes/response/" + message.topic.substr(attributeRequest.size()),
+				response.str());
+		}
+		else if (!message.topic.compare(0, chunkRequest.size(), chunkRequest)) {
+			// v2/fw/request/$id/chunk/$n, payload is the chunk size
+			const std::string path = message.topic.substr(chunkRequest.size());
+			const uint32_t number = strtoul(path.substr(path.rfind('/') + 1).c_str(), nullptr, 10);
+			const size_t size = strtoul(message.payload.c_str(), nullptr, 10);
+			requests.push_back(number);
+
+			Chunk chunk;
+			chunk.number = number;
+			chunk.topic = "v2/fw/response/" + path;
+			chunk.payload = number * size < image.size() ? image.substr(number * size, size) : std::string();
+			if (holdChunks)
+				held.push_back(chunk);
+			else
+				send(broker, chunk);
+		}
+	}
+
+	void send(Test_Broker& broker, const Chunk& chunk) {
+		if (chunksSent >= chunkLimit)
+			return;
+		++chunksSent;
+		bytesSent += chunk.payload.size();
+		broker.publish(chunk.topic, chunk.payload);
+	}
+};
+
+// Returns random bytes, the same for the same seed
+inline std::string randomImage(size_t size, uint32_t seed) {
+	std::mt19937 random(seed);
+	std::string image(size, '\0');
+	for (char& c : image)
+		c = static_cast<char>(random());
+	return image;
+}
+
+// Returns path of a temporary file with given name, unique per test process
+inline std::string tempPath(const std::string& name) {
+	const char* dir = getenv("TMPDIR");
+	return std::string(dir ? dir : "/tmp") + "/tb_" + std::to_string(getpid()) + "_" + name;
+}
+
+inline std::string readFile(const std::string& path) {
+	std::ifstream file(path, std::ios::binary);
+	return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+inline void writeFile(const std::string& path, const std::string& data) {
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	file.write(data.data(), data.size());
+}
+
+// Returns delta patch from the current image to the next one, made by
+// extras/make_delta.py, empty if it failed
+inline std::string makeDelta(const std::string& current, const std::string& next) {
+	const std::string currentPath = tempPath("delta_current.bin");
+	const std::string nextPath = tempPath("delta_next.bin");
+	const std::string patchPath = tempPath("delta_patch.bin");
+	writeFile(currentPath, current);
+	writeFile(nextPath, next);
+	const std::string command = "python3 ../make_delta.py " + currentPath + " " + nextPath + " " + patchPath;
+	const std::string patch = system(command.c_str()) ? std::string() : readFile(patchPath);
+	remove(currentPath.c_str());
+	remove(nextPath.c_str());
+	remove(patchPath.c_str());
+	return patch;
+}
+
+#endif // test_firmware_h
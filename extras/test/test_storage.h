@@ -0,0 +1,35 @@
+/*
+  test_storage.h - Persistent_Storage in memory, surviving instances of the
+  library like storage of a device survives reboots.
+*/
+#ifndef test_storage_h
+#define test_storage_h
+
+#include <ThingsBoard.h>
+#include <map>
+#include <string>
+
+class Test_Storage : public Persistent_Storage {
+public:
+	size_t load(const char* name, void* data, size_t size) override {
+		const auto it = blobs.find(name);
+		if (it == blobs.end() || it->second.size() > size)
+			return 0;
+		memcpy(data, it->second.data(), it->second.size());
+		return it->second.size();
+	}
+
+	bool save(const char* name, const void* data, size_t size) override {
+		++saves;
+		if (failSaves)
+			return false;
+		blobs[name].assign(static_cast<const char*>(data), size);
+		return true;
+	}
+
+	std::map<std::string, std::string> blobs;  // Saved blobs by name
+	size_t saves = 0;                           // Amount of save() calls
+	bool failSaves = false;                     // Should save() fail?
+};
+
+#endif // test_storage_h
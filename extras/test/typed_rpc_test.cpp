@@ -0,0 +1,137 @@
+// Tests of RPC callbacks with native signatures
+
+#include "test.h"
+#include "test_broker.h"
+#include <ThingsBoard.h>
+
+using ThingsBoard_Under_Test = ThingsBoardSized<64, 8, Test_Logger>;
+
+static int ledPin = -1;
+static bool ledOn = false;
+static int resets = 0;
+
+static bool setLed(int pin, bool on) {
+	ledPin = pin;
+	ledOn = on;
+	return on;
+}
+
+static double scale(double value, double factor) {
+	return value * factor;
+}
+
+static int square(int value) {
+	return value * value;
+}
+
+static void reset() {
+	++resets;
+}
+
+static RPC_Response status(const char* name) {
+	return RPC_Response(nullptr, name && !strcmp(name, "fan") ? "on" : "unknown");
+}
+
+static const char* const setLedParams[] = { "pin", "on" };
+static const char* const scaleParams[] = { "value", "factor" };
+static const char* const squareParams[] = { "value" };
+static const char* const statusParams[] = { "name" };
+
+// Sends RPC request and returns payload of the response, empty if none
+static std::string call(Test_Broker& broker, ThingsBoard_Under_Test& tb, const std::string& request) {
+	static uint32_t id = 0;
+	broker.published.clear();
+	broker.publish("v1/devices/me/rpc/request/" + std::to_string(++id), request);
+	tb.loop();
+	if (broker.published.size() != 1 || broker.published[0].topic != "v1/devices/me/rpc/response/" + std::to_string(id))
+		return std::string();
+	return broker.published[0].payload;
+}
+
+static void subscribe(ThingsBoard_Under_Test& tb) {
+	CHECK(tb.RPC_Subscribe({
+		RPC_Callback("setLed", setLed, setLedParams),
+		RPC_Callback("scale", scale, scaleParams),
+		RPC_Callback("square", square, squareParams),
+		RPC_Callback("reset", reset),
+		RPC_Callback("status", status, statusParams)
+	}));
+}
+
+static void test_named_params() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+	subscribe(tb);
+
+	// Order of fields does not matter, unknown ones are skipped
+	CHECK(call(broker, tb, "{\"method\":\"setLed\",\"params\":{\"on\":true,\"color\":\"red\",\"pin\":13}}") == "true");
+	CHECK(ledPin == 13 && ledOn);
+	CHECK(call(broker, tb, "{\"method\":\"scale\",\"params\":{\"value\":1.25,\"factor\":2}}") == "2.5");
+	CHECK(call(broker, tb, "{\"method\":\"status\",\"params\":{\"name\":\"fan\"}}") == "\"on\"");
+}
+
+static void test_positional_params() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+	subscribe(tb);
+
+	CHECK(call(broker, tb, "{\"method\":\"setLed\",\"params\":[5,true]}") == "true");
+	CHECK(ledPin == 5 && ledOn);
+
+	// Values beyond the arguments are skipped
+	CHECK(call(broker, tb, "{\"method\":\"scale\",\"params\":[3,4,5]}") == "12");
+}
+
+static void test_scalar_param() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+	subscribe(tb);
+
+	CHECK(call(broker, tb, "{\"method\":\"square\",\"params\":7}") == "49");
+	CHECK(call(broker, tb, "{\"method\":\"status\",\"params\":\"fan\"}") == "\"on\"");
+}
+
+static void test_missing_params() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+	subscribe(tb);
+
+	// Missing arguments are value-initialized
+	ledPin = -1;
+	CHECK(call(broker, tb, "{\"method\":\"setLed\",\"params\":{\"on\":true}}") == "true");
+	CHECK(ledPin == 0 && ledOn);
+	CHECK(call(broker, tb, "{\"method\":\"setLed\",\"params\":[7]}") == "false");
+	CHECK(ledPin == 7 && !ledOn);
+	CHECK(call(broker, tb, "{\"method\":\"square\"}") == "0");
+	CHECK(call(broker, tb, "{\"method\":\"status\",\"params\":{}}") == "\"unknown\"");
+}
+
+static void test_void_result() {
+	Test_Broker broker;
+	ThingsBoard_Under_Test tb(broker);
+	CHECK(tb.connect("broker", "token"));
+	subscribe(tb);
+
+	// Parameters of handlers without arguments are ignored
+	resets = 0;
+	CHECK(call(broker, tb, "{\"method\":\"reset\",\"params\":{\"delay\":10}}") == "null");
+	CHECK(resets == 1);
+}
+
+#ifdef EXPECT_COMPILE_ERROR
+// EXPECT_COMPILE_ERROR: amount of parameter names must match amount of callback arguments
+static const RPC_Callback mismatched("setLed", setLed, squareParams);
+#endif
+
+int main() {
+	RUN_TEST(test_named_params);
+	RUN_TEST(test_positional_params);
+	RUN_TEST(test_scalar_param);
+	RUN_TEST(test_missing_params);
+	RUN_TEST(test_void_result);
+	return testResult();
+}
@@ -1,6 +1,6 @@
 /*
   ThingsBoard.h - Library API for sending data to the ThingsBoard
-  Based on PubSub MQTT library.
+  Uses built-in MQTT 3.1.1 client.
   Created by Olender M. Oct 2018.
   Released into the public domain.
 */
@@ -11,30 +11,339 @@
 #include <ArduinoHttpClient.h>
 #endif
 
-#include <PubSubClient.h>
+#include <Client.h>
 #include <ArduinoJson.h>
 #include <ArduinoJson/Polyfills/type_traits.hpp>
 #include <vector>
+#include <new>
+#include <tuple>
+#include <type_traits>
 
 #define Default_Payload 64
 #define Default_Fields_Amt 8
 
+// Space for the fixed header and topic of MQTT packets. Buffers of the MQTT
+// client hold PayloadSize plus that many bytes.
+#ifndef THINGSBOARD_MQTT_HEADER_SIZE
+#define THINGSBOARD_MQTT_HEADER_SIZE 64
+#endif
+
+// MQTT keep alive interval in seconds
+#ifndef THINGSBOARD_MQTT_KEEPALIVE
+#define THINGSBOARD_MQTT_KEEPALIVE 15
+#endif
+
+// Time in milliseconds to wait for CONNACK from the server
+#ifndef THINGSBOARD_MQTT_TIMEOUT
+#define THINGSBOARD_MQTT_TIMEOUT 15000
+#endif
+
+// Define THINGSBOARD_ENABLE_MQTT5 to connect with MQTT 5 instead of 3.1.1.
+// Telemetry and attribute topics are then replaced by topic aliases, as far
+// as the server allows.
+// #define THINGSBOARD_ENABLE_MQTT5
+
+// Maximum amount of server-side RPC requests awaiting a deferred response
+#ifndef THINGSBOARD_MAX_PENDING_RPC
+#define THINGSBOARD_MAX_PENDING_RPC 2
+#endif
+
+// Time in milliseconds after which an unanswered deferred RPC is dropped
+#ifndef THINGSBOARD_RPC_TIMEOUT
+#define THINGSBOARD_RPC_TIMEOUT 10000
+#endif
+
+// Maximum amount of client-side RPC requests awaiting a response
+#ifndef THINGSBOARD_MAX_CLIENT_RPC
+#define THINGSBOARD_MAX_CLIENT_RPC 2
+#endif
+
+// Maximum amount of telemetry and attribute messages, also of gateway
+// sub-devices, published at QoS 1, which are not acknowledged by the broker
+// yet. 0 publishes them at QoS 0.
+#ifndef THINGSBOARD_QOS1_WINDOW
+#define THINGSBOARD_QOS1_WINDOW 0
+#endif
+
+// Maximum amount of QoS 1 messages kept until acknowledged, including ones
+// published while offline or waiting for room in the window
+#ifndef THINGSBOARD_QOS1_OUTBOX
+#define THINGSBOARD_QOS1_OUTBOX (2 * THINGSBOARD_QOS1_WINDOW)
+#endif
+
+// Amount of recent RPC request ids remembered to drop redelivered
+// requests, 0 disables duplicate suppression
+#ifndef THINGSBOARD_RPC_DEDUP_SIZE
+#define THINGSBOARD_RPC_DEDUP_SIZE 0
+#endif
+
+// Amount of cached responses of idempotent RPC methods, 0 disables the cache
+#ifndef THINGSBOARD_RPC_CACHE_SIZE
+#define THINGSBOARD_RPC_CACHE_SIZE 0
+#endif
+
+// Amount of telemetry keys, which last sent values are kept in memory,
+// 0 disables the cache
+#ifndef THINGSBOARD_TELEMETRY_CACHE_SIZE
+#define THINGSBOARD_TELEMETRY_CACHE_SIZE 0
+#endif
+
+// Maximum length of a cached telemetry key, including terminating zero
+#ifndef THINGSBOARD_TELEMETRY_KEY_SIZE
+#define THINGSBOARD_TELEMETRY_KEY_SIZE 16
+#endif
+
+// Maximum length of a cached telemetry string value, including terminating zero
+#ifndef THINGSBOARD_TELEMETRY_STRING_SIZE
+#define THINGSBOARD_TELEMETRY_STRING_SIZE 16
+#endif
+
+// Maximum amount of attribute requests awaiting a response
+#ifndef THINGSBOARD_MAX_ATTRIBUTE_REQUESTS
+#define THINGSBOARD_MAX_ATTRIBUTE_REQUESTS 2
+#endif
+
+// Amount of shared attributes, which last known values are mirrored in
+// memory, 0 disables the mirror
+#ifndef THINGSBOARD_ATTRIBUTE_MIRROR_SIZE
+#define THINGSBOARD_ATTRIBUTE_MIRROR_SIZE 0
+#endif
+
+// Maximum length of a mirrored attribute key, including terminating zero
+#ifndef THINGSBOARD_ATTRIBUTE_KEY_SIZE
+#define THINGSBOARD_ATTRIBUTE_KEY_SIZE 16
+#endif
+
+// Maximum length of a mirrored attribute value, serialized to JSON,
+// including terminating zero
+#ifndef THINGSBOARD_ATTRIBUTE_VALUE_SIZE
+#define THINGSBOARD_ATTRIBUTE_VALUE_SIZE 32
+#endif
+
+// Amount of client attribute keys, which hashes of last published values are
+// kept to publish only changed attributes, 0 publishes all attributes
+#ifndef THINGSBOARD_ATTRIBUTE_DIFF_SIZE
+#define THINGSBOARD_ATTRIBUTE_DIFF_SIZE 0
+#endif
+
+// Maximum length of a client attribute key, which published values are
+// compared, including terminating zero
+#ifndef THINGSBOARD_ATTRIBUTE_DIFF_KEY_SIZE
+#define THINGSBOARD_ATTRIBUTE_DIFF_KEY_SIZE 16
+#endif
+
+// Shared attribute updates, received within that many milliseconds, are
+// merged into a single update before passing them to callbacks, 0 passes
+// every update as it arrives
+#ifndef THINGSBOARD_ATTRIBUTE_COALESCE
+#define THINGSBOARD_ATTRIBUTE_COALESCE 0
+#endif
+
+// Define THINGSBOARD_GATEWAY_BATCH to pack telemetry of sub-devices, sent
+// through the gateway within that many milliseconds, into a single message.
+// Batch is sent earlier once it is full. Requires THINGSBOARD_ENABLE_GATEWAY.
+// #define THINGSBOARD_GATEWAY_BATCH 1000
+
+// Maximum amount of sub-devices in a single telemetry batch
+#ifndef THINGSBOARD_GATEWAY_BATCH_DEVICES
+#define THINGSBOARD_GATEWAY_BATCH_DEVICES 16
+#endif
+
+// Capacity of the gateway RPC routing table, in sub-devices. Keep it well
+// above the amount of routed devices, lookups slow down as it fills up.
+// 0 disables routing. Requires THINGSBOARD_ENABLE_GATEWAY.
+#ifndef THINGSBOARD_GATEWAY_DEVICES
+#define THINGSBOARD_GATEWAY_DEVICES 0
+#endif
+
+// Maximum amount of keys a single shared attribute callback is subscribed to
+#ifndef THINGSBOARD_SHARED_ATTRIBUTE_KEYS
+#define THINGSBOARD_SHARED_ATTRIBUTE_KEYS 8
+#endif
+
+// Define THINGSBOARD_ENABLE_RPC_WORKER to run RPC callbacks in a worker
+// task instead of the network loop (ESP32 and host builds only)
+#ifdef THINGSBOARD_ENABLE_RPC_WORKER
+
+// Maximum amount of RPC requests queued for the worker
+#ifndef THINGSBOARD_RPC_WORKER_QUEUE
+#define THINGSBOARD_RPC_WORKER_QUEUE 4
+#endif
+
+// Stack size of the worker task in bytes, used on ESP32
+#ifndef THINGSBOARD_RPC_WORKER_STACK
+#define THINGSBOARD_RPC_WORKER_STACK 4096
+#endif
+
+// Priority of the worker task, used on ESP32
+#ifndef THINGSBOARD_RPC_WORKER_PRIORITY
+#define THINGSBOARD_RPC_WORKER_PRIORITY 1
+#endif
+
+#if defined(ESP32)
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#elif !defined(ARDUINO)
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#else
+#error "RPC worker is supported on ESP32 and host builds only"
+#endif
+#include <atomic>
+
+#endif // THINGSBOARD_ENABLE_RPC_WORKER
+
+// Define THINGSBOARD_ENABLE_OTA to support firmware updates
+#ifdef THINGSBOARD_ENABLE_OTA
+
+// Size of a firmware chunk in bytes, up to PayloadSize. 0 requests chunks
+// of PayloadSize.
+#ifndef THINGSBOARD_OTA_CHUNK_SIZE
+#define THINGSBOARD_OTA_CHUNK_SIZE 0
+#endif
+
+// Maximum amount of firmware chunk requests in flight
+#ifndef THINGSBOARD_OTA_WINDOW
+#define THINGSBOARD_OTA_WINDOW 4
+#endif
+
+// Time in milliseconds without a chunk, after which chunk requests in
+// flight are sent again
+#ifndef THINGSBOARD_OTA_TIMEOUT
+#define THINGSBOARD_OTA_TIMEOUT 5000
+#endif
+
+// Amount of times chunk requests are sent again before the update fails
+#ifndef THINGSBOARD_OTA_RETRIES
+#define THINGSBOARD_OTA_RETRIES 5
+#endif
+
+// Amount of firmware bytes written between saves of the download progress,
+// which allow to resume the download after a reboot. Progress is saved into
+// the storage, set by setStorage(), if the sink supports resuming.
+#ifndef THINGSBOARD_OTA_SAVE_INTERVAL
+#define THINGSBOARD_OTA_SAVE_INTERVAL 16384
+#endif
+
+// Maximum size of the sink state, saved together with the download progress
+#ifndef THINGSBOARD_OTA_SINK_STATE
+#define THINGSBOARD_OTA_SINK_STATE 128
+#endif
+
+// Size of the buffer for the current image data, read by delta updates
+#ifndef THINGSBOARD_OTA_DELTA_BUFFER
+#define THINGSBOARD_OTA_DELTA_BUFFER 64
+#endif
+
+// Size of a firmware chunk in bytes, requested by a single HTTP request
+#ifndef THINGSBOARD_OTA_HTTP_CHUNK_SIZE
+#define THINGSBOARD_OTA_HTTP_CHUNK_SIZE 4096
+#endif
+
+// Size of the buffer, HTTP response with firmware is read through
+#ifndef THINGSBOARD_OTA_HTTP_BUFFER
+#define THINGSBOARD_OTA_HTTP_BUFFER 128
+#endif
+
+// Size of the buffer for the firmware information, read over HTTP, which is
+// about 200 bytes with a SHA256 checksum
+#ifndef THINGSBOARD_OTA_HTTP_INFO_SIZE
+#define THINGSBOARD_OTA_HTTP_INFO_SIZE 256
+#endif
+
+#if defined(ESP32)
+#include <esp_ota_ops.h>
+#elif defined(ESP8266)
+#include <Updater.h>
+#elif !defined(ARDUINO)
+#include <cstdio>
+#endif
+
+#endif // THINGSBOARD_ENABLE_OTA
+
+// Define THINGSBOARD_ENABLE_PROVISIONING to support device provisioning
+#ifdef THINGSBOARD_ENABLE_PROVISIONING
+
+// Size of the buffer for the access token, issued by provisioning
+#ifndef THINGSBOARD_PROVISION_TOKEN_SIZE
+#define THINGSBOARD_PROVISION_TOKEN_SIZE 64
+#endif
+
+// Time in milliseconds to wait for the provisioning response
+#ifndef THINGSBOARD_PROVISION_TIMEOUT
+#define THINGSBOARD_PROVISION_TIMEOUT 10000
+#endif
+
+#endif // THINGSBOARD_ENABLE_PROVISIONING
+
+// Size in bytes of a callable object, that can be stored inside a callback
+#ifndef THINGSBOARD_CALLBACK_SIZE
+#define THINGSBOARD_CALLBACK_SIZE (4 * sizeof(void*))
+#endif
+
 class ThingsBoardDefaultLogger;
 
+template <size_t PayloadSize = Default_Payload,
+	size_t MaxFieldsAmt = Default_Fields_Amt,
+	typename Logger = ThingsBoardDefaultLogger>
+class ThingsBoardSized;
+
+#ifndef ESP8266
+template <size_t PayloadSize = Default_Payload,
+	size_t MaxFieldsAmt = Default_Fields_Amt,
+	typename Logger = ThingsBoardDefaultLogger>
+class ThingsBoardHttpSized;
+#endif
+
+// Computes 32-bit FNV-1a hash of the data, may be chained through hash
+inline uint32_t fnv1a_hash(const void* data, size_t length, uint32_t hash = 2166136261UL) {
+	const uint8_t* bytes = static_cast<const uint8_t*>(data);
+	for (size_t i = 0; i < length; ++i) {
+		hash ^= bytes[i];
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+// Writer for serializeJson(), which hashes the output instead of storing it
+class FNV1a_Writer {
+public:
+	inline FNV1a_Writer(uint32_t hash = 2166136261UL)
+		:m_hash(hash) { }
+
+	inline size_t write(uint8_t c) {
+		m_hash = fnv1a_hash(&c, 1, m_hash);
+		return 1;
+	}
+
+	inline size_t write(const uint8_t* s, size_t n) {
+		m_hash = fnv1a_hash(s, n, m_hash);
+		return n;
+	}
+
+	inline uint32_t hash() const {
+		return m_hash;
+	}
+
+private:
+	uint32_t m_hash;    // Hash of the output so far
+};
+
 // Telemetry record class, allows to store different data using common interface.
 class Telemetry {
-	template <size_t PayloadSize = Default_Payload,
-		size_t MaxFieldsAmt = Default_Fields_Amt,
-		typename Logger = ThingsBoardDefaultLogger>
-		friend class ThingsBoardSized;
+	template <size_t PayloadSize, size_t MaxFieldsAmt, typename Logger>
+	friend class ThingsBoardSized;
 
 #ifndef ESP8266
-	template <size_t PayloadSize = Default_Payload,
-		size_t MaxFieldsAmt = Default_Fields_Amt,
-		typename Logger = ThingsBoardDefaultLogger>
-		friend class ThingsBoardHttpSized;
+	template <size_t PayloadSize, size_t MaxFieldsAmt, typename Logger>
+	friend class ThingsBoardHttpSized;
 #endif
 
+	template <size_t Capacity>
+	friend class Telemetry_Cache;
+
 public:
 	inline Telemetry()
 		:m_type(TYPE_NONE), m_key(nullptr), m_value() { }
@@ -67,6 +376,13 @@ public:
 		m_value.str = val;
 	}
 
+	// Constructs telemetry record from serialized JSON, that is sent as is,
+	// e.g. Telemetry("config", serialized("{\"mode\":1}")).
+	inline Telemetry(const char* key, ARDUINOJSON_NAMESPACE::SerializedValue<const char*> val)
+		: m_type(TYPE_RAW), m_key(key), m_value() {
+		m_value.str = val.data();
+	}
+
 private:
 	// Data container
 	union data {
@@ -87,12 +403,31 @@ private:
 		TYPE_INT,
 		TYPE_REAL,
 		TYPE_STR,
+		TYPE_RAW,
 	};
 
 	dataType     m_type;	// Data type flag
 	const char* m_key;		// Data key
 	data         m_value;	// Data value
 
+	// Computes hash of the value, used to detect changed values.
+	uint32_t hashValue() const {
+		const uint32_t hash = fnv1a_hash(&m_type, sizeof(m_type));
+		switch (m_type) {
+		case TYPE_BOOL:
+			return fnv1a_hash(&m_value.boolean, sizeof(m_value.boolean), hash);
+		case TYPE_INT:
+			return fnv1a_hash(&m_value.integer, sizeof(m_value.integer), hash);
+		case TYPE_REAL:
+			return fnv1a_hash(&m_value.real, sizeof(m_value.real), hash);
+		case TYPE_STR:
+		case TYPE_RAW:
+			return m_value.str ? fnv1a_hash(m_value.str, strlen(m_value.str), hash) : hash;
+		default:
+			return hash;
+		}
+	}
+
 	// Serializes key-value pair in a generic way.
 	bool serializeKeyval(JsonVariant& jsonObj) const {
 		if (m_key) {
@@ -109,6 +444,9 @@ private:
 			case TYPE_STR:
 				jsonObj[m_key] = m_value.str;
 				break;
+			case TYPE_RAW:
+				jsonObj[m_key] = serialized(m_value.str);
+				break;
 			default:
 				break;
 			}
@@ -123,6 +461,8 @@ private:
 				return jsonObj.set(m_value.real);
 			case TYPE_STR:
 				return jsonObj.set(m_value.str);
+			case TYPE_RAW:
+				return jsonObj.set(serialized(m_value.str));
 			default:
 				break;
 			}
@@ -136,236 +476,5292 @@ using Attribute = Telemetry;
 using RPC_Response = Telemetry;
 // JSON object is used to communicate RPC parameters to the client
 using RPC_Data = JsonVariant;
+using Attribute_Data = JsonVariant;
 
-// RPC callback wrapper
-class RPC_Callback {
-	template <size_t PayloadSize, size_t MaxFieldsAmt, typename Logger>
-	friend class ThingsBoardSized;
+// Callable wrapper with fixed-size inline storage, used for callbacks.
+// Unlike std::function, it never allocates: function pointers and lambdas
+// with captures up to THINGSBOARD_CALLBACK_SIZE bytes are stored in place,
+// bigger callables are rejected at compile time.
+template <typename Signature, size_t Size = THINGSBOARD_CALLBACK_SIZE>
+class Inplace_Callback;
 
-public:
-	// RPC callback signature
-	using processFn = RPC_Response(*)(const RPC_Data & data);
+template <typename R, typename... Args, size_t Size>
+class Inplace_Callback<R(Args...), Size> {
+	// Checks that Fn can be called with Args, returning something convertible to R
+	template <typename Fn, typename Result = decltype(std::declval<Fn&>()(std::declval<Args>()...))>
+	struct Callable : std::integral_constant<bool,
+		std::is_void<R>::value || std::is_convertible<Result, R>::value> { };
 
+	template <typename Fn>
+	using EnableIfCallable = typename std::enable_if<
+		!std::is_same<typename std::decay<Fn>::type, Inplace_Callback>::value
+		&& Callable<typename std::decay<Fn>::type>::value>::type;
+
+public:
 	// Constructs empty callback
-	inline RPC_Callback()
-		:m_name(), m_cb(nullptr) {  }
+	inline Inplace_Callback()
+		:m_invoke(nullptr), m_manage(nullptr) { }
 
-	// Constructs callback that will be fired upon a RPC request arrival with
-	// given method name
-	inline RPC_Callback(const char* methodName, processFn cb)
-		: m_name(methodName), m_cb(cb) {  }
+	inline Inplace_Callback(std::nullptr_t)
+		:m_invoke(nullptr), m_manage(nullptr) { }
+
+	// Constructs callback, storing a copy of the callable object in place
+	template <typename Fn, typename = EnableIfCallable<Fn>>
+	inline Inplace_Callback(Fn fn)
+		:m_invoke(nullptr), m_manage(nullptr) {
+		static_assert(sizeof(Fn) <= Size, "callable is too big, increase THINGSBOARD_CALLBACK_SIZE");
+		static_assert(alignof(Fn) <= alignof(Storage), "callable alignment is not supported");
+		if (isNull(fn))
+			return;
+		new (&m_storage) Fn(fn);
+		m_invoke = &invoke<Fn>;
+		m_manage = &manage<Fn>;
+	}
+
+	inline Inplace_Callback(const Inplace_Callback& other)
+		:m_invoke(other.m_invoke), m_manage(other.m_manage) {
+		if (m_manage)
+			m_manage(&m_storage, &other.m_storage);
+	}
+
+	Inplace_Callback& operator=(const Inplace_Callback& other) {
+		if (this != &other) {
+			reset();
+			m_invoke = other.m_invoke;
+			m_manage = other.m_manage;
+			if (m_manage)
+				m_manage(&m_storage, &other.m_storage);
+		}
+		return *this;
+	}
+
+	inline ~Inplace_Callback() {
+		reset();
+	}
+
+	// Returns true if callback holds a callable object
+	inline explicit operator bool() const {
+		return m_invoke != nullptr;
+	}
+
+	// Calls stored callable object. Callback must not be empty.
+	inline R operator()(Args... args) const {
+		return m_invoke(&m_storage, std::forward<Args>(args)...);
+	}
 
 private:
-	const char* m_name;    // Method name
-	processFn   m_cb;      // Callback to call
+	// Storage, aligned for pointers and doubles captured by value
+	union Storage {
+		void*         ptr;
+		void        (*fn)();
+		double        real;
+		unsigned char bytes[Size];
+	};
+
+	template <typename Fn>
+	static R invoke(void* storage, Args... args) {
+		return (*static_cast<Fn*>(storage))(std::forward<Args>(args)...);
+	}
+
+	// Copies callable object into dst if src is given, destroys dst otherwise
+	template <typename Fn>
+	static void manage(void* dst, const void* src) {
+		if (src)
+			new (dst) Fn(*static_cast<const Fn*>(src));
+		else
+			static_cast<Fn*>(dst)->~Fn();
+	}
+
+	template <typename Fn>
+	static bool isNull(const Fn&) {
+		return false;
+	}
+
+	template <typename T>
+	static bool isNull(T* fn) {
+		return fn == nullptr;
+	}
+
+	inline void reset() {
+		if (m_manage)
+			m_manage(&m_storage, nullptr);
+		m_invoke = nullptr;
+		m_manage = nullptr;
+	}
+
+	mutable Storage m_storage;                  // Callable object
+	R(*m_invoke)(void*, Args...);               // Calls object of the stored type
+	void(*m_manage)(void*, const void*);        // Copies or destroys object of the stored type
 };
 
-class ThingsBoardDefaultLogger
-{
-public:
-	static void log(const char* msg) {
-#ifndef THINGSBOARD_NO_LOG
-		Serial.print(F("[TB] "));
-		Serial.println(msg);
-#endif
+// Compile-time sequence of indices, used to expand typed RPC handler arguments
+template <size_t... I>
+struct RPC_Indices { };
+
+template <size_t N, size_t... I>
+struct RPC_Make_Indices : RPC_Make_Indices<N - 1, N - 1, I...> { };
+
+template <size_t... I>
+struct RPC_Make_Indices<0, I...> {
+	using type = RPC_Indices<I...>;
+};
+
+// Storage type of a typed RPC handler argument
+template <typename T>
+using RPC_Arg = typename ARDUINOJSON_NAMESPACE::remove_const<
+	typename ARDUINOJSON_NAMESPACE::remove_reference<T>::type>::type;
+
+// Arguments of a typed RPC handler, extracted from RPC parameters.
+class RPC_Typed_Params_Base {
+protected:
+	// Returns position of the parameter name in the list, or count if missing
+	static size_t indexOf(const char* key, const char* const* names, size_t count) {
+		for (size_t i = 0; i < count; ++i) {
+			if (key && !strcmp(key, names[i]))
+				return i;
+		}
+		return count;
 	}
 };
 
-// ThingsBoardSized client class
-template <size_t PayloadSize, size_t MaxFieldsAmt, typename Logger>
-class ThingsBoardSized
-{
+template <typename... Args>
+class RPC_Typed_Params : public RPC_Typed_Params_Base {
 public:
-	// Initializes ThingsBoardSized class with network client.
-	inline ThingsBoardSized(Client& client) :m_client(client) { }
+	// Fills arguments in a single pass over RPC parameters. Parameters may be
+	// an object with named fields, a positional array or, for handlers with
+	// one argument, a plain value. Missing arguments are value-initialized.
+	void resolve(const RPC_Data& params, const char* const* names) {
+		if (params.template is<JsonObject>()) {
+			for (const JsonPair& kv : params.template as<JsonObject>())
+				assign<0>(indexOf(kv.key().c_str(), names, sizeof...(Args)), kv.value());
+		}
+		else if (params.template is<JsonArray>()) {
+			size_t index = 0;
+			for (const JsonVariant& value : params.template as<JsonArray>())
+				assign<0>(index++, value);
+		}
+		else if (!params.isNull()) {
+			assign<0>(0, params);
+		}
+	}
 
-	// Destroys ThingsBoardSized class with network client.
-	inline ~ThingsBoardSized() { }
+	std::tuple<RPC_Arg<Args>...> m_values;	// Extracted argument values
 
-	// Connects to the specified ThingsBoard server and port.
-	// Access token is used to authenticate a client.
-	// Returns true on success, false otherwise.
-	bool connect(const char* host, const char* access_token, uint16_t port = 1883) {
-		if (!host || !access_token)
-			return false;
+private:
+	// Converts value to the type of argument with given index
+	template <size_t I>
+	typename ARDUINOJSON_NAMESPACE::enable_if<(I < sizeof...(Args))>::type
+		assign(size_t index, const JsonVariant& value) {
+		if (index == I) {
+			std::get<I>(m_values) = value.template as<typename std::tuple_element<I, std::tuple<RPC_Arg<Args>...>>::type>();
+			return;
+		}
+		assign<I + 1>(index, value);
+	}
 
-		RPC_Unsubscribe(); // Cleanup any subscriptions
-		m_client.setServer(host, port);
-		return m_client.connect("TbDev", access_token, nullptr);
+	template <size_t I>
+	typename ARDUINOJSON_NAMESPACE::enable_if<(I >= sizeof...(Args))>::type
+		assign(size_t, const JsonVariant&) { }
+};
+
+// Converts return value of a typed RPC handler to RPC response.
+template <typename R>
+struct RPC_Typed_Result {
+	template <typename Fn, typename... Args>
+	static RPC_Response call(Fn fn, Args&... args) {
+		return RPC_Response(nullptr, fn(args...));
 	}
+};
 
-	// Disconnects from ThingsBoard. Returns true on success.
-	inline void disconnect() {
-		m_client.disconnect();
+template <>
+struct RPC_Typed_Result<void> {
+	template <typename Fn, typename... Args>
+	static RPC_Response call(Fn fn, Args&... args) {
+		fn(args...);
+		return RPC_Response();
 	}
+};
 
-	// Returns true if connected, false otherwise.
-	inline bool connected() {
-		return m_client.connected();
+template <>
+struct RPC_Typed_Result<RPC_Response> {
+	template <typename Fn, typename... Args>
+	static RPC_Response call(Fn fn, Args&... args) {
+		return fn(args...);
 	}
+};
 
-	// Executes an event loop for PubSub client.
-	inline void loop() {
-		m_client.loop();
+template <>
+struct RPC_Typed_Result<double> {
+	template <typename Fn, typename... Args>
+	static RPC_Response call(Fn fn, Args&... args) {
+		return RPC_Response(nullptr, static_cast<float>(fn(args...)));
 	}
+};
 
-	//----------------------------------------------------------------------------
-	// Telemetry API
+// Calls handler with native signature R(Args...) on RPC parameters.
+template <typename R, typename... Args>
+class RPC_Typed_Handler {
+public:
+	using handlerFn = R(*)(Args...);
 
-	// Sends telemetry data to the ThingsBoard, returns true on success.
-	template<typename T> bool sendTelemetry(const char* key, const T& value) {
-		return sendKeyval(key, value);
+	inline RPC_Typed_Handler(handlerFn fn, const char* const* names)
+		:m_fn(fn), m_names(names) { }
+
+	RPC_Response operator()(const RPC_Data& data) const {
+		RPC_Typed_Params<Args...> params;
+		params.resolve(data, m_names);
+		return call(params, typename RPC_Make_Indices<sizeof...(Args)>::type());
 	}
 
-	inline bool sendTelemetry(const char* attrName, const String& value) {
-		return sendTelemetry(attrName, value.c_str());
+private:
+	template <size_t... I>
+	RPC_Response call(RPC_Typed_Params<Args...>& params, RPC_Indices<I...>) const {
+		return RPC_Typed_Result<R>::call(m_fn, std::get<I>(params.m_values)...);
 	}
 
-	// Sends aggregated telemetry to the ThingsBoard.
-	inline bool sendTelemetry(const Telemetry* data, size_t data_count) {
-		return sendDataArray(data, data_count);
+	handlerFn          m_fn;      // Handler to call
+	const char* const* m_names;   // Names of handler arguments
+};
+
+// Streaming JSON pull-parser. Walks a JSON document once with constant
+// memory: every call to next() advances to the next value or container
+// boundary, giving access to its key and value. Unlike JsonDocument, it is
+// not limited by amount of fields. Strings are decoded in place, so the
+// buffer must be writable and is modified by parsing. Nesting depth is
+// limited to 32 levels.
+class JSON_Pull_Parser {
+	template <size_t PayloadSize, size_t MaxFieldsAmt, typename Logger>
+	friend class ThingsBoardSized;
+
+public:
+#if ARDUINOJSON_HAS_INT64
+	using integer_t = int64_t;
+#else
+	using integer_t = int32_t;
+#endif
+
+private:
+#if ARDUINOJSON_HAS_INT64
+	using uinteger_t = uint64_t;
+#else
+	using uinteger_t = uint32_t;
+#endif
+	static constexpr integer_t INTEGER_MAX = static_cast<integer_t>(~static_cast<uinteger_t>(0) >> 1);
+	static constexpr integer_t INTEGER_MIN = -INTEGER_MAX - 1;
+	// Amount of decimal digits, that always fit into uinteger_t
+	static constexpr size_t INTEGER_DIGITS = sizeof(uinteger_t) * 12 / 5;
+
+public:
+	// Parsing events
+	enum Event {
+		EVENT_NONE,
+		EVENT_BEGIN_OBJECT,
+		EVENT_END_OBJECT,
+		EVENT_BEGIN_ARRAY,
+		EVENT_END_ARRAY,
+		EVENT_STRING,
+		EVENT_NUMBER,
+		EVENT_BOOL,
+		EVENT_NULL,
+	};
+
+	// Constructs parser of a null value, that has no more events
+	inline JSON_Pull_Parser()
+		:JSON_Pull_Parser(nullptr, 0) {
+		m_event = EVENT_NULL;
+		m_done = true;
+	}
+
+	// Constructs parser of the JSON document in a writable buffer
+	inline JSON_Pull_Parser(char* json, size_t length)
+		:m_pos(json), m_end(json + length), m_objects(0), m_depth(0)
+		, m_event(EVENT_NONE), m_needComma(false), m_done(false), m_error(false)
+		, m_decode(true), m_scoped(false), m_scopeDone(false), m_scopeDepth(0)
+		, m_key(nullptr), m_keyLength(0), m_str(nullptr), m_strLength(0), m_strDecoded(false)
+		, m_number(0), m_integer(0), m_isInteger(false), m_boolean(false) { }
+
+	// Advances to the next event. Returns false at the end of the document
+	// or on malformed JSON, see error().
+	bool next() {
+		if (m_error || m_done || (m_scoped && m_scopeDone))
+			return false;
+
+		m_key = nullptr;
+		m_keyLength = 0;
+		skipWhitespace();
+		if (m_pos >= m_end)
+			return fail();
+
+		if (m_depth > 0) {
+			const bool inObject = m_objects & (1UL << (m_depth - 1));
+			const char c = *m_pos;
+			if (c == '}' || c == ']') {
+				if ((c == '}') != inObject)
+					return fail();
+				++m_pos;
+				--m_depth;
+				m_event = inObject ? EVENT_END_OBJECT : EVENT_END_ARRAY;
+				finishValue();
+				return true;
+			}
+
+			if (m_needComma) {
+				if (c != ',')
+					return fail();
+				++m_pos;
+				skipWhitespace();
+			}
+
+			if (inObject) {
+				char* key = nullptr;
+				size_t keyLength = 0;
+				if (!parseString(key, keyLength))
+					return fail();
+				m_key = key;
+				m_keyLength = keyLength;
+
+				skipWhitespace();
+				if (m_pos >= m_end || *m_pos != ':')
+					return fail();
+				++m_pos;
+				skipWhitespace();
+			}
+		}
+
+		return parseValue();
+	}
+
+	// Skips the rest of the object or array, which beginning is the current
+	// event. Does nothing for other events.
+	void skip() {
+		if (m_event != EVENT_BEGIN_OBJECT && m_event != EVENT_BEGIN_ARRAY)
+			return;
+
+		const uint8_t depth = m_depth - 1;
+		const bool decode = m_decode;
+		m_decode = false;
+		while (m_depth > depth && next()) { }
+		m_decode = decode;
+	}
+
+	// Returns the current event
+	inline Event event() const {
+		return m_event;
+	}
+
+	// Returns nesting depth of the current event, 0 is the document itself
+	inline size_t depth() const {
+		return m_depth;
+	}
+
+	// Returns true if JSON is malformed
+	inline bool error() const {
+		return m_error;
+	}
+
+	// Returns key of the current value inside an object, nullptr otherwise
+	inline const char* key() const {
+		return m_key;
+	}
+
+	// Returns true if key of the current value is equal to the name
+	bool keyEquals(const char* name) const {
+		return m_key && equals(m_key, m_keyLength, name);
+	}
+
+	// Returns current string value
+	inline const char* string() const {
+		return m_event == EVENT_STRING ? m_str : nullptr;
+	}
+
+	// Returns length of the current string value
+	inline size_t stringLength() const {
+		return m_event == EVENT_STRING ? m_strLength : 0;
+	}
+
+	// Returns true if current value is a string equal to the name
+	bool stringEquals(const char* name) const {
+		return m_event == EVENT_STRING && equals(m_str, m_strLength, name);
+	}
+
+	// Returns current number value
+	inline double number() const {
+		return m_number;
+	}
+
+	// Returns current number value, truncated to integer
+	inline integer_t integer() const {
+		return m_integer;
+	}
+
+	// Returns true if current number has no fraction and exponent
+	inline bool isInteger() const {
+		return m_event == EVENT_NUMBER && m_isInteger;
+	}
+
+	// Returns current boolean value
+	inline bool boolean() const {
+		return m_boolean;
+	}
+
+private:
+	static bool equals(const char* str, size_t length, const char* name) {
+		return strlen(name) == length && !memcmp(str, name, length);
+	}
+
+	inline bool fail() {
+		m_error = true;
+		return false;
+	}
+
+	inline void skipWhitespace() {
+		while (m_pos < m_end && (*m_pos == ' ' || *m_pos == '\t' || *m_pos == '\n' || *m_pos == '\r'))
+			++m_pos;
+	}
+
+	// Called after a complete value, marks end of the document or scope
+	inline void finishValue() {
+		m_needComma = true;
+		if (m_depth == 0)
+			m_done = true;
+		if (m_scoped && m_depth == m_scopeDepth)
+			m_scopeDone = true;
+	}
+
+	bool parseValue() {
+		const char c = *m_pos;
+		if (c == '{' || c == '[') {
+			if (m_depth >= 32)
+				return fail();
+			++m_pos;
+			if (c == '{')
+				m_objects |= 1UL << m_depth;
+			else
+				m_objects &= ~(1UL << m_depth);
+			++m_depth;
+			m_needComma = false;
+			m_event = c == '{' ? EVENT_BEGIN_OBJECT : EVENT_BEGIN_ARRAY;
+			return true;
+		}
+
+		if (c == '"') {
+			if (!parseString(m_str, m_strLength))
+				return fail();
+			m_strDecoded = m_decode;
+			m_event = EVENT_STRING;
+		}
+		else if (c == 't' || c == 'f' || c == 'n') {
+			const char* literal = c == 't' ? "true" : c == 'f' ? "false" : "null";
+			const size_t length = strlen(literal);
+			if (static_cast<size_t>(m_end - m_pos) < length || memcmp(m_pos, literal, length))
+				return fail();
+			m_pos += length;
+			m_boolean = c == 't';
+			m_event = c == 'n' ? EVENT_NULL : EVENT_BOOL;
+		}
+		else if (!parseNumber()) {
+			return fail();
+		}
+
+		finishValue();
+		return true;
+	}
+
+	// Parses string, m_pos points to the opening quote. If decoding is on,
+	// string is decoded in place and terminated with zero.
+	bool parseString(char*& str, size_t& length) {
+		if (*m_pos != '"')
+			return false;
+
+		char* start = ++m_pos;
+		while (m_pos < m_end && *m_pos != '"') {
+			if (*m_pos == '\\')
+				++m_pos;
+			++m_pos;
+		}
+		if (m_pos >= m_end)
+			return false;
+
+		str = start;
+		length = m_pos - start;
+		++m_pos;
+		if (m_decode)
+			length = decode(start, length);
+		return true;
+	}
+
+	// Decodes current string, if it was parsed without decoding
+	void decodeString() {
+		if (m_event == EVENT_STRING && !m_strDecoded) {
+			m_strLength = decode(m_str, m_strLength);
+			m_strDecoded = true;
+		}
+	}
+
+	// Decodes escape sequences of the raw string in place, terminates it with
+	// zero and returns decoded length. Decoded string is never longer than
+	// raw one, and the terminating zero replaces the closing quote at most.
+	static size_t decode(char* str, size_t length) {
+		char* out = str;
+		const char* in = str;
+		const char* end = str + length;
+		while (in < end) {
+			char c = *in++;
+			if (c != '\\' || in >= end) {
+				*out++ = c;
+				continue;
+			}
+
+			c = *in++;
+			switch (c) {
+			case 'b': *out++ = '\b'; break;
+			case 'f': *out++ = '\f'; break;
+			case 'n': *out++ = '\n'; break;
+			case 'r': *out++ = '\r'; break;
+			case 't': *out++ = '\t'; break;
+			case 'u': {
+				uint32_t codepoint = 0;
+				if (!parseHex(in, end, codepoint))
+					break;
+				// Surrogate pair encodes code point above U+FFFF
+				uint32_t low = 0;
+				if (codepoint >= 0xD800 && codepoint < 0xDC00 && end - in >= 6
+					&& in[0] == '\\' && in[1] == 'u') {
+					const char* next = in + 2;
+					if (parseHex(next, end, low) && low >= 0xDC00 && low < 0xE000) {
+						codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (low - 0xDC00);
+						in = next;
+					}
+				}
+				out = encodeUtf8(out, codepoint);
+				break;
+			}
+			default: *out++ = c; break;
+			}
+		}
+		*out = '\0';
+		return out - str;
+	}
+
+	static bool parseHex(const char*& in, const char* end, uint32_t& value) {
+		if (end - in < 4)
+			return false;
+		value = 0;
+		for (uint8_t i = 0; i < 4; ++i) {
+			const char c = *in++;
+			value <<= 4;
+			if (c >= '0' && c <= '9')
+				value |= c - '0';
+			else if (c >= 'a' && c <= 'f')
+				value |= c - 'a' + 10;
+			else if (c >= 'A' && c <= 'F')
+				value |= c - 'A' + 10;
+			else
+				return false;
+		}
+		return true;
+	}
+
+	static char* encodeUtf8(char* out, uint32_t codepoint) {
+		if (codepoint < 0x80) {
+			*out++ = static_cast<char>(codepoint);
+		}
+		else if (codepoint < 0x800) {
+			*out++ = static_cast<char>(0xC0 | (codepoint >> 6));
+			*out++ = static_cast<char>(0x80 | (codepoint & 0x3F));
+		}
+		else if (codepoint < 0x10000) {
+			*out++ = static_cast<char>(0xE0 | (codepoint >> 12));
+			*out++ = static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F));
+			*out++ = static_cast<char>(0x80 | (codepoint & 0x3F));
+		}
+		else {
+			*out++ = static_cast<char>(0xF0 | (codepoint >> 18));
+			*out++ = static_cast<char>(0x80 | ((codepoint >> 12) & 0x3F));
+			*out++ = static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F));
+			*out++ = static_cast<char>(0x80 | (codepoint & 0x3F));
+		}
+		return out;
+	}
+
+	bool parseNumber() {
+		bool negative = false;
+		if (*m_pos == '-') {
+			negative = true;
+			++m_pos;
+		}
+		if (m_pos >= m_end || *m_pos < '0' || *m_pos > '9')
+			return false;
+
+		// Magnitude is accumulated unsigned, and only while it cannot overflow
+		uinteger_t integer = 0;
+		double mantissa = 0;
+		int32_t exponent = 0;
+		size_t digits = 0;
+		while (m_pos < m_end && *m_pos >= '0' && *m_pos <= '9') {
+			if (digits < INTEGER_DIGITS)
+				integer = integer * 10 + static_cast<uinteger_t>(*m_pos - '0');
+			mantissa = mantissa * 10 + (*m_pos - '0');
+			++digits;
+			++m_pos;
+		}
+		// Too large for integer_t
+		m_isInteger = digits <= INTEGER_DIGITS
+			&& integer <= static_cast<uinteger_t>(INTEGER_MAX) + (negative ? 1 : 0);
+
+		if (m_pos < m_end && *m_pos == '.') {
+			m_isInteger = false;
+			++m_pos;
+			if (m_pos >= m_end || *m_pos < '0' || *m_pos > '9')
+				return false;
+			while (m_pos < m_end && *m_pos >= '0' && *m_pos <= '9') {
+				mantissa = mantissa * 10 + (*m_pos - '0');
+				--exponent;
+				++m_pos;
+			}
+		}
+
+		if (m_pos < m_end && (*m_pos == 'e' || *m_pos == 'E')) {
+			m_isInteger = false;
+			++m_pos;
+			bool negativeExponent = false;
+			if (m_pos < m_end && (*m_pos == '+' || *m_pos == '-')) {
+				negativeExponent = *m_pos == '-';
+				++m_pos;
+			}
+			if (m_pos >= m_end || *m_pos < '0' || *m_pos > '9')
+				return false;
+			int32_t value = 0;
+			while (m_pos < m_end && *m_pos >= '0' && *m_pos <= '9') {
+				if (value < 1000)
+					value = value * 10 + (*m_pos - '0');
+				++m_pos;
+			}
+			exponent += negativeExponent ? -value : value;
+		}
+
+		for (; exponent > 0; --exponent)
+			mantissa *= 10;
+		for (; exponent < 0; ++exponent)
+			mantissa /= 10;
+
+		m_number = negative ? -mantissa : mantissa;
+		// Negated off by one, so the minimum does not overflow
+		if (m_isInteger && negative && integer > 0)
+			m_integer = -static_cast<integer_t>(integer - 1) - 1;
+		else if (m_isInteger)
+			m_integer = static_cast<integer_t>(integer);
+		// Out of range double is clamped, as converting it is undefined
+		else if (m_number >= static_cast<double>(INTEGER_MAX))
+			m_integer = INTEGER_MAX;
+		else if (m_number <= static_cast<double>(INTEGER_MIN))
+			m_integer = INTEGER_MIN;
+		else
+			m_integer = static_cast<integer_t>(m_number);
+		m_event = EVENT_NUMBER;
+		return true;
+	}
+
+	// Limits parser to the current value: next() returns false once the
+	// value ends. Used to hand over a part of the document to a callback.
+	void enterScope() {
+		m_scoped = true;
+		m_key = nullptr;
+		m_keyLength = 0;
+		if (m_event == EVENT_BEGIN_OBJECT || m_event == EVENT_BEGIN_ARRAY) {
+			m_scopeDepth = m_depth - 1;
+			m_scopeDone = false;
+		}
+		else {
+			m_scopeDone = true;
+		}
+	}
+
+	char*     m_pos;            // Current position
+	char*     m_end;            // End of the document
+	uint32_t  m_objects;        // Bit per nesting level, set for objects, cleared for arrays
+	uint8_t   m_depth;          // Current nesting level
+	Event     m_event;          // Current event
+	bool      m_needComma;      // Must the next value be preceded by a comma?
+	bool      m_done;           // Is the document finished?
+	bool      m_error;          // Is the document malformed?
+	bool      m_decode;         // Are strings decoded in place?
+	bool      m_scoped;         // Is parser limited to a single value?
+	bool      m_scopeDone;      // Has that value ended?
+	uint8_t   m_scopeDepth;     // Nesting level of that value
+	const char* m_key;          // Key of the current value
+	size_t    m_keyLength;      // Length of the key
+	char*     m_str;            // Current string value
+	size_t    m_strLength;      // Length of the current string value
+	bool      m_strDecoded;     // Was current string decoded?
+	double    m_number;         // Current number value
+	integer_t m_integer;        // Current number value, as integer
+	bool      m_isInteger;      // Is current number an integer?
+	bool      m_boolean;        // Current boolean value
+};
+
+// Remembers last Capacity request ids, to recognize redelivered requests.
+template <size_t Capacity>
+class Recent_Ids {
+public:
+	inline Recent_Ids()
+		:m_ids(), m_next(0), m_count(0) { }
+
+	// Returns true if id was remembered before.
+	bool contains(uint32_t id) const {
+		for (size_t i = 0; i < m_count; ++i) {
+			if (m_ids[i] == id)
+				return true;
+		}
+		return false;
+	}
+
+	// Remembers id, forgetting the oldest one if full.
+	void remember(uint32_t id) {
+		m_ids[m_next] = id;
+		m_next = (m_next + 1) % Capacity;
+		if (m_count < Capacity)
+			++m_count;
+	}
+
+	// Forgets all ids.
+	inline void clear() {
+		m_next = 0;
+		m_count = 0;
+	}
+
+private:
+	uint32_t m_ids[Capacity];   // Ring of request ids
+	size_t m_next;              // Position of the next id to write
+	size_t m_count;             // Amount of valid ids
+};
+
+// Cache of serialized RPC responses, keyed by hash of the request.
+template <size_t PayloadSize, size_t Capacity>
+class RPC_Response_Cache {
+public:
+	inline RPC_Response_Cache()
+		:m_entries() { }
+
+	// Returns cached response for the request, nullptr if missing or expired.
+	const char* find(uint32_t hash) {
+		const uint32_t now = millis();
+		for (auto& entry : m_entries) {
+			if (entry.used && entry.hash == hash) {
+				if (now - entry.stored < entry.ttl)
+					return entry.response;
+				entry.used = false;
+			}
+		}
+		return nullptr;
+	}
+
+	// Stores response for the request for ttl milliseconds, replacing an
+	// expired or the oldest response if cache is full.
+	void store(uint32_t hash, uint32_t ttl, const char* response) {
+		const uint32_t now = millis();
+		Entry* target = &m_entries[0];
+		for (auto& entry : m_entries) {
+			if (!entry.used || entry.hash == hash || now - entry.stored >= entry.ttl) {
+				target = &entry;
+				break;
+			}
+			if (now - entry.stored > now - target->stored)
+				target = &entry;
+		}
+
+		target->used = true;
+		target->hash = hash;
+		target->stored = now;
+		target->ttl = ttl;
+		strncpy(target->response, response, PayloadSize - 1);
+		target->response[PayloadSize - 1] = '\0';
+	}
+
+private:
+	struct Entry {
+		bool     used;                      // Is entry occupied?
+		uint32_t hash;                      // Hash of the raw request
+		uint32_t stored;                    // Time of storing, in milliseconds
+		uint32_t ttl;                       // Time to live, in milliseconds
+		char     response[PayloadSize];     // Serialized response
+	};
+
+	Entry m_entries[Capacity];
+};
+
+// Last sent values of telemetry keys, with time they were sent.
+// Keys and string values are copied, so they must fit into
+// THINGSBOARD_TELEMETRY_KEY_SIZE and THINGSBOARD_TELEMETRY_STRING_SIZE.
+template <size_t Capacity>
+class Telemetry_Cache {
+public:
+	inline Telemetry_Cache()
+		:m_entries() { }
+
+	// Stores the value, replacing the least recently updated key if full.
+	// Returns false if key or value is too long to be cached.
+	bool update(const Telemetry& data) {
+		if (!data.m_key || strlen(data.m_key) >= THINGSBOARD_TELEMETRY_KEY_SIZE)
+			return false;
+		if ((data.m_type == Telemetry::TYPE_STR || data.m_type == Telemetry::TYPE_RAW)
+			&& (!data.m_value.str || strlen(data.m_value.str) >= THINGSBOARD_TELEMETRY_STRING_SIZE))
+			return false;
+
+		const uint32_t now = millis();
+		Entry* target = &m_entries[0];
+		for (auto& entry : m_entries) {
+			if (entry.used && !strcmp(entry.key, data.m_key)) {
+				target = &entry;
+				break;
+			}
+			if (!entry.used) {
+				if (target->used)
+					target = &entry;
+			}
+			else if (target->used && now - entry.updated > now - target->updated) {
+				target = &entry;
+			}
+		}
+
+		target->used = true;
+		target->updated = now;
+		strcpy(target->key, data.m_key);
+		target->value = data;
+		target->value.m_key = target->key;
+		if (data.m_type == Telemetry::TYPE_STR || data.m_type == Telemetry::TYPE_RAW) {
+			strcpy(target->str, data.m_value.str);
+			target->value.m_value.str = target->str;
+		}
+		return true;
+	}
+
+	// Adds {"value":...,"age":...} object for each cached key to the JSON
+	// object. Age is in milliseconds. If keys is an array or a string,
+	// only listed keys are added.
+	void serialize(JsonObject& object, const JsonVariant& keys) const {
+		const uint32_t now = millis();
+		for (const auto& entry : m_entries) {
+			if (!entry.used || !requested(entry.key, keys))
+				continue;
+
+			JsonVariant item = object.createNestedObject(entry.key);
+			Telemetry value = entry.value;
+			value.m_key = "value";
+			value.serializeKeyval(item);
+			item["age"] = now - entry.updated;
+		}
+	}
+
+private:
+	// Checks if key is listed in keys, absent keys list matches every key
+	static bool requested(const char* key, const JsonVariant& keys) {
+		if (keys.template is<JsonArray>()) {
+			for (const JsonVariant& requestedKey : keys.template as<JsonArray>()) {
+				const char* name = requestedKey.template as<const char*>();
+				if (name && !strcmp(name, key))
+					return true;
+			}
+			return false;
+		}
+		const char* name = keys.template as<const char*>();
+		return !name || !strcmp(name, key);
+	}
+
+	struct Entry {
+		bool      used;                                     // Is entry occupied?
+		uint32_t  updated;                                  // Time of the last update, in milliseconds
+		char      key[THINGSBOARD_TELEMETRY_KEY_SIZE];      // Copy of the key
+		char      str[THINGSBOARD_TELEMETRY_STRING_SIZE];   // Copy of the string value
+		Telemetry value;                                    // Value, pointing to key and str
+	};
+
+	Entry m_entries[Capacity];
+};
+
+// Hashes of last published values per key, to skip publishing values that
+// did not change. Oldest key is forgotten if full. Keys are copied, keys not
+// fitting into THINGSBOARD_ATTRIBUTE_DIFF_KEY_SIZE are always published.
+template <size_t Capacity>
+class Attribute_Diff {
+public:
+	inline Attribute_Diff()
+		:m_entries(), m_next(0), m_count(0) { }
+
+	// Returns true if value differs from the last published one, or the key
+	// was not published yet.
+	bool changed(const char* key, uint32_t value) const {
+		for (size_t i = 0; i < m_count; ++i) {
+			if (!strcmp(m_entries[i].key, key))
+				return m_entries[i].value != value;
+		}
+		return true;
+	}
+
+	// Remembers published value of the key
+	void store(const char* key, uint32_t value) {
+		if (strlen(key) >= THINGSBOARD_ATTRIBUTE_DIFF_KEY_SIZE)
+			return;
+		for (size_t i = 0; i < m_count; ++i) {
+			if (!strcmp(m_entries[i].key, key)) {
+				m_entries[i].value = value;
+				return;
+			}
+		}
+		strcpy(m_entries[m_next].key, key);
+		m_entries[m_next].value = value;
+		m_next = (m_next + 1) % Capacity;
+		if (m_count < Capacity)
+			++m_count;
+	}
+
+	// Forgets all values, so they are published again
+	inline void clear() {
+		m_next = 0;
+		m_count = 0;
+	}
+
+private:
+	struct Entry {
+		char     key[THINGSBOARD_ATTRIBUTE_DIFF_KEY_SIZE];  // Copy of the key
+		uint32_t value;                                     // Hash of the last published value
+	};
+
+	Entry m_entries[Capacity];  // Ring of published values
+	size_t m_next;              // Position of the next entry to write
+	size_t m_count;             // Amount of valid entries
+};
+
+// Storage for data, which must survive reboots, e.g. EEPROM, NVS or a file.
+// Data is saved and loaded as named blobs.
+class Persistent_Storage {
+public:
+	virtual ~Persistent_Storage() { }
+
+	// Loads blob into the buffer. Returns size of the blob, 0 if it is missing.
+	virtual size_t load(const char* name, void* data, size_t size) = 0;
+
+	// Saves blob, replacing the previous one. Returns false on failure.
+	virtual bool save(const char* name, const void* data, size_t size) = 0;
+};
+
+// Last known values of shared attributes, serialized to JSON. Each change of
+// a value is numbered with a sequence, so changes can be tracked.
+template <size_t Capacity>
+class Attribute_Mirror {
+public:
+	inline Attribute_Mirror()
+		:m_state(), m_dirty(false) {
+		m_state.magic = Magic;
+	}
+
+	// Stores the value, replacing the least recently updated key if full.
+	// Returns false if key or value is too long to be mirrored.
+	bool update(const char* key, const JsonVariant& value) {
+		if (!key || strlen(key) >= THINGSBOARD_ATTRIBUTE_KEY_SIZE
+			|| measureJson(value) >= THINGSBOARD_ATTRIBUTE_VALUE_SIZE)
+			return false;
+
+		const uint32_t now = millis();
+		Entry* target = &m_state.entries[0];
+		for (auto& entry : m_state.entries) {
+			if (entry.used && !strcmp(entry.key, key)) {
+				target = &entry;
+				break;
+			}
+			if (!entry.used) {
+				if (target->used)
+					target = &entry;
+			}
+			else if (target->used && now - entry.updated > now - target->updated) {
+				target = &entry;
+			}
+		}
+
+		char serialized[THINGSBOARD_ATTRIBUTE_VALUE_SIZE];
+		serializeJson(value, serialized, sizeof(serialized));
+
+		const bool same = target->used && !strcmp(target->key, key);
+		target->updated = now;
+		target->restored = false;
+		if (same && !strcmp(target->value, serialized))
+			return true;
+
+		target->used = true;
+		target->sequence = ++m_state.sequence;
+		strcpy(target->key, key);
+		strcpy(target->value, serialized);
+		m_dirty = true;
+		return true;
+	}
+
+	// Forgets the key, deleted on the server
+	void remove(const char* key) {
+		for (auto& entry : m_state.entries) {
+			if (entry.used && !strcmp(entry.key, key)) {
+				entry.used = false;
+				++m_state.sequence;
+				m_dirty = true;
+				return;
+			}
+		}
+	}
+
+	// Returns value serialized to JSON and optionally its sequence,
+	// nullptr if the key is missing
+	const char* value(const char* key, uint32_t* sequence) const {
+		const Entry* entry = find(key);
+		if (!entry)
+			return nullptr;
+		if (sequence)
+			*sequence = entry->sequence;
+		return entry->value;
+	}
+
+	// Returns true if the key is missing, or was updated more than max_age
+	// milliseconds ago. Values restored from storage are of unknown age, so
+	// they are stale unless max_age is 0.
+	bool stale(const char* key, uint32_t max_age) const {
+		const Entry* entry = find(key);
+		if (!entry)
+			return true;
+		if (!max_age)
+			return false;
+		return entry->restored || millis() - entry->updated > max_age;
+	}
+
+	// Returns true if values were changed since the last save
+	inline bool dirty() const {
+		return m_dirty;
+	}
+
+	// Restores values from the storage
+	bool load(Persistent_Storage& storage) {
+		State state;
+		if (storage.load(BlobName, &state, sizeof(state)) != sizeof(state) || state.magic != Magic)
+			return false;
+
+		m_state = state;
+		for (auto& entry : m_state.entries)
+			entry.restored = true;
+		m_dirty = false;
+		return true;
+	}
+
+	// Saves values to the storage
+	bool save(Persistent_Storage& storage) {
+		if (!storage.save(BlobName, &m_state, sizeof(m_state)))
+			return false;
+		m_dirty = false;
+		return true;
+	}
+
+private:
+	static constexpr const char* BlobName = "tb_attributes";
+	// Identifies layout of the saved blob
+	static constexpr uint32_t Magic = 0x54424D00UL ^ (Capacity << 16)
+		^ (THINGSBOARD_ATTRIBUTE_KEY_SIZE << 8) ^ THINGSBOARD_ATTRIBUTE_VALUE_SIZE;
+
+	struct Entry {
+		bool      used;                                     // Is entry occupied?
+		bool      restored;                                 // Was value restored from storage?
+		uint32_t  sequence;                                 // Sequence of the last change
+		uint32_t  updated;                                  // Time of the last update, in milliseconds
+		char      key[THINGSBOARD_ATTRIBUTE_KEY_SIZE];      // Copy of the key
+		char      value[THINGSBOARD_ATTRIBUTE_VALUE_SIZE];  // Value, serialized to JSON
+	};
+
+	// Saved as a single blob
+	struct State {
+		uint32_t  magic;                                    // Layout of the blob
+		uint32_t  sequence;                                 // Sequence of the last change
+		Entry     entries[Capacity];
+	};
+
+	const Entry* find(const char* key) const {
+		for (const auto& entry : m_state.entries) {
+			if (entry.used && !strcmp(entry.key, key))
+				return &entry;
+		}
+		return nullptr;
+	}
+
+	State m_state;
+	bool  m_dirty;                                          // Were values changed since the last save?
+};
+
+// Counters of RPC duplicate suppression and response cache
+struct RPC_Cache_Stats {
+	uint32_t hits;          // Requests answered from the cache
+	uint32_t misses;        // Requests to idempotent methods, that called the callback
+	uint32_t duplicates;    // Redelivered requests that were dropped
+};
+
+// Fixed-size table of requests waiting for completion, keyed by request id.
+// Each entry carries a timeout, expired entries are dropped by expire().
+template <typename T, size_t Capacity>
+class Pending_Table {
+public:
+	inline Pending_Table()
+		:m_slots() { }
+
+	// Reserves an entry for given request id.
+	// Returns nullptr if the table is full.
+	T* insert(uint32_t id, uint32_t timeout) {
+		for (auto& slot : m_slots) {
+			if (!slot.used) {
+				slot.used = true;
+				slot.id = id;
+				slot.started = millis();
+				slot.timeout = timeout;
+				slot.value = T();
+				return &slot.value;
+			}
+		}
+		return nullptr;
+	}
+
+	// Returns entry with given request id, nullptr if there is none.
+	T* find(uint32_t id) {
+		for (auto& slot : m_slots) {
+			if (slot.used && slot.id == id)
+				return &slot.value;
+		}
+		return nullptr;
+	}
+
+	// Releases entry with given request id, returns false if there is none.
+	bool remove(uint32_t id) {
+		for (auto& slot : m_slots) {
+			if (slot.used && slot.id == id) {
+				slot.used = false;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Releases entries waiting longer than their timeout.
+	// Calls fn(id, value) for each of them after it is released,
+	// so fn may insert new entries.
+	template<typename Fn> void expire(Fn fn) {
+		const uint32_t now = millis();
+		for (auto& slot : m_slots) {
+			if (slot.used && now - slot.started >= slot.timeout) {
+				T value = slot.value;
+				slot.used = false;
+				fn(slot.id, value);
+			}
+		}
+	}
+
+	// Returns amount of entries in use.
+	size_t size() const {
+		size_t count = 0;
+		for (const auto& slot : m_slots)
+			count += slot.used ? 1 : 0;
+		return count;
+	}
+
+private:
+	struct Slot {
+		uint32_t id;        // Request id
+		uint32_t started;   // Time of insertion, in milliseconds
+		uint32_t timeout;   // Allowed time to wait, in milliseconds
+		bool     used;      // Is slot occupied?
+		T        value;     // User data
+	};
+
+	Slot m_slots[Capacity];
+};
+
+// State of the MQTT connection, values of CONNACK return codes are positive
+enum MQTT_State : int8_t {
+	MQTT_STATE_AWAITING_CONNACK = -6,       // CONNECT sent, waiting for CONNACK
+	MQTT_STATE_OPENING = -5,                // Network connection is opened by the next loop()
+	MQTT_STATE_CONNECTION_TIMEOUT = -4,     // Server did not answer in time
+	MQTT_STATE_CONNECTION_LOST = -3,        // Network connection was closed
+	MQTT_STATE_CONNECT_FAILED = -2,         // Network connection failed
+	MQTT_STATE_DISCONNECTED = -1,           // Not connected yet, or disconnected
+	MQTT_STATE_CONNECTED = 0,
+	MQTT_STATE_BAD_PROTOCOL = 1,
+	MQTT_STATE_BAD_CLIENT_ID = 2,
+	MQTT_STATE_UNAVAILABLE = 3,
+	MQTT_STATE_BAD_CREDENTIALS = 4,
+	MQTT_STATE_UNAUTHORIZED = 5,
+};
+
+// MQTT 3.1.1 client on top of the network client, or MQTT 5 client if
+// THINGSBOARD_ENABLE_MQTT5 is defined. Outgoing packets are built in place in
+// the send buffer and written at once. Incoming packets are read in bulk into
+// the receive buffer, without blocking, and parsed in place: topic and
+// payload passed to the message callback point into the buffer. Incoming
+// packets larger than BufferSize are skipped and logged.
+template <size_t BufferSize, typename Logger>
+class MQTT_Client {
+public:
+	// Received message callback signature
+	using messageFn = Inplace_Callback<void(char* topic, uint8_t* payload, unsigned int length)>;
+
+	// Callback signature for PUBACK of a QoS 1 message
+	using ackFn = Inplace_Callback<void(uint16_t packetId)>;
+
+	inline MQTT_Client(Client& client)
+		:m_client(client), m_host(nullptr), m_port(0), m_messageCb(), m_ackCb()
+		, m_state(MQTT_STATE_DISCONNECTED), m_packetId(0), m_lastIn(0), m_lastOut(0)
+		, m_pingOutstanding(false), m_connectOffset(0), m_connectEnd(0)
+		, m_rxLength(0), m_rxHeader(0), m_rxTotal(0), m_rxSkip(0)
+#ifdef THINGSBOARD_ENABLE_MQTT5
+		, m_aliasTopics(nullptr), m_aliasCount(0), m_aliasMaximum(0), m_aliasesSent(0)
+		, m_keepAlive(THINGSBOARD_MQTT_KEEPALIVE), m_receiveMaximum(UINT16_MAX)
+#endif
+		, m_rx(), m_tx() { }
+
+	inline void setServer(const char* host, uint16_t port) {
+		m_host = host;
+		m_port = port;
+	}
+
+	inline void setCallback(const messageFn& cb) { m_messageCb = cb; }
+
+	inline void setAckCallback(const ackFn& cb) { m_ackCb = cb; }
+
+#ifdef THINGSBOARD_ENABLE_MQTT5
+	// Sets topics, which are published with topic aliases, up to 32 of them.
+	// Topic is sent once per connection, and its alias afterwards. Array
+	// must outlive the client.
+	inline void setTopicAliases(const char* const* topics, size_t count) {
+		m_aliasTopics = topics;
+		m_aliasCount = count < 32 ? count : 32;
+	}
+#endif
+
+	// Starts connecting to the server with a clean session. CONNECT packet
+	// is built right away, network connection is opened and CONNACK awaited
+	// by the following loop() calls. User and password may be nullptr.
+	bool beginConnect(const char* id, const char* user, const char* pass) {
+		if (connected())
+			return true;
+		if (connecting())
+			m_client.stop();
+
+		if (!m_host) {
+			m_state = MQTT_STATE_CONNECT_FAILED;
+			return false;
+		}
+
+		// Protocol name and level, flags and keep alive
+#ifdef THINGSBOARD_ENABLE_MQTT5
+		static const uint8_t header[] = { 0x00, 0x04, 'M', 'Q', 'T', 'T', 0x05 };
+#else
+		static const uint8_t header[] = { 0x00, 0x04, 'M', 'Q', 'T', 'T', 0x04 };
+#endif
+		size_t length = 5;
+		memcpy(m_tx + length, header, sizeof(header));
+		length += sizeof(header);
+		m_tx[length++] = 0x02 | (user ? 0x80 : 0x00) | (user && pass ? 0x40 : 0x00);
+		m_tx[length++] = THINGSBOARD_MQTT_KEEPALIVE >> 8;
+		m_tx[length++] = THINGSBOARD_MQTT_KEEPALIVE & 0xFF;
+#ifdef THINGSBOARD_ENABLE_MQTT5
+		// No properties, so the server uses no topic aliases either
+		m_tx[length++] = 0x00;
+#endif
+		if (!putString(length, id) || (user && !putString(length, user))
+			|| (user && pass && !putString(length, pass))) {
+			m_state = MQTT_STATE_CONNECT_FAILED;
+			return false;
+		}
+
+		// Send buffer is left alone until connected, so the packet waits there
+		m_connectOffset = finish(0x10, length);
+		m_connectEnd = length;
+		m_state = MQTT_STATE_OPENING;
+		return true;
+	}
+
+	// Connects to the server with a clean session and waits for CONNACK.
+	// User and password may be nullptr.
+	bool connect(const char* id, const char* user, const char* pass) {
+		if (!beginConnect(id, user, pass))
+			return false;
+		while (connecting())
+			loop();
+		return connected();
+	}
+
+	// Sends DISCONNECT and closes the network connection
+	void disconnect() {
+		if (m_state == MQTT_STATE_CONNECTED) {
+			static const uint8_t packet[] = { 0xE0, 0x00 };
+			m_client.write(packet, sizeof(packet));
+		}
+		m_client.stop();
+		m_state = MQTT_STATE_DISCONNECTED;
+	}
+
+	// Returns true if connected, noticing closed network connection
+	bool connected() {
+		if (m_state != MQTT_STATE_CONNECTED)
+			return false;
+		if (m_client.connected())
+			return true;
+
+		m_client.stop();
+		m_state = MQTT_STATE_CONNECTION_LOST;
+		return false;
+	}
+
+	// Returns true while connection, started by beginConnect(), is pending
+	inline bool connecting() const {
+		return m_state == MQTT_STATE_OPENING || m_state == MQTT_STATE_AWAITING_CONNACK;
+	}
+
+	// Returns state of the connection, or why the last connect() failed
+	inline int state() const { return m_state; }
+
+	// Handles all received packets and keeps the connection alive. Packet,
+	// which is not received completely, is finished by the next call.
+	// Pending connection is advanced by one step instead.
+	// Returns false if not connected.
+	bool loop() {
+		if (connecting()) {
+			continueConnect();
+			return connected();
+		}
+		if (!connected())
+			return false;
+
+#ifdef THINGSBOARD_ENABLE_MQTT5
+		// Server may set another keep alive in CONNACK, 0 turns it off
+		const uint32_t keepAlive = m_keepAlive * 1000UL;
+#else
+		const uint32_t keepAlive = THINGSBOARD_MQTT_KEEPALIVE * 1000UL;
+#endif
+		const uint32_t now = millis();
+		if (keepAlive && (now - m_lastIn > keepAlive || now - m_lastOut > keepAlive)) {
+			if (m_pingOutstanding) {
+				m_client.stop();
+				m_state = MQTT_STATE_CONNECTION_TIMEOUT;
+				return false;
+			}
+
+			static const uint8_t packet[] = { 0xC0, 0x00 };
+			memcpy(m_tx, packet, sizeof(packet));
+			if (!send(0, sizeof(packet)))
+				return connected();
+			m_pingOutstanding = true;
+			// Silence of the server is measured from the ping
+			m_lastIn = now;
+		}
+
+		while (readPacket()) {
+			m_lastIn = millis();
+			handlePacket();
+			m_rxLength = m_rxTotal = 0;
+			if (!connected())
+				return false;
+		}
+		// Malformed packet drops the connection
+		return connected();
+	}
+
+	// Publishes message at QoS 0, or at QoS 1 if packet id is not 0. Message
+	// sent before is marked with dup.
+	inline bool publish(const char* topic, const uint8_t* payload, size_t length,
+		uint16_t packetId = 0, bool dup = false) {
+		return publish(topic, length, [payload](uint8_t* data, size_t size) {
+			memcpy(data, payload, size);
+		}, packetId, dup);
+	}
+
+	inline bool publish(const char* topic, const char* payload) {
+		return publish(topic, reinterpret_cast<const uint8_t*>(payload), strlen(payload));
+	}
+
+	// Publishes message, which payload of given length is written in place
+	// by write(uint8_t* data, size_t length)
+	template <typename Writer>
+	bool publish(const char* topic, size_t length, Writer write, uint16_t packetId = 0, bool dup = false) {
+		if (!connected())
+			return false;
+
+		size_t offset = 5;
+#ifdef THINGSBOARD_ENABLE_MQTT5
+		// Topic, which alias is known to the server, is left empty
+		const uint16_t alias = topicAlias(topic);
+		const uint32_t aliasBit = alias ? 1UL << (alias - 1) : 0;
+		if (!putString(offset, (m_aliasesSent & aliasBit) ? "" : topic))
+			return false;
+#else
+		if (!putString(offset, topic))
+			return false;
+#endif
+		if (packetId) {
+			m_tx[offset++] = packetId >> 8;
+			m_tx[offset++] = packetId & 0xFF;
+		}
+#ifdef THINGSBOARD_ENABLE_MQTT5
+		if (BufferSize - offset < 4)
+			return false;
+		// Properties: topic alias only
+		m_tx[offset++] = alias ? 3 : 0;
+		if (alias) {
+			m_tx[offset++] = 0x23;
+			m_tx[offset++] = alias >> 8;
+			m_tx[offset++] = alias & 0xFF;
+		}
+#endif
+		if (length > BufferSize - offset)
+			return false;
+
+		write(m_tx + offset, length);
+		offset += length;
+		const uint8_t type = 0x30 | (packetId ? 0x02 : 0x00) | (dup ? 0x08 : 0x00);
+		if (!send(finish(type, offset), offset))
+			return false;
+#ifdef THINGSBOARD_ENABLE_MQTT5
+		m_aliasesSent |= aliasBit;
+#endif
+		return true;
+	}
+
+	// Subscribes to the topic at QoS 0
+	bool subscribe(const char* topic) {
+		if (!connected())
+			return false;
+
+		size_t length = 5;
+		putPacketId(length);
+		if (!putString(length, topic) || length == BufferSize)
+			return false;
+		// Subscription options: QoS 0
+		m_tx[length++] = 0x00;
+		return send(finish(0x82, length), length);
+	}
+
+	bool unsubscribe(const char* topic) {
+		if (!connected())
+			return false;
+
+		size_t length = 5;
+		putPacketId(length);
+		if (!putString(length, topic))
+			return false;
+		return send(finish(0xA2, length), length);
+	}
+
+	// Returns amount of QoS 1 messages the server accepts in flight, as
+	// announced in CONNACK
+	inline uint16_t receiveMaximum() const {
+#ifdef THINGSBOARD_ENABLE_MQTT5
+		return m_receiveMaximum;
+#else
+		return UINT16_MAX;
+#endif
+	}
+
+	// Returns unused packet id
+	inline uint16_t nextPacketId() {
+		if (!++m_packetId)
+			++m_packetId;
+		return m_packetId;
+	}
+
+private:
+	// Appends length-prefixed string to the send buffer.
+	// Returns false if it does not fit.
+	bool putString(size_t& length, const char* str) {
+		const size_t strLength = strlen(str);
+		if (strLength + 2 > BufferSize - length)
+			return false;
+		m_tx[length++] = strLength >> 8;
+		m_tx[length++] = strLength & 0xFF;
+		memcpy(m_tx + length, str, strLength);
+		length += strLength;
+		return true;
+	}
+
+	// Opens network connection and sends CONNECT, or checks for CONNACK.
+	// Opening the connection blocks for as long as the network client does.
+	void continueConnect() {
+		if (m_state == MQTT_STATE_OPENING) {
+			if (m_client.connect(m_host, m_port) != 1) {
+				m_state = MQTT_STATE_CONNECT_FAILED;
+				return;
+			}
+
+			m_rxLength = m_rxTotal = m_rxSkip = 0;
+			m_pingOutstanding = false;
+#ifdef THINGSBOARD_ENABLE_MQTT5
+			m_aliasMaximum = 0;
+			m_aliasesSent = 0;
+			m_keepAlive = THINGSBOARD_MQTT_KEEPALIVE;
+			m_receiveMaximum = UINT16_MAX;
+#endif
+			m_state = MQTT_STATE_AWAITING_CONNACK;
+			if (!send(m_connectOffset, m_connectEnd))
+				return;
+			// Answer of the server is awaited from now on
+			m_lastIn = millis();
+			return;
+		}
+
+		if (!readPacket()) {
+			if (m_state != MQTT_STATE_AWAITING_CONNACK)
+				return;
+			if (!m_client.connected() || millis() - m_lastIn >= THINGSBOARD_MQTT_TIMEOUT) {
+				m_client.stop();
+				m_state = MQTT_STATE_CONNECTION_TIMEOUT;
+			}
+			return;
+		}
+
+#ifdef THINGSBOARD_ENABLE_MQTT5
+		// CONNACK: session present flag, reason code and properties
+		const bool connack = (m_rx[0] & 0xF0) == 0x20 && m_rxTotal - m_rxHeader >= 3;
+		const uint8_t code = connack ? connectState(m_rx[m_rxHeader + 1]) : static_cast<uint8_t>(MQTT_STATE_BAD_PROTOCOL);
+		if (connack && !code)
+			readConnackProperties(m_rx + m_rxHeader + 2, m_rx + m_rxTotal);
+#else
+		// CONNACK: session present flag and return code
+		const bool connack = (m_rx[0] & 0xF0) == 0x20 && m_rxTotal - m_rxHeader == 2;
+		const uint8_t code = connack ? m_rx[m_rxHeader + 1] : static_cast<uint8_t>(MQTT_STATE_BAD_PROTOCOL);
+#endif
+		m_rxLength = m_rxTotal = 0;
+		if (code) {
+			m_client.stop();
+			m_state = static_cast<MQTT_State>(code);
+			return;
+		}
+
+		m_lastIn = millis();
+		m_state = MQTT_STATE_CONNECTED;
+	}
+
+	// Appends packet id, followed by empty properties for MQTT 5
+	inline void putPacketId(size_t& length) {
+		const uint16_t id = nextPacketId();
+		m_tx[length++] = id >> 8;
+		m_tx[length++] = id & 0xFF;
+#ifdef THINGSBOARD_ENABLE_MQTT5
+		m_tx[length++] = 0x00;
+#endif
+	}
+
+#ifdef THINGSBOARD_ENABLE_MQTT5
+	// Returns alias of the topic, 0 if it has none
+	uint16_t topicAlias(const char* topic) const {
+		for (size_t i = 0; i < m_aliasCount && i < m_aliasMaximum; ++i) {
+			if (m_aliasTopics[i] == topic || !strcmp(m_aliasTopics[i], topic))
+				return i + 1;
+		}
+		return 0;
+	}
+
+	// Maps CONNACK reason code to the state
+	static uint8_t connectState(uint8_t reason) {
+		switch (reason) {
+		case 0x00: return MQTT_STATE_CONNECTED;
+		case 0x84: return MQTT_STATE_BAD_PROTOCOL;
+		case 0x85: return MQTT_STATE_BAD_CLIENT_ID;
+		case 0x86: return MQTT_STATE_BAD_CREDENTIALS;
+		case 0x87: return MQTT_STATE_UNAUTHORIZED;
+		default: return MQTT_STATE_UNAVAILABLE;
+		}
+	}
+
+	// Reads variable byte integer. Returns false if it is malformed.
+	static bool readVarint(const uint8_t*& data, const uint8_t* end, size_t& value) {
+		value = 0;
+		for (size_t shift = 0; shift < 28; shift += 7) {
+			if (data == end)
+				return false;
+			const uint8_t digit = *data++;
+			value |= static_cast<size_t>(digit & 0x7F) << shift;
+			if (!(digit & 0x80))
+				return true;
+		}
+		return false;
+	}
+
+	// Reads topic alias maximum, server keep alive and receive maximum from
+	// CONNACK properties, skipping the others
+	void readConnackProperties(const uint8_t* data, const uint8_t* end) {
+		size_t length = 0;
+		if (!readVarint(data, end, length) || length > static_cast<size_t>(end - data))
+			return;
+
+		end = data + length;
+		while (data < end) {
+			const uint8_t id = *data++;
+			size_t size = 0;
+			switch (id) {
+			case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+				size = 1;
+				break;
+			case 0x13: case 0x21: case 0x22: case 0x23:
+				size = 2;
+				break;
+			case 0x02: case 0x11: case 0x18: case 0x27:
+				size = 4;
+				break;
+			case 0x0B:
+				if (!readVarint(data, end, size))
+					return;
+				size = 0;
+				break;
+			case 0x26:
+				// User property, a pair of strings
+				for (int i = 0; i < 2; ++i) {
+					if (end - data < 2)
+						return;
+					const size_t strLength = (data[0] << 8) | data[1];
+					if (static_cast<size_t>(end - data) < 2 + strLength)
+						return;
+					data += 2 + strLength;
+				}
+				break;
+			default:
+				// Strings and binary data
+				if (end - data < 2)
+					return;
+				size = 2 + ((data[0] << 8) | data[1]);
+				break;
+			}
+			if (static_cast<size_t>(end - data) < size)
+				return;
+			if (id == 0x13)
+				m_keepAlive = (data[0] << 8) | data[1];
+			else if (id == 0x21 && (data[0] || data[1]))
+				m_receiveMaximum = (data[0] << 8) | data[1];
+			else if (id == 0x22)
+				m_aliasMaximum = (data[0] << 8) | data[1];
+			data += size;
+		}
+	}
+#endif
+
+	// Writes fixed header right before the rest of the packet, which starts
+	// at offset 5. Returns offset of the packet in the send buffer.
+	size_t finish(uint8_t type, size_t length) {
+		size_t remaining = length - 5;
+		uint8_t header[5];
+		size_t headerLength = 0;
+		header[headerLength++] = type;
+		do {
+			const uint8_t digit = remaining % 128;
+			remaining /= 128;
+			header[headerLength++] = remaining ? digit | 0x80 : digit;
+		} while (remaining);
+
+		const size_t offset = 5 - headerLength;
+		memcpy(m_tx + offset, header, headerLength);
+		return offset;
+	}
+
+	// Writes bytes of the send buffer from offset to end, dropping the
+	// connection if they were written partially
+	bool send(size_t offset, size_t end) {
+		const size_t size = end - offset;
+		if (m_client.write(m_tx + offset, size) != size) {
+			m_client.stop();
+			m_state = MQTT_STATE_CONNECTION_LOST;
+			return false;
+		}
+		m_lastOut = millis();
+		return true;
+	}
+
+	// Reads available bytes of the next packet into the receive buffer.
+	// Returns true once the packet is complete.
+	bool readPacket() {
+		while (m_client.available() > 0) {
+			if (m_rxSkip) {
+				uint8_t scratch[32];
+				const int read = m_client.read(scratch, m_rxSkip < sizeof(scratch) ? m_rxSkip : sizeof(scratch));
+				if (read <= 0)
+					return false;
+				m_rxSkip -= read;
+				continue;
+			}
+
+			// Fixed header is read byte by byte, as its length is unknown
+			if (!m_rxTotal) {
+				const int c = m_client.read();
+				if (c < 0)
+					return false;
+				m_rx[m_rxLength++] = c;
+				if (m_rxLength == 1 || (c & 0x80)) {
+					if (m_rxLength == 5) {
+						// Remaining length of more than 4 bytes
+						m_client.stop();
+						m_state = MQTT_STATE_BAD_PROTOCOL;
+						return false;
+					}
+					continue;
+				}
+
+				size_t remaining = 0;
+				for (size_t i = m_rxLength - 1; i > 0; --i)
+					remaining = remaining * 128 + (m_rx[i] & 0x7F);
+				m_rxHeader = m_rxLength;
+				if (remaining > BufferSize - m_rxHeader) {
+					Logger::log("received packet too large, skipped");
+					m_rxSkip = remaining;
+					m_rxLength = 0;
+					continue;
+				}
+				m_rxTotal = m_rxHeader + remaining;
+				if (!remaining)
+					return true;
+				continue;
+			}
+
+			const int read = m_client.read(m_rx + m_rxLength, m_rxTotal - m_rxLength);
+			if (read <= 0)
+				return false;
+			m_rxLength += read;
+			if (m_rxLength == m_rxTotal)
+				return true;
+		}
+		return false;
+	}
+
+	// Handles complete packet in the receive buffer
+	void handlePacket() {
+		uint8_t* body = m_rx + m_rxHeader;
+		const size_t length = m_rxTotal - m_rxHeader;
+		switch (m_rx[0] & 0xF0) {
+		case 0x30: {
+			if (length < 2)
+				return;
+			const size_t topicLength = (body[0] << 8) | body[1];
+			const uint8_t qos = (m_rx[0] >> 1) & 0x03;
+			size_t offset = 2 + topicLength + (qos ? 2 : 0);
+			if (offset > length)
+				return;
+#ifdef THINGSBOARD_ENABLE_MQTT5
+			// Properties are skipped, the server uses no topic aliases
+			const uint8_t* properties = body + offset;
+			size_t propertiesLength = 0;
+			if (!readVarint(properties, body + length, propertiesLength)
+				|| propertiesLength > static_cast<size_t>(body + length - properties))
+				return;
+			offset = properties + propertiesLength - body;
+#endif
+			const uint16_t packetId = qos ? (body[2 + topicLength] << 8) | body[3 + topicLength] : 0;
+
+			// Topic is moved over its length to make room for the terminator
+			memmove(body + 1, body + 2, topicLength);
+			body[1 + topicLength] = '\0';
+			if (m_messageCb)
+				m_messageCb(reinterpret_cast<char*>(body + 1), body + offset, length - offset);
+
+			if (qos == 1) {
+				const uint8_t packet[] = { 0x40, 0x02, uint8_t(packetId >> 8), uint8_t(packetId & 0xFF) };
+				memcpy(m_tx, packet, sizeof(packet));
+				send(0, sizeof(packet));
+			}
+			break;
+		}
+		case 0x40:
+			// MQTT 5 adds reason code, rejected message is not sent again either
+			if (length >= 2 && m_ackCb)
+				m_ackCb((body[0] << 8) | body[1]);
+			break;
+		case 0xD0:
+			m_pingOutstanding = false;
+			break;
+		case 0xE0:
+			// MQTT 5 server closes the connection with a reason
+			m_client.stop();
+			m_state = MQTT_STATE_CONNECTION_LOST;
+			break;
+		default:
+			// SUBACK and UNSUBACK need no handling
+			break;
+		}
+	}
+
+	Client&     m_client;               // Network client
+	const char* m_host;                 // Server host
+	uint16_t    m_port;                 // Server port
+	messageFn   m_messageCb;            // Received message callback
+	ackFn       m_ackCb;                // PUBACK callback
+	MQTT_State  m_state;                // Connection state
+	uint16_t    m_packetId;             // Last used packet id
+	uint32_t    m_lastIn;               // Time of the last received packet
+	uint32_t    m_lastOut;              // Time of the last sent packet
+	bool        m_pingOutstanding;      // Is PINGRESP awaited?
+	size_t      m_connectOffset;        // Offset of CONNECT packet in the send buffer
+	size_t      m_connectEnd;           // End of CONNECT packet in the send buffer
+	size_t      m_rxLength;             // Amount of bytes of the packet received so far
+	size_t      m_rxHeader;             // Length of the fixed header of the packet
+	size_t      m_rxTotal;              // Length of the packet, 0 while fixed header is read
+	size_t      m_rxSkip;               // Amount of bytes of too large packet left to skip
+#ifdef THINGSBOARD_ENABLE_MQTT5
+	const char* const* m_aliasTopics;   // Topics published with aliases, alias is index + 1
+	size_t      m_aliasCount;           // Amount of topics with aliases
+	uint16_t    m_aliasMaximum;         // Highest alias the server accepts
+	uint32_t    m_aliasesSent;          // Bits of aliases known to the server
+	uint16_t    m_keepAlive;            // Keep alive in seconds, set by the server or ours
+	uint16_t    m_receiveMaximum;       // QoS 1 messages the server accepts in flight
+#endif
+	uint8_t     m_rx[BufferSize];       // Receive buffer
+	uint8_t     m_tx[BufferSize];       // Send buffer
+};
+
+#if THINGSBOARD_QOS1_WINDOW > 0
+// Messages published at QoS 1, stored in order of publishing until the
+// broker acknowledges them with PUBACK. Up to Window of them are in flight
+// at once, the rest wait in the outbox, as do messages published offline.
+// After reconnect messages in flight are sent again.
+template <size_t PayloadSize, size_t Capacity, size_t Window>
+class MQTT_Outbox {
+public:
+	enum Message_State : uint8_t {
+		MESSAGE_QUEUED,         // Waits to be sent
+		MESSAGE_IN_FLIGHT,      // Sent and waits for PUBACK
+		MESSAGE_ACKNOWLEDGED,   // Freed once messages before it are acknowledged
+	};
+
+	struct Message {
+		Message_State state;
+		uint16_t      packetId;     // Packet id, 0 if never sent
+		const char*   topic;        // Topic, must outlive the message
+		size_t        length;       // Length of the payload
+		char          payload[PayloadSize];
+	};
+
+	inline MQTT_Outbox()
+		:m_messages(), m_head(0), m_count(0), m_inFlight(0) { }
+
+	// Stores message. Returns false if the outbox is full.
+	bool push(const char* topic, const char* payload, size_t length) {
+		if (m_count == Capacity || length > PayloadSize)
+			return false;
+
+		Message& m = m_messages[(m_head + m_count) % Capacity];
+		m.state = MESSAGE_QUEUED;
+		m.packetId = 0;
+		m.topic = topic;
+		m.length = length;
+		memcpy(m.payload, payload, length);
+		++m_count;
+		return true;
+	}
+
+	// Returns the oldest message waiting to be sent, nullptr if there is
+	// none or the window, limited to limit messages, is full
+	Message* next(size_t limit = Window) {
+		if (m_inFlight >= Window || m_inFlight >= limit)
+			return nullptr;
+		for (size_t i = 0; i < m_count; ++i) {
+			Message& m = at(i);
+			if (m.state == MESSAGE_QUEUED)
+				return &m;
+		}
+		return nullptr;
+	}
+
+	// Marks message returned by next() as sent
+	inline void sent(Message& m) {
+		m.state = MESSAGE_IN_FLIGHT;
+		++m_inFlight;
+	}
+
+	// Frees message with given packet id. Returns false if none is in flight.
+	bool acknowledge(uint16_t packetId) {
+		for (size_t i = 0; i < m_count; ++i) {
+			Message& m = at(i);
+			if (m.state == MESSAGE_IN_FLIGHT && m.packetId == packetId) {
+				m.state = MESSAGE_ACKNOWLEDGED;
+				--m_inFlight;
+				while (m_count && at(0).state == MESSAGE_ACKNOWLEDGED) {
+					m_head = (m_head + 1) % Capacity;
+					--m_count;
+				}
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Makes messages in flight wait to be sent again, e.g. after reconnect
+	void requeue() {
+		for (size_t i = 0; i < m_count; ++i) {
+			Message& m = at(i);
+			if (m.state == MESSAGE_IN_FLIGHT)
+				m.state = MESSAGE_QUEUED;
+		}
+		m_inFlight = 0;
+	}
+
+	// Returns amount of messages not acknowledged yet
+	inline size_t size() const { return m_count; }
+
+private:
+	inline Message& at(size_t i) { return m_messages[(m_head + i) % Capacity]; }
+
+	Message m_messages[Capacity];   // Ring of messages
+	size_t  m_head;                 // Index of the oldest message
+	size_t  m_count;                // Amount of stored messages
+	size_t  m_inFlight;             // Amount of messages in flight
+};
+#endif
+
+// Identifies a server-side RPC request, which response is sent later with
+// ThingsBoardSized::RPC_Respond().
+class RPC_Token {
+	template <size_t PayloadSize, size_t MaxFieldsAmt, typename Logger>
+	friend class ThingsBoardSized;
+
+public:
+	// Constructs invalid token
+	inline RPC_Token()
+		:m_id(0) { }
+
+	// Returns id of the RPC request
+	inline uint32_t id() const {
+		return m_id;
+	}
+
+private:
+	inline explicit RPC_Token(uint32_t id)
+		:m_id(id) { }
+
+	uint32_t m_id;	// RPC request id, taken from the request topic
+};
+
+// RPC callback wrapper
+class RPC_Callback {
+	template <size_t PayloadSize, size_t MaxFieldsAmt, typename Logger>
+	friend class ThingsBoardSized;
+
+public:
+	// RPC callback signature
+	using processFn = Inplace_Callback<RPC_Response(const RPC_Data & data)>;
+
+	// Deferred RPC callback signature. Callback must return immediately,
+	// response is sent later by passing the token to RPC_Respond().
+	using deferredFn = Inplace_Callback<void(const RPC_Data & data, RPC_Token token)>;
+
+	// Streaming RPC callback signature. Parser is positioned at the params
+	// value, and next() walks through its contents.
+	using streamFn = Inplace_Callback<RPC_Response(JSON_Pull_Parser & params)>;
+
+	// Constructs empty callback
+	inline RPC_Callback()
+		:m_name(), m_cb(), m_deferredCb(), m_streamCb(), m_cacheTtl(0), m_inLoop(false) {  }
+
+	// Constructs callback that will be fired upon a RPC request arrival with
+	// given method name. Callback may be a function or a lambda with captures.
+	inline RPC_Callback(const char* methodName, processFn cb)
+		: m_name(methodName), m_cb(cb), m_deferredCb(), m_streamCb(), m_cacheTtl(0), m_inLoop(false) {  }
+
+	// Constructs callback that will be fired upon a RPC request arrival with
+	// given method name, and which response will be sent later
+	inline RPC_Callback(const char* methodName, deferredFn cb)
+		: m_name(methodName), m_cb(), m_deferredCb(cb), m_streamCb(), m_cacheTtl(0), m_inLoop(false) {  }
+
+	// Constructs callback, which parses RPC params on the fly without
+	// JsonDocument, so params are not limited by amount of fields.
+	inline RPC_Callback(const char* methodName, streamFn cb)
+		: m_name(methodName), m_cb(), m_deferredCb(), m_streamCb(cb), m_cacheTtl(0), m_inLoop(false) {  }
+
+	// Constructs callback with native signature, e.g. bool setLed(int pin, bool on).
+	// RPC parameters are converted to handler arguments by names, listed in
+	// the same order as arguments. Names must be an array, living as long as
+	// the callback, so temporaries are rejected at compile time.
+	template <typename R, typename... Args, typename Names>
+	inline RPC_Callback(const char* methodName, R(*cb)(Args...), Names& paramNames)
+		: m_name(methodName), m_cb(RPC_Typed_Handler<R, Args...>(cb, paramNames)), m_deferredCb(), m_streamCb(), m_cacheTtl(0), m_inLoop(false) {
+		static_assert(std::extent<Names>::value == sizeof...(Args),
+			"amount of parameter names must match amount of callback arguments");
+	}
+
+	// Constructs callback with native signature, taking no arguments.
+	template <typename R>
+	inline RPC_Callback(const char* methodName, R(*cb)())
+		: m_name(methodName), m_cb(RPC_Typed_Handler<R>(cb, nullptr)), m_deferredCb(), m_streamCb(), m_cacheTtl(0), m_inLoop(false) {  }
+
+	// Marks method as idempotent: its response is cached for ttl milliseconds
+	// and repeated requests with the same parameters are answered from the
+	// cache. Requires THINGSBOARD_RPC_CACHE_SIZE to be set.
+	inline RPC_Callback& idempotent(uint32_t ttl) {
+		m_cacheTtl = ttl;
+		return *this;
+	}
+
+	// Marks method to be always executed in the network loop, even if the
+	// RPC worker is enabled. Meant for fast callbacks reading data shared
+	// with loop().
+	inline RPC_Callback& inLoop() {
+		m_inLoop = true;
+		return *this;
+	}
+
+private:
+	const char* m_name;         // Method name
+	processFn   m_cb;           // Callback to call
+	deferredFn  m_deferredCb;   // Deferred callback to call
+	streamFn    m_streamCb;     // Streaming callback to call
+	uint32_t    m_cacheTtl;     // Response lifetime in cache, 0 if not cached
+	bool        m_inLoop;       // Is callback never passed to the RPC worker?
+};
+
+#ifdef THINGSBOARD_ENABLE_RPC_WORKER
+// Lock-free queue with fixed capacity, safe for exactly one producer thread
+// and one consumer thread.
+template <typename T, size_t Capacity>
+class SPSC_Queue {
+public:
+	inline SPSC_Queue()
+		:m_items(), m_head(0), m_tail(0) { }
+
+	// Appends a copy of the item, returns false if queue is full.
+	// Must be called from the producer thread only.
+	bool push(const T& item) {
+		const size_t tail = m_tail.load(std::memory_order_relaxed);
+		const size_t next = (tail + 1) % (Capacity + 1);
+		if (next == m_head.load(std::memory_order_acquire))
+			return false;
+
+		m_items[tail] = item;
+		m_tail.store(next, std::memory_order_release);
+		return true;
+	}
+
+	// Moves the oldest item out, returns false if queue is empty.
+	// Must be called from the consumer thread only.
+	bool pop(T& item) {
+		const size_t head = m_head.load(std::memory_order_relaxed);
+		if (head == m_tail.load(std::memory_order_acquire))
+			return false;
+
+		item = m_items[head];
+		m_head.store((head + 1) % (Capacity + 1), std::memory_order_release);
+		return true;
+	}
+
+private:
+	T m_items[Capacity + 1];        // One slot is kept free to tell full from empty
+	std::atomic<size_t> m_head;     // Next item to pop, written by consumer
+	std::atomic<size_t> m_tail;     // Next slot to push, written by producer
+};
+
+// Worker thread, sleeping until it is notified. FreeRTOS task on ESP32,
+// std::thread on host builds.
+class RPC_Worker_Thread {
+public:
+	using entryFn = void(*)(void* arg);
+
+#if defined(ESP32)
+	inline RPC_Worker_Thread()
+		:m_fn(nullptr), m_arg(nullptr), m_stop(false), m_task(nullptr) { }
+
+	// Starts the thread, running fn(arg). Returns true if thread is running.
+	bool start(entryFn fn, void* arg) {
+		if (m_task)
+			return true;
+
+		m_fn = fn;
+		m_arg = arg;
+		m_stop = false;
+		TaskHandle_t task = nullptr;
+		if (xTaskCreate(&run, "tb_rpc", THINGSBOARD_RPC_WORKER_STACK, this,
+			THINGSBOARD_RPC_WORKER_PRIORITY, &task) != pdPASS)
+			return false;
+		m_task = task;
+		return true;
+	}
+
+	// Wakes the thread up
+	inline void notify() {
+		TaskHandle_t task = m_task;
+		if (task)
+			xTaskNotifyGive(task);
+	}
+
+	// Called from the thread. Blocks until notified, returns false if the
+	// thread must exit.
+	inline bool wait() {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		return !m_stop;
+	}
+
+	// Called from the thread. Gives up the CPU for a short time.
+	inline void pause() {
+		vTaskDelay(1);
+	}
+
+	// Stops the thread and waits for it to exit
+	void stop() {
+		if (!m_task)
+			return;
+
+		m_stop = true;
+		notify();
+		while (m_task)
+			vTaskDelay(1);
+	}
+
+private:
+	static void run(void* self) {
+		RPC_Worker_Thread* thread = static_cast<RPC_Worker_Thread*>(self);
+		thread->m_fn(thread->m_arg);
+		thread->m_task = nullptr;
+		vTaskDelete(nullptr);
+	}
+
+	entryFn m_fn;                       // Thread function
+	void* m_arg;                        // Thread function argument
+	std::atomic<bool> m_stop;           // Must the thread exit?
+	std::atomic<TaskHandle_t> m_task;   // Running task, nullptr when stopped
+#else
+	inline RPC_Worker_Thread()
+		:m_thread(), m_mutex(), m_cv(), m_signaled(false), m_stop(false) { }
+
+	// Starts the thread, running fn(arg). Returns true if thread is running.
+	bool start(entryFn fn, void* arg) {
+		if (m_thread.joinable())
+			return true;
+
+		m_stop = false;
+		m_thread = std::thread(fn, arg);
+		return true;
+	}
+
+	// Wakes the thread up
+	inline void notify() {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_signaled = true;
+		}
+		m_cv.notify_one();
+	}
+
+	// Called from the thread. Blocks until notified, returns false if the
+	// thread must exit.
+	bool wait() {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_cv.wait(lock, [this]() { return m_signaled || m_stop; });
+		m_signaled = false;
+		return !m_stop;
+	}
+
+	// Called from the thread. Gives up the CPU for a short time.
+	inline void pause() {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	// Stops the thread and waits for it to exit
+	void stop() {
+		if (!m_thread.joinable())
+			return;
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_cv.notify_one();
+		m_thread.join();
+	}
+
+private:
+	std::thread m_thread;               // Running thread
+	std::mutex m_mutex;                 // Guards wake-up flags, not the queues
+	std::condition_variable m_cv;       // Signals wake-up
+	bool m_signaled;                    // Was the thread notified?
+	bool m_stop;                        // Must the thread exit?
+#endif
+};
+#endif // THINGSBOARD_ENABLE_RPC_WORKER
+
+#ifdef THINGSBOARD_ENABLE_OTA
+// Incremental CRC-32, as used by zip and Ethernet
+class OTA_CRC32 {
+public:
+	inline OTA_CRC32()
+		:m_crc(0xFFFFFFFFUL) { }
+
+	void update(const uint8_t* data, size_t length) {
+		// Table of CRCs of all 4-bit values
+		static const uint32_t table[16] = {
+			0x00000000UL, 0x1DB71064UL, 0x3B6E20C8UL, 0x26D930ACUL,
+			0x76DC4190UL, 0x6B6B51F4UL, 0x4DB26158UL, 0x5005713CUL,
+			0xEDB88320UL, 0xF00F9344UL, 0xD6D6A3E8UL, 0xCB61B38CUL,
+			0x9B64C2B0UL, 0x86D3D2D4UL, 0xA00AE278UL, 0xBDBDF21CUL,
+		};
+		for (size_t i = 0; i < length; ++i) {
+			m_crc ^= data[i];
+			m_crc = table[m_crc & 0x0F] ^ (m_crc >> 4);
+			m_crc = table[m_crc & 0x0F] ^ (m_crc >> 4);
+		}
+	}
+
+	inline uint32_t value() const {
+		return ~m_crc;
+	}
+
+private:
+	uint32_t m_crc;             // Current CRC, inverted
+};
+
+// Incremental SHA-256
+class OTA_SHA256 {
+public:
+	inline OTA_SHA256()
+		:m_state{ 0x6A09E667UL, 0xBB67AE85UL, 0x3C6EF372UL, 0xA54FF53AUL,
+			0x510E527FUL, 0x9B05688CUL, 0x1F83D9ABUL, 0x5BE0CD19UL }
+		, m_length(0), m_block(), m_blockLength(0) { }
+
+	void update(const uint8_t* data, size_t length) {
+		m_length += length;
+		while (length) {
+			const size_t part = length < sizeof(m_block) - m_blockLength ? length : sizeof(m_block) - m_blockLength;
+			memcpy(m_block + m_blockLength, data, part);
+			m_blockLength += part;
+			data += part;
+			length -= part;
+			if (m_blockLength == sizeof(m_block)) {
+				transform();
+				m_blockLength = 0;
+			}
+		}
+	}
+
+	// Finishes hashing and writes 32 bytes of the digest
+	void finish(uint8_t* digest) {
+		const uint64_t bits = m_length * 8;
+		const uint8_t padding = 0x80;
+		update(&padding, 1);
+		const uint8_t zero = 0;
+		while (m_blockLength != sizeof(m_block) - 8)
+			update(&zero, 1);
+		for (int8_t i = 7; i >= 0; --i)
+			m_block[m_blockLength++] = static_cast<uint8_t>(bits >> (i * 8));
+		transform();
+
+		for (uint8_t i = 0; i < 32; ++i)
+			digest[i] = static_cast<uint8_t>(m_state[i / 4] >> (24 - (i % 4) * 8));
+	}
+
+private:
+	static inline uint32_t rotr(uint32_t x, uint8_t n) {
+		return (x >> n) | (x << (32 - n));
+	}
+
+	void transform() {
+		static const uint32_t k[64] = {
+			0x428A2F98UL, 0x71374491UL, 0xB5C0FBCFUL, 0xE9B5DBA5UL, 0x3956C25BUL, 0x59F111F1UL, 0x923F82A4UL, 0xAB1C5ED5UL,
+			0xD807AA98UL, 0x12835B01UL, 0x243185BEUL, 0x550C7DC3UL, 0x72BE5D74UL, 0x80DEB1FEUL, 0x9BDC06A7UL, 0xC19BF174UL,
+			0xE49B69C1UL, 0xEFBE4786UL, 0x0FC19DC6UL, 0x240CA1CCUL, 0x2DE92C6FUL, 0x4A7484AAUL, 0x5CB0A9DCUL, 0x76F988DAUL,
+			0x983E5152UL, 0xA831C66DUL, 0xB00327C8UL, 0xBF597FC7UL, 0xC6E00BF3UL, 0xD5A79147UL, 0x06CA6351UL, 0x14292967UL,
+			0x27B70A85UL, 0x2E1B2138UL, 0x4D2C6DFCUL, 0x53380D13UL, 0x650A7354UL, 0x766A0ABBUL, 0x81C2C92EUL, 0x92722C85UL,
+			0xA2BFE8A1UL, 0xA81A664BUL, 0xC24B8B70UL, 0xC76C51A3UL, 0xD192E819UL, 0xD6990624UL, 0xF40E3585UL, 0x106AA070UL,
+			0x19A4C116UL, 0x1E376C08UL, 0x2748774CUL, 0x34B0BCB5UL, 0x391C0CB3UL, 0x4ED8AA4AUL, 0x5B9CCA4FUL, 0x682E6FF3UL,
+			0x748F82EEUL, 0x78A5636FUL, 0x84C87814UL, 0x8CC70208UL, 0x90BEFFFAUL, 0xA4506CEBUL, 0xBEF9A3F7UL, 0xC67178F2UL,
+		};
+
+		uint32_t w[64];
+		for (uint8_t i = 0; i < 16; ++i) {
+			w[i] = (static_cast<uint32_t>(m_block[i * 4]) << 24) | (static_cast<uint32_t>(m_block[i * 4 + 1]) << 16)
+				| (static_cast<uint32_t>(m_block[i * 4 + 2]) << 8) | m_block[i * 4 + 3];
+		}
+		for (uint8_t i = 16; i < 64; ++i) {
+			const uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			const uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+		uint32_t e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+		for (uint8_t i = 0; i < 64; ++i) {
+			const uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+			const uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+
+		m_state[0] += a;
+		m_state[1] += b;
+		m_state[2] += c;
+		m_state[3] += d;
+		m_state[4] += e;
+		m_state[5] += f;
+		m_state[6] += g;
+		m_state[7] += h;
+	}
+
+	uint32_t m_state[8];        // Intermediate hash
+	uint64_t m_length;          // Length of the hashed data in bytes
+	uint8_t  m_block[64];       // Block being filled
+	size_t   m_blockLength;     // Amount of bytes in the block
+};
+
+// Incremental verification of the firmware checksum, computed with the
+// algorithm named by the server
+class OTA_Checksum {
+public:
+	inline OTA_Checksum()
+		:m_algorithm(ALGORITHM_NONE), m_expected(), m_crc32(), m_sha256() { }
+
+	// Starts verification. Returns false if the algorithm is not supported.
+	bool begin(const char* algorithm, const char* expected) {
+		*this = OTA_Checksum();
+		if (!algorithm || !expected || strlen(expected) >= sizeof(m_expected))
+			return false;
+
+		if (!strcmp(algorithm, "CRC32"))
+			m_algorithm = ALGORITHM_CRC32;
+		else if (!strcmp(algorithm, "SHA256"))
+			m_algorithm = ALGORITHM_SHA256;
+		else
+			return false;
+
+		strcpy(m_expected, expected);
+		return true;
+	}
+
+	void update(const uint8_t* data, size_t length) {
+		if (m_algorithm == ALGORITHM_CRC32)
+			m_crc32.update(data, length);
+		else if (m_algorithm == ALGORITHM_SHA256)
+			m_sha256.update(data, length);
+	}
+
+	// Returns true if both checksums verify the same image
+	inline bool sameImage(const OTA_Checksum& other) const {
+		return m_algorithm == other.m_algorithm && !strcmp(m_expected, other.m_expected);
+	}
+
+	// Returns true if checksum of the whole image matches the expected one
+	bool verify() {
+		uint8_t digest[32];
+		size_t length = 0;
+		if (m_algorithm == ALGORITHM_CRC32) {
+			// Server formats CRC-32 as its bytes in little-endian order
+			const uint32_t crc = m_crc32.value();
+			for (; length < 4; ++length)
+				digest[length] = static_cast<uint8_t>(crc >> (length * 8));
+		}
+		else if (m_algorithm == ALGORITHM_SHA256) {
+			m_sha256.finish(digest);
+			length = 32;
+		}
+		else {
+			return false;
+		}
+
+		if (strlen(m_expected) != length * 2)
+			return false;
+
+		static const char hex[] = "0123456789abcdef";
+		for (size_t i = 0; i < length; ++i) {
+			if (tolower(m_expected[i * 2]) != hex[digest[i] >> 4]
+				|| tolower(m_expected[i * 2 + 1]) != hex[digest[i] & 0x0F])
+				return false;
+		}
+		return true;
+	}
+
+private:
+	enum Algorithm {
+		ALGORITHM_NONE,
+		ALGORITHM_CRC32,
+		ALGORITHM_SHA256,
+	};
+
+	Algorithm  m_algorithm;     // Checksum algorithm
+	char       m_expected[65];  // Expected checksum in hex
+	OTA_CRC32  m_crc32;         // CRC-32 of the data so far
+	OTA_SHA256 m_sha256;        // SHA-256 of the data so far
+};
+
+// Destination of the downloaded firmware image
+class OTA_Sink {
+public:
+	virtual ~OTA_Sink() { }
+
+	// Prepares writing of the image with given size
+	virtual bool begin(size_t size) = 0;
+
+	// Writes next part of the image
+	virtual bool write(const uint8_t* data, size_t length) = 0;
+
+	// Finishes writing. Image is finalized if it was verified, discarded
+	// otherwise. Last part of the image is written only after verification.
+	virtual bool end(bool verified) = 0;
+
+	// Makes data written so far durable and saves state, needed to resume
+	// writing after a reboot, into the buffer. Returns size of the state,
+	// 0 if writing can not be resumed.
+	virtual size_t saveState(uint8_t* state, size_t size) {
+		(void)state;
+		(void)size;
+		return 0;
+	}
+
+	// Resumes writing of the image with given size from the saved state
+	virtual bool resume(size_t size, const uint8_t* state, size_t length) {
+		(void)size;
+		(void)state;
+		(void)length;
+		return false;
+	}
+};
+
+#if defined(ESP32)
+// Writes firmware image into the next update partition. Sectors are erased
+// right before they are written, so writing can be resumed after a reboot.
+class ESP_OTA_Sink : public OTA_Sink {
+public:
+	inline ESP_OTA_Sink()
+		:m_partition(nullptr), m_size(0), m_written(0), m_erased(0) { }
+
+	bool begin(size_t size) override {
+		return start(size, 0);
+	}
+
+	bool write(const uint8_t* data, size_t length) override {
+		if (!m_partition || m_written + length > m_size)
+			return false;
+
+		if (m_written + length > m_erased) {
+			const size_t erase = (m_written + length - m_erased + SectorSize - 1) / SectorSize * SectorSize;
+			if (esp_partition_erase_range(m_partition, m_erased, erase) != ESP_OK)
+				return false;
+			m_erased += erase;
+		}
+		if (esp_partition_write(m_partition, m_written, data, length) != ESP_OK)
+			return false;
+		m_written += length;
+		return true;
+	}
+
+	bool end(bool verified) override {
+		const esp_partition_t* partition = m_partition;
+		m_partition = nullptr;
+		// Image is booted only if it is verified, boot partition validates it too
+		return verified && partition && m_written == m_size
+			&& esp_ota_set_boot_partition(partition) == ESP_OK;
+	}
+
+	size_t saveState(uint8_t* state, size_t size) override {
+		const uint32_t written = m_written;
+		if (!m_partition || size < sizeof(written))
+			return 0;
+		memcpy(state, &written, sizeof(written));
+		return sizeof(written);
+	}
+
+	bool resume(size_t size, const uint8_t* state, size_t length) override {
+		uint32_t written = 0;
+		if (length != sizeof(written))
+			return false;
+		memcpy(&written, state, sizeof(written));
+		return start(size, written);
+	}
+
+private:
+	static constexpr size_t SectorSize = 4096;
+
+	// Starts writing at given offset of the update partition
+	bool start(size_t size, size_t written) {
+		m_partition = esp_ota_get_next_update_partition(nullptr);
+		if (!m_partition || size > m_partition->size || written > size) {
+			m_partition = nullptr;
+			return false;
+		}
+		m_size = size;
+		m_written = written;
+		m_erased = written;
+
+		// Sector, written partly before the reboot, may contain data written
+		// after the state was saved, so it is erased and its start restored
+		const size_t sectorStart = written / SectorSize * SectorSize;
+		if (written == sectorStart)
+			return true;
+
+		uint8_t* sector = new (std::nothrow) uint8_t[written - sectorStart];
+		const bool restored = sector
+			&& esp_partition_read(m_partition, sectorStart, sector, written - sectorStart) == ESP_OK
+			&& esp_partition_erase_range(m_partition, sectorStart, SectorSize) == ESP_OK
+			&& esp_partition_write(m_partition, sectorStart, sector, written - sectorStart) == ESP_OK;
+		delete[] sector;
+		if (!restored) {
+			m_partition = nullptr;
+			return false;
+		}
+		m_erased = sectorStart + SectorSize;
+		return true;
+	}
+
+	const esp_partition_t* m_partition; // Update partition
+	size_t m_size;                      // Size of the image
+	size_t m_written;                   // Amount of bytes written
+	size_t m_erased;                    // End of the erased part of the partition
+};
+#elif defined(ESP8266)
+// Writes firmware image into the update partition
+class ESP_OTA_Sink : public OTA_Sink {
+public:
+	bool begin(size_t size) override {
+		return Update.begin(size);
+	}
+
+	bool write(const uint8_t* data, size_t length) override {
+		return Update.write(const_cast<uint8_t*>(data), length) == length;
+	}
+
+	bool end(bool verified) override {
+		if (verified)
+			return Update.end();
+		// Image is incomplete, so the update is discarded
+		Update.end(false);
+		return true;
+	}
+};
+#elif !defined(ARDUINO)
+// Writes firmware image into a file, used on host
+class File_OTA_Sink : public OTA_Sink {
+public:
+	inline File_OTA_Sink(const char* path)
+		:m_path(path), m_file(nullptr), m_written(0) { }
+
+	inline ~File_OTA_Sink() {
+		if (m_file)
+			fclose(m_file);
+	}
+
+	bool begin(size_t size) override {
+		(void)size;
+		if (m_file)
+			fclose(m_file);
+		m_file = fopen(m_path, "wb");
+		m_written = 0;
+		return m_file != nullptr;
+	}
+
+	bool write(const uint8_t* data, size_t length) override {
+		if (!m_file || fwrite(data, 1, length, m_file) != length)
+			return false;
+		m_written += length;
+		return true;
+	}
+
+	bool end(bool verified) override {
+		if (!m_file)
+			return false;
+		const bool closed = !fclose(m_file);
+		m_file = nullptr;
+		if (!verified)
+			remove(m_path);
+		return verified && closed;
+	}
+
+	size_t saveState(uint8_t* state, size_t size) override {
+		const uint32_t written = m_written;
+		if (!m_file || size < sizeof(written) || fflush(m_file))
+			return 0;
+		memcpy(state, &written, sizeof(written));
+		return sizeof(written);
+	}
+
+	bool resume(size_t size, const uint8_t* state, size_t length) override {
+		(void)size;
+		uint32_t written = 0;
+		if (length != sizeof(written))
+			return false;
+		memcpy(&written, state, sizeof(written));
+
+		if (m_file)
+			fclose(m_file);
+		m_file = fopen(m_path, "r+b");
+		if (!m_file || fseek(m_file, written, SEEK_SET)) {
+			if (m_file)
+				fclose(m_file);
+			m_file = nullptr;
+			return false;
+		}
+		m_written = written;
+		return true;
+	}
+
+private:
+	const char* m_path;         // Path of the image file
+	FILE* m_file;               // Image file being written
+	size_t m_written;           // Amount of bytes written
+};
+#endif
+
+// Reader of the current firmware image, which delta updates are applied to
+class OTA_Source {
+public:
+	virtual ~OTA_Source() { }
+
+	// Reads part of the current image at given offset
+	virtual bool read(size_t offset, uint8_t* data, size_t length) = 0;
+};
+
+#if defined(ESP32)
+// Reads the running firmware partition
+class ESP_OTA_Source : public OTA_Source {
+public:
+	inline ESP_OTA_Source()
+		:m_partition(esp_ota_get_running_partition()) { }
+
+	bool read(size_t offset, uint8_t* data, size_t length) override {
+		return m_partition && esp_partition_read(m_partition, offset, data, length) == ESP_OK;
+	}
+
+private:
+	const esp_partition_t* m_partition; // Running firmware partition
+};
+#elif defined(ESP8266)
+// Reads the running sketch, which starts at the beginning of the flash
+class ESP_OTA_Source : public OTA_Source {
+public:
+	bool read(size_t offset, uint8_t* data, size_t length) override {
+		return ESP.flashRead(offset, data, length);
+	}
+};
+#elif !defined(ARDUINO)
+// Reads firmware image from a file, used on host
+class File_OTA_Source : public OTA_Source {
+public:
+	inline File_OTA_Source(const char* path)
+		:m_file(fopen(path, "rb")) { }
+
+	inline ~File_OTA_Source() {
+		if (m_file)
+			fclose(m_file);
+	}
+
+	bool read(size_t offset, uint8_t* data, size_t length) override {
+		return m_file && !fseek(m_file, offset, SEEK_SET) && fread(data, 1, length, m_file) == length;
+	}
+
+private:
+	FILE* m_file;               // Image file
+};
+#endif
+
+// Applies delta patch to the current image on the fly, writing the new image
+// into another sink. If downloaded data is not a patch, it is written as is,
+// so a full image can be used too. Patch starts with "TBDELTA1" and 32-bit
+// size of the new image, followed by records of 32-bit diff length, extra
+// length and signed seek, each followed by diff and extra bytes. Diff is
+// made of tokens: with the high bit set, it is amount minus one of current
+// image bytes which are unchanged, otherwise it is amount minus one of bytes
+// following it, which are added to the current image bytes. Extra bytes are
+// copied as is. Seek moves the position in the current image after the
+// record. Integers are little-endian. Patches are made by extras/make_delta.py.
+class OTA_Delta_Sink : public OTA_Sink {
+public:
+	inline OTA_Delta_Sink(OTA_Sink& target, OTA_Source& source)
+		:m_target(target), m_source(source), m_progress(), m_buffer() { }
+
+	bool begin(size_t size) override {
+		m_progress.stage = STAGE_HEADER;
+		m_progress.size = size;
+		m_progress.headerLength = 0;
+		m_progress.written = 0;
+		m_progress.oldPos = 0;
+		return true;
+	}
+
+	bool write(const uint8_t* data, size_t length) override {
+		while (length) {
+			size_t part = 0;
+			switch (m_progress.stage) {
+			case STAGE_HEADER:
+				part = fillHeader(data, length, HeaderSize);
+				if (m_progress.headerLength == HeaderSize && !startImage())
+					return false;
+				break;
+
+			case STAGE_FULL:
+				return m_target.write(data, length);
+
+			case STAGE_CONTROL:
+				part = fillHeader(data, length, ControlSize);
+				if (m_progress.headerLength == ControlSize) {
+					m_progress.diffLeft = readLE(m_progress.header);
+					m_progress.extraLeft = readLE(m_progress.header + 4);
+					m_progress.seek = static_cast<int32_t>(readLE(m_progress.header + 8));
+					m_progress.literalLeft = 0;
+					m_progress.headerLength = 0;
+					if (m_progress.written + m_progress.diffLeft + m_progress.extraLeft > m_progress.newSize)
+						return false;
+					m_progress.stage = STAGE_DIFF;
+					if (!nextRecord())
+						return false;
+				}
+				break;
+
+			case STAGE_DIFF:
+				if (m_progress.literalLeft) {
+					part = length < m_progress.literalLeft ? length : m_progress.literalLeft;
+					if (!applyDiff(data, part))
+						return false;
+					m_progress.literalLeft -= part;
+				}
+				else {
+					part = 1;
+					if (*data & 0x80) {
+						if (!applyDiff(nullptr, (*data & 0x7F) + 1U))
+							return false;
+					}
+					else
+						m_progress.literalLeft = *data + 1U;
+				}
+				if (!nextRecord())
+					return false;
+				break;
+
+			case STAGE_EXTRA:
+				part = length < m_progress.extraLeft ? length : m_progress.extraLeft;
+				if (!m_target.write(data, part))
+					return false;
+				m_progress.extraLeft -= part;
+				m_progress.written += part;
+				if (!nextRecord())
+					return false;
+				break;
+			}
+
+			data += part;
+			length -= part;
+		}
+		return true;
+	}
+
+	bool end(bool verified) override {
+		// Data, shorter than the header, is not a patch
+		if (m_progress.stage == STAGE_HEADER && m_progress.headerLength) {
+			if (!m_target.begin(m_progress.size) || !m_target.write(m_progress.header, m_progress.headerLength)) {
+				m_target.end(false);
+				return false;
+			}
+			m_progress.stage = STAGE_FULL;
+		}
+
+		const bool complete = m_progress.stage == STAGE_FULL || (m_progress.stage == STAGE_CONTROL
+			&& !m_progress.headerLength && m_progress.written == m_progress.newSize);
+		if (!complete)
+			verified = false;
+		return m_target.end(verified) && verified;
+	}
+
+	size_t saveState(uint8_t* state, size_t size) override {
+		if (size < sizeof(m_progress))
+			return 0;
+
+		size_t target = 0;
+		if (m_progress.stage != STAGE_HEADER) {
+			target = m_target.saveState(state + sizeof(m_progress), size - sizeof(m_progress));
+			if (!target)
+				return 0;
+		}
+		memcpy(state, &m_progress, sizeof(m_progress));
+		return sizeof(m_progress) + target;
+	}
+
+	bool resume(size_t size, const uint8_t* state, size_t length) override {
+		if (length < sizeof(m_progress))
+			return false;
+		memcpy(&m_progress, state, sizeof(m_progress));
+		if (m_progress.size != size)
+			return false;
+
+		// Target is begun once the header is read
+		if (m_progress.stage == STAGE_HEADER)
+			return true;
+		return m_target.resume(m_progress.stage == STAGE_FULL ? m_progress.size : m_progress.newSize,
+			state + sizeof(m_progress), length - sizeof(m_progress));
+	}
+
+private:
+	static constexpr size_t HeaderSize = 12;
+	static constexpr size_t ControlSize = 12;
+
+	enum Stage {
+		STAGE_HEADER,               // Reading header
+		STAGE_FULL,                 // Writing full image as is
+		STAGE_CONTROL,              // Reading record control
+		STAGE_DIFF,                 // Applying diff bytes
+		STAGE_EXTRA,                // Copying extra bytes
+	};
+
+	// Progress of patching, saved to resume it
+	struct Progress {
+		Stage    stage;                     // What is being read
+		size_t   size;                      // Size of the downloaded data
+		uint8_t  header[HeaderSize];        // Header or control being read
+		size_t   headerLength;              // Amount of bytes in the header
+		size_t   newSize;                   // Size of the new image
+		size_t   written;                   // Amount of new image bytes written
+		size_t   oldPos;                    // Position in the current image
+		size_t   diffLeft;                  // Amount of diff bytes left in the record
+		size_t   literalLeft;               // Amount of diff bytes left in the token
+		size_t   extraLeft;                 // Amount of extra bytes left in the record
+		int32_t  seek;                      // Seek in the current image after the record
+	};
+
+	static inline uint32_t readLE(const uint8_t* data) {
+		return data[0] | (static_cast<uint32_t>(data[1]) << 8)
+			| (static_cast<uint32_t>(data[2]) << 16) | (static_cast<uint32_t>(data[3]) << 24);
+	}
+
+	// Copies up to size bytes into the header, returns amount of bytes taken
+	size_t fillHeader(const uint8_t* data, size_t length, size_t size) {
+		size_t part = size - m_progress.headerLength;
+		if (part > length)
+			part = length;
+		memcpy(m_progress.header + m_progress.headerLength, data, part);
+		m_progress.headerLength += part;
+		return part;
+	}
+
+	// Writes current image bytes with diff added to them, or unchanged if diff is null
+	bool applyDiff(const uint8_t* diff, size_t length) {
+		if (length > m_progress.diffLeft)
+			return false;
+
+		while (length) {
+			const size_t part = length < sizeof(m_buffer) ? length : sizeof(m_buffer);
+			if (!m_source.read(m_progress.oldPos, m_buffer, part))
+				return false;
+			if (diff) {
+				for (size_t i = 0; i < part; ++i)
+					m_buffer[i] += diff[i];
+				diff += part;
+			}
+			if (!m_target.write(m_buffer, part))
+				return false;
+			m_progress.oldPos += part;
+			m_progress.diffLeft -= part;
+			m_progress.written += part;
+			length -= part;
+		}
+		return true;
+	}
+
+	// Begins writing the new image, once the header is read
+	bool startImage() {
+		if (memcmp(m_progress.header, "TBDELTA1", 8)) {
+			m_progress.stage = STAGE_FULL;
+			return m_target.begin(m_progress.size) && m_target.write(m_progress.header, m_progress.headerLength);
+		}
+
+		m_progress.newSize = readLE(m_progress.header + 8);
+		m_progress.headerLength = 0;
+		m_progress.stage = STAGE_CONTROL;
+		return m_target.begin(m_progress.newSize);
+	}
+
+	// Moves to the next part of the record, once the current one is done
+	bool nextRecord() {
+		if (m_progress.stage == STAGE_DIFF && !m_progress.diffLeft && !m_progress.literalLeft)
+			m_progress.stage = STAGE_EXTRA;
+		if (m_progress.stage == STAGE_EXTRA && !m_progress.extraLeft) {
+			if (m_progress.seek < 0 && static_cast<size_t>(-m_progress.seek) > m_progress.oldPos)
+				return false;
+			m_progress.oldPos += m_progress.seek;
+			m_progress.stage = STAGE_CONTROL;
+		}
+		return true;
+	}
+
+	OTA_Sink&   m_target;                               // Destination of the new image
+	OTA_Source& m_source;                               // Current image
+	Progress    m_progress;                             // Progress of patching
+	uint8_t     m_buffer[THINGSBOARD_OTA_DELTA_BUFFER]; // Current image bytes being patched
+};
+
+// Result of the firmware update
+enum OTA_Result {
+	OTA_UPDATED,                // Image is downloaded and verified, device may be restarted
+	OTA_UP_TO_DATE,             // Assigned firmware is the current one, or none is assigned
+	OTA_FAILED,                 // Update failed, see logs
+};
+
+// Firmware update callback, called once the update ends
+using OTA_Callback = Inplace_Callback<void(OTA_Result result)>;
+#endif // THINGSBOARD_ENABLE_OTA
+
+// Client-side RPC response callback. Called with response data, or with
+// null data and timeout flag set if the server did not answer in time.
+using RPC_Request_Callback = Inplace_Callback<void(const RPC_Data & data, bool timeout)>;
+
+// Attribute request callback. Called with response data, holding "client"
+// and "shared" objects, or with null data and timeout flag set if the server
+// did not answer in time.
+using Attribute_Request_Callback = Inplace_Callback<void(const Attribute_Data & data, bool timeout)>;
+
+#ifdef THINGSBOARD_ENABLE_GATEWAY
+// Gateway RPC callback. Called with name of the sub-device, method name and
+// parameters of the RPC request, sent to the sub-device.
+using Gateway_RPC_Callback = Inplace_Callback<RPC_Response(const char* device, const char* method, const RPC_Data & data)>;
+
+// Gateway shared attribute callback. Called with name of the sub-device and
+// its updated shared attributes.
+using Gateway_Attribute_Callback = Inplace_Callback<void(const char* device, const JsonObject & data)>;
+
+#ifdef THINGSBOARD_GATEWAY_BATCH
+// Telemetry of several sub-devices, packed into a single gateway message:
+// {"A":[{"t":1},{"t":2}],"B":[{"t":3}]}. Name of each device is rendered
+// once per message, and next telemetry of the device is appended to its
+// array, found by hash of the name.
+template <size_t PayloadSize, size_t Devices>
+class Gateway_Batch {
+public:
+	inline Gateway_Batch()
+		:m_devices(), m_count(0), m_length(0), m_since(0), m_payload() { }
+
+	// Appends telemetry of the device, a JSON object of given length, which
+	// is written in place by write(char* data, size_t length). Returns false
+	// if it does not fit, leaving the batch unchanged.
+	template <typename Writer>
+	bool append(const char* device, size_t length, Writer write) {
+		// Name is rendered right after the batch, where a new device would
+		// go, and compared with names in the batch from there
+		const size_t position = m_length ? m_length : 1;
+		const size_t nameLength = render(device, m_payload + position, PayloadSize - position);
+		if (!nameLength) {
+			m_payload[m_length] = '\0';
+			return false;
+		}
+
+		const uint32_t hash = fnv1a_hash(device, strlen(device));
+		for (size_t i = 0; i < m_count; ++i) {
+			Device& entry = m_devices[i];
+			if (entry.hash != hash || entry.nameLength != nameLength
+				|| memcmp(m_payload + entry.name, m_payload + position, nameLength))
+				continue;
+
+			// ,{data} is inserted before the closing bracket of the device array
+			m_payload[m_length] = '\0';
+			if (m_length + 1 + length >= PayloadSize)
+				return false;
+			memmove(m_payload + entry.end + 1 + length, m_payload + entry.end, m_length - entry.end + 1);
+			m_payload[entry.end] = ',';
+			write(m_payload + entry.end + 1, length);
+			entry.end += 1 + length;
+			for (size_t j = i + 1; j < m_count; ++j) {
+				m_devices[j].name += 1 + length;
+				m_devices[j].end += 1 + length;
+			}
+			m_length += 1 + length;
+			return true;
+		}
+
+		// "name":[{data}] is appended before the closing brace
+		const size_t needed = 1 + nameLength + 2 + length + 2;
+		if (m_count == Devices || m_length + needed >= PayloadSize) {
+			m_payload[m_length] = '\0';
+			return false;
+		}
+		if (!m_length)
+			m_since = millis();
+
+		m_payload[position - 1] = m_length ? ',' : '{';
+		Device& entry = m_devices[m_count++];
+		entry.hash = hash;
+		entry.name = position;
+		entry.nameLength = nameLength;
+		size_t end = position + nameLength;
+		m_payload[end++] = ':';
+		m_payload[end++] = '[';
+		write(m_payload + end, length);
+		end += length;
+		entry.end = end;
+		m_payload[end++] = ']';
+		m_payload[end++] = '}';
+		m_payload[end] = '\0';
+		m_length = end;
+		return true;
+	}
+
+	inline bool empty() const {
+		return !m_length;
+	}
+
+	// Returns time of the first telemetry in the batch
+	inline uint32_t since() const {
+		return m_since;
+	}
+
+	inline const char* payload() const {
+		return m_payload;
+	}
+
+	inline void clear() {
+		m_count = 0;
+		m_length = 0;
+		m_payload[0] = '\0';
+	}
+
+private:
+	// Renders name as JSON string, escaping quotes, backslashes and control
+	// characters. Returns its length, 0 if it does not fit.
+	static size_t render(const char* name, char* out, size_t size) {
+		static const char hex[] = "0123456789abcdef";
+		size_t length = 0;
+		if (size < 2)
+			return 0;
+		out[length++] = '"';
+		for (; *name; ++name) {
+			const uint8_t c = *name;
+			const char* escape = c == '"' ? "\\\"" : c == '\\' ? "\\\\" : c == '\b' ? "\\b" : c == '\f' ? "\\f"
+				: c == '\n' ? "\\n" : c == '\r' ? "\\r" : c == '\t' ? "\\t" : nullptr;
+			const size_t needed = escape ? 2 : c < 0x20 ? 6 : 1;
+			if (length + needed + 1 >= size)
+				return 0;
+			if (escape) {
+				out[length++] = escape[0];
+				out[length++] = escape[1];
+			}
+			else if (c < 0x20) {
+				memcpy(out + length, "\\u00", 4);
+				out[length + 4] = hex[c >> 4];
+				out[length + 5] = hex[c & 0x0F];
+				length += 6;
+			}
+			else {
+				out[length++] = c;
+			}
+		}
+		out[length++] = '"';
+		return length;
+	}
+
+	struct Device {
+		uint32_t hash;              // Hash of the device name
+		size_t   name;              // Offset of the rendered name in the payload
+		size_t   nameLength;        // Length of the rendered name
+		size_t   end;               // Offset of the closing bracket of the device array
+	};
+
+	Device   m_devices[Devices];    // Devices in the batch, in order of the payload
+	size_t   m_count;               // Amount of devices in the batch
+	size_t   m_length;              // Length of the payload
+	uint32_t m_since;               // Time of the first telemetry in the batch
+	char     m_payload[PayloadSize];// Serialized batch
+};
+#endif // THINGSBOARD_GATEWAY_BATCH
+
+// RPC method of sub-devices, routed by the gateway. Array of methods may be
+// shared by all sub-devices of the same kind, callback gets name of the device.
+class Gateway_RPC_Method {
+	template <size_t PayloadSize, size_t MaxFieldsAmt, typename Logger>
+	friend class ThingsBoardSized;
+	template <size_t Capacity>
+	friend class Gateway_RPC_Routes;
+
+public:
+	// Gateway RPC method callback signature
+	using processFn = Inplace_Callback<RPC_Response(const char* device, const RPC_Data & data)>;
+
+	// Constructs method with given name. Name must outlive the method.
+	inline Gateway_RPC_Method(const char* methodName, processFn cb)
+		:m_name(methodName), m_hash(fnv1a_hash(methodName, strlen(methodName))), m_cb(cb) { }
+
+private:
+	const char* m_name;     // Method name
+	uint32_t    m_hash;     // Hash of the method name
+	processFn   m_cb;       // Callback
+};
+
+#if THINGSBOARD_GATEWAY_DEVICES > 0
+// Routes RPC requests of sub-devices to their methods. Devices are found by
+// hash of the name in an open addressing table, then method is found by hash
+// in the method array of the device. Nothing is allocated or copied, device
+// names and method arrays must outlive their routes.
+template <size_t Capacity>
+class Gateway_RPC_Routes {
+public:
+	inline Gateway_RPC_Routes()
+		:m_slots(), m_size(0) { }
+
+	// Adds route of the device, or replaces its methods. Returns false if
+	// the table is full.
+	bool add(const char* device, const Gateway_RPC_Method* methods, size_t count) {
+		const uint32_t hash = fnv1a_hash(device, strlen(device));
+		Slot* slot = lookup(device, hash);
+		if (!slot) {
+			// First removed slot on the probe sequence is reused
+			for (size_t i = 0, index = hash % Capacity; i < Capacity; ++i, index = (index + 1) % Capacity) {
+				if (m_slots[index].state != SLOT_USED) {
+					slot = &m_slots[index];
+					break;
+				}
+			}
+			if (!slot)
+				return false;
+			slot->state = SLOT_USED;
+			slot->hash = hash;
+			slot->device = device;
+			++m_size;
+		}
+		slot->methods = methods;
+		slot->count = count;
+		return true;
+	}
+
+	// Removes route of the device. Returns false if there is none.
+	bool remove(const char* device) {
+		Slot* slot = lookup(device, fnv1a_hash(device, strlen(device)));
+		if (!slot)
+			return false;
+		slot->state = SLOT_REMOVED;
+		--m_size;
+
+		// Removed slots right before an empty one end no probe sequence of
+		// other devices, so they are emptied to keep lookups short
+		size_t index = slot - m_slots;
+		if (m_slots[(index + 1) % Capacity].state == SLOT_EMPTY) {
+			while (m_slots[index].state == SLOT_REMOVED) {
+				m_slots[index].state = SLOT_EMPTY;
+				index = (index + Capacity - 1) % Capacity;
+			}
+		}
+		return true;
+	}
+
+	// Returns method of the device, nullptr if device or method is not routed
+	const Gateway_RPC_Method* find(const char* device, const char* method) const {
+		const Slot* slot = lookup(device, fnv1a_hash(device, strlen(device)));
+		if (!slot)
+			return nullptr;
+
+		const uint32_t hash = fnv1a_hash(method, strlen(method));
+		for (size_t i = 0; i < slot->count; ++i) {
+			const Gateway_RPC_Method& m = slot->methods[i];
+			if (m.m_hash == hash && !strcmp(m.m_name, method))
+				return &m;
+		}
+		return nullptr;
+	}
+
+	// Returns amount of routed devices
+	inline size_t size() const { return m_size; }
+
+private:
+	enum Slot_State : uint8_t {
+		SLOT_EMPTY,
+		SLOT_USED,
+		SLOT_REMOVED,   // Keeps probe sequences of other devices going
+	};
+
+	struct Slot {
+		Slot_State                state;
+		uint32_t                  hash;     // Hash of the device name
+		const char*               device;   // Device name
+		const Gateway_RPC_Method* methods;  // Methods of the device
+		size_t                    count;    // Amount of methods
+	};
+
+	// Returns index of the slot of the device, Capacity if it is not routed
+	size_t locate(const char* device, uint32_t hash) const {
+		for (size_t i = 0, index = hash % Capacity; i < Capacity; ++i, index = (index + 1) % Capacity) {
+			const Slot& slot = m_slots[index];
+			if (slot.state == SLOT_EMPTY)
+				break;
+			if (slot.state == SLOT_USED && slot.hash == hash && !strcmp(slot.device, device))
+				return index;
+		}
+		return Capacity;
+	}
+
+	// Returns slot of the device, nullptr if it is not routed
+	inline Slot* lookup(const char* device, uint32_t hash) {
+		const size_t index = locate(device, hash);
+		return index < Capacity ? &m_slots[index] : nullptr;
+	}
+
+	inline const Slot* lookup(const char* device, uint32_t hash) const {
+		const size_t index = locate(device, hash);
+		return index < Capacity ? &m_slots[index] : nullptr;
+	}
+
+	Slot   m_slots[Capacity];   // Routed devices
+	size_t m_size;              // Amount of routed devices
+};
+#endif // THINGSBOARD_GATEWAY_DEVICES
+#endif
+
+// Shared attribute update, passed to a shared attribute callback. Values of
+// the keys the callback is subscribed to are resolved in advance, in the
+// order of the keys.
+class Shared_Attribute_Data {
+public:
+	inline Shared_Attribute_Data(const JsonObject& object, const char* const* keys,
+		const JsonObject::iterator* values, size_t keys_count)
+		:m_object(object), m_keys(keys), m_values(values), m_keysCount(keys_count) { }
+
+	// Returns amount of subscribed keys, 0 if callback is subscribed to all keys
+	inline size_t size() const {
+		return m_keysCount;
+	}
+
+	// Returns subscribed key by index
+	inline const char* key(size_t index) const {
+		return index < m_keysCount ? m_keys[index] : nullptr;
+	}
+
+	// Returns value of the subscribed key by index. Value is null if the key
+	// is not in this update.
+	inline JsonVariant operator[](size_t index) const {
+		if (index >= m_keysCount || m_values[index] == m_object.end())
+			return JsonVariant();
+		return (*m_values[index]).value();
+	}
+
+	// Returns the whole update
+	inline const JsonObject& object() const {
+		return m_object;
+	}
+
+private:
+	const JsonObject& m_object;     // Whole update
+	const char* const* m_keys;      // Subscribed keys
+	const JsonObject::iterator* m_values;	// Members with subscribed keys, end() if missing
+	size_t m_keysCount;             // Amount of subscribed keys
+};
+
+// Shared attribute callback wrapper
+class Shared_Attribute_Callback {
+	template <size_t PayloadSize, size_t MaxFieldsAmt, typename Logger>
+	friend class ThingsBoardSized;
+
+public:
+	// Shared attribute callback signature
+	using processFn = Inplace_Callback<void(const Shared_Attribute_Data & data)>;
+
+	// Constructs empty callback
+	inline Shared_Attribute_Callback()
+		:m_keys(nullptr), m_keysCount(0), m_hashes(), m_cb() { }
+
+	// Constructs callback that will be fired upon any shared attribute update
+	inline Shared_Attribute_Callback(processFn cb)
+		:m_keys(nullptr), m_keysCount(0), m_hashes(), m_cb(cb) { }
+
+	// Constructs callback that will be fired upon update of any of the given
+	// shared attributes. Keys must be an array, living as long as the callback.
+	template <typename Keys>
+	inline Shared_Attribute_Callback(Keys& keys, processFn cb)
+		:m_keys(keys), m_keysCount(std::extent<Keys>::value), m_hashes(), m_cb(cb) {
+		static_assert(std::extent<Keys>::value <= THINGSBOARD_SHARED_ATTRIBUTE_KEYS,
+			"too many keys, increase THINGSBOARD_SHARED_ATTRIBUTE_KEYS");
+		for (size_t i = 0; i < m_keysCount; ++i)
+			m_hashes[i] = fnv1a_hash(m_keys[i], strlen(m_keys[i]));
+	}
+
+private:
+	const char* const* m_keys;      // Subscribed keys, nullptr for all keys
+	size_t m_keysCount;             // Amount of subscribed keys
+	uint32_t m_hashes[THINGSBOARD_SHARED_ATTRIBUTE_KEYS];	// Hashes of subscribed keys
+	processFn m_cb;                 // Callback to call
+};
+
+class ThingsBoardDefaultLogger
+{
+public:
+	static void log(const char* msg) {
+#ifndef THINGSBOARD_NO_LOG
+		Serial.print(F("[TB] "));
+		Serial.println(msg);
+#endif
+	}
+};
+
+// ThingsBoardSized client class
+template <size_t PayloadSize, size_t MaxFieldsAmt, typename Logger>
+class ThingsBoardSized
+{
+public:
+	// Initializes ThingsBoardSized class with network client.
+	inline ThingsBoardSized(Client& client)
+		:m_client(client)
+		, m_connectPending(false)
+#if THINGSBOARD_QOS1_WINDOW > 0
+		, m_outbox()
+#endif
+		, m_rpcCallbacks()
+		, m_subscribedInstance(false)
+		, m_streamRPC(false)
+		, m_sharedAttributeCallbacks()
+		, m_sharedAttributeSubscribed(false)
+		, m_attributeRequests()
+		, m_attributeResponseSubscribed(false)
+		, m_storage(nullptr)
+#if THINGSBOARD_ATTRIBUTE_DIFF_SIZE > 0
+		, m_attributeDiff()
+#endif
+#if THINGSBOARD_ATTRIBUTE_COALESCE > 0
+		, m_coalescedSince(0)
+		, m_coalescedLength(0)
+		, m_coalesced()
+#endif
+		, m_pendingRPC()
+		, m_clientRPC()
+		, m_clientRPCSubscribed(false)
+		, m_requestId(0)
+		, m_rpcStats()
+#ifdef THINGSBOARD_ENABLE_OTA
+		, m_ota()
+#endif
+#ifdef THINGSBOARD_ENABLE_GATEWAY
+		, m_gatewayRPC()
+		, m_gatewayRPCSubscribed(false)
+#if THINGSBOARD_GATEWAY_DEVICES > 0
+		, m_gatewayRoutes()
+#endif
+		, m_gatewayAttributes()
+#ifdef THINGSBOARD_GATEWAY_BATCH
+		, m_gatewayBatch()
+#endif
+#endif
+#ifdef THINGSBOARD_ENABLE_PROVISIONING
+		, m_provisionToken(nullptr)
+#endif
+	{
+		m_client.setCallback([this](char* topic, uint8_t* payload, unsigned int length) {
+			on_message(topic, payload, length);
+		});
+#ifdef THINGSBOARD_ENABLE_MQTT5
+		static const char* const aliasedTopics[] = {
+			"v1/devices/me/telemetry", "v1/devices/me/attributes", "v1/gateway/telemetry"
+		};
+		m_client.setTopicAliases(aliasedTopics, sizeof(aliasedTopics) / sizeof(*aliasedTopics));
+#endif
+#if THINGSBOARD_QOS1_WINDOW > 0
+		m_client.setAckCallback([this](uint16_t packetId) {
+			if (!m_outbox.acknowledge(packetId))
+				Logger::log("PUBACK for unknown packet id");
+		});
+#endif
+	}
+
+	// Destroys ThingsBoardSized class with network client.
+	inline ~ThingsBoardSized() {
+#ifdef THINGSBOARD_ENABLE_RPC_WORKER
+		m_worker.stop();
+#endif
+	}
+
+	// Connects to the specified ThingsBoard server and port.
+	// Access token is used to authenticate a client.
+	// Returns true on success, false otherwise.
+	bool connect(const char* host, const char* access_token, uint16_t port = 1883) {
+		if (!Connect_Begin(host, access_token, port))
+			return false;
+		while (m_client.connecting())
+			m_client.loop();
+		finishConnect();
+		return connected();
+	}
+
+	// Starts connecting to the specified ThingsBoard server and port without
+	// waiting. Connection is advanced by loop(), so the application keeps
+	// running while it comes up. Returns false if it can not be started.
+	bool Connect_Begin(const char* host, const char* access_token, uint16_t port = 1883) {
+		if (!host || !access_token)
+			return false;
+
+		RPC_Unsubscribe(); // Cleanup any subscriptions
+		Shared_Attribute_Unsubscribe();
+#ifdef THINGSBOARD_ENABLE_GATEWAY
+		Gateway_RPC_Unsubscribe();
+		Gateway_Shared_Attribute_Unsubscribe();
+#endif
+		m_clientRPCSubscribed = false;
+		m_attributeResponseSubscribed = false;
+		Attributes_Force_Resend();
+#if THINGSBOARD_RPC_DEDUP_SIZE > 0
+		// Server numbers requests per connection
+		m_recentRPC.clear();
+#endif
+		m_client.setServer(host, port);
+		m_connectPending = m_client.beginConnect("TbDev", access_token, nullptr);
+		return m_connectPending;
+	}
+
+	// Returns state of the connection: MQTT_STATE_OPENING and
+	// MQTT_STATE_AWAITING_CONNACK while it comes up, MQTT_STATE_CONNECTED, or
+	// why it failed or was lost.
+	inline MQTT_State Connect_Status() const {
+		return static_cast<MQTT_State>(m_client.state());
+	}
+
+	// Sets storage for data, which must survive reboots. Shared attributes
+	// mirror is restored from it.
+	void setStorage(Persistent_Storage* storage) {
+		m_storage = storage;
+#if THINGSBOARD_ATTRIBUTE_MIRROR_SIZE > 0
+		if (m_storage && !m_attributeMirror.load(*m_storage))
+			Logger::log("no shared attributes saved");
+#endif
+	}
+
+	// Disconnects from ThingsBoard. Returns true on success.
+	inline void disconnect() {
+		m_client.disconnect();
+	}
+
+	// Returns true if connected, false otherwise.
+	inline bool connected() {
+		return m_client.connected();
+	}
+
+	// Executes an event loop for MQTT client.
+	inline void loop() {
+		m_client.loop();
+		finishConnect();
+
+#if THINGSBOARD_ATTRIBUTE_COALESCE > 0
+		const uint32_t window = THINGSBOARD_ATTRIBUTE_COALESCE;
+		if (m_coalescedLength && millis() - m_coalescedSince >= window)
+			flushSharedAttributes();
+#endif
+
+#if THINGSBOARD_QOS1_WINDOW > 0
+		// Acknowledged messages make room in the window
+		sendOutbox();
+#endif
+
+#if defined(THINGSBOARD_ENABLE_GATEWAY) && defined(THINGSBOARD_GATEWAY_BATCH)
+		const uint32_t batchTime = THINGSBOARD_GATEWAY_BATCH;
+		if (!m_gatewayBatch.empty() && millis() - m_gatewayBatch.since() >= batchTime)
+			Gateway_Flush();
+#endif
+
+		m_pendingRPC.expire([](uint32_t, const char* methodName) {
+			Logger::log("deferred RPC timed out:");
+			Logger::log(methodName);
+		});
+
+		m_clientRPC.expire([](uint32_t, const RPC_Request_Callback& cb) {
+			Logger::log("client-side RPC timed out");
+			cb(RPC_Data(), true);
+		});
+
+		m_attributeRequests.expire([](uint32_t, const Attribute_Request_Callback& cb) {
+			Logger::log("attribute request timed out");
+			cb(Attribute_Data(), true);
+		});
+
+#ifdef THINGSBOARD_ENABLE_OTA
+		// Chunks in flight are requested again if none arrived in time
+		if (m_ota.state == OTA_DOWNLOADING && millis() - m_ota.lastProgress > THINGSBOARD_OTA_TIMEOUT) {
+			if (++m_ota.retries > THINGSBOARD_OTA_RETRIES) {
+				otaFail("download timed out", true);
+			}
+			else {
+				Logger::log("firmware chunks timed out, requesting again");
+				m_ota.nextRequest = m_ota.nextWrite;
+				m_ota.lastProgress = millis();
+				otaRequestChunks();
+			}
+		}
+#endif
+
+#ifdef THINGSBOARD_ENABLE_RPC_WORKER
+		// Responses are published from the network loop only, since
+		// the MQTT client is not thread-safe
+		RPC_Job_Result result;
+		while (m_rpcResults.pop(result)) {
+			if (result.error)
+				Logger::log(result.error);
+#if THINGSBOARD_RPC_CACHE_SIZE > 0
+			else if (result.cacheTtl)
+				m_rpcCache.store(result.hash, result.cacheTtl, result.payload);
+#endif
+			publishRPCResponse(result.id, result.payload);
+		}
+#endif
+	}
+
+	//----------------------------------------------------------------------------
+	// Telemetry API
+
+	// Sends telemetry data to the ThingsBoard, returns true on success.
+	template<typename T> bool sendTelemetry(const char* key, const T& value) {
+		return sendKeyval(key, value);
+	}
+
+	inline bool sendTelemetry(const char* attrName, const String& value) {
+		return sendTelemetry(attrName, value.c_str());
+	}
+
+	// Sends aggregated telemetry to the ThingsBoard.
+	inline bool sendTelemetry(const Telemetry* data, size_t data_count) {
+		return sendDataArray(data, data_count);
+	}
+
+	// Sends custom JSON telemetry string to the ThingsBoard.
+	inline bool sendTelemetryJson(const char* json) {
+		return publishData("v1/devices/me/telemetry", json);
+	}
+
+#if THINGSBOARD_QOS1_WINDOW > 0
+	// Returns amount of telemetry and attribute messages, which are not
+	// acknowledged by the broker yet. Their data is kept until they are.
+	inline size_t Publish_Pending() const {
+		return m_outbox.size();
+	}
+#endif
+
+#if THINGSBOARD_TELEMETRY_CACHE_SIZE > 0
+	// Returns RPC callback, answering with last sent telemetry values and
+	// their age in milliseconds, without touching sensors:
+	// {"temperature":{"value":21.5,"age":1200}}. Optional "keys" parameter,
+	// an array or a single key, limits the response to the listed keys.
+	// Add it to callbacks passed to RPC_Subscribe().
+	RPC_Callback Telemetry_Cache_RPC(const char* methodName = "getTelemetry") {
+		// Executed in the network loop, so the cache is never read
+		// concurrently with sendTelemetry(), and the response buffer is
+		// published before the next request reuses it
+		return RPC_Callback(methodName, RPC_Callback::processFn(
+			[this](const RPC_Data& data) {
+				StaticJsonDocument<JSON_OBJECT_SIZE(THINGSBOARD_TELEMETRY_CACHE_SIZE)
+					+ THINGSBOARD_TELEMETRY_CACHE_SIZE * JSON_OBJECT_SIZE(2)> jsonBuffer;
+				JsonObject object = jsonBuffer.template to<JsonObject>();
+				m_telemetryCache.serialize(object, data["keys"]);
+
+				if (measureJson(jsonBuffer) > PayloadSize - 1) {
+					Logger::log("too small buffer for JSON data");
+					return RPC_Response();
+				}
+				serializeJson(object, m_telemetryCacheResponse, sizeof(m_telemetryCacheResponse));
+				return RPC_Response(nullptr, serialized(m_telemetryCacheResponse));
+			})).inLoop();
+	}
+#endif
+
+	//----------------------------------------------------------------------------
+	// Attribute API
+
+	// Sends attribute with given name and value.
+	template<typename T> bool sendAttribute(const char* attrName, const T& value) {
+		return sendKeyval(attrName, value, false);
+	}
+
+	inline bool sendAttribute(const char* attrName, const String& value) {
+		return sendAttribute(attrName, value.c_str());
+	}
+
+	// Sends aggregated attributes to the ThingsBoard.
+	inline bool sendAttributes(const Attribute* data, size_t data_count) {
+		return sendDataArray(data, data_count, false);
+	}
+
+	// Makes the next sendAttribute() and sendAttributes() calls publish all
+	// passed attributes, even unchanged ones. Called upon connect().
+	inline void Attributes_Force_Resend() {
+#if THINGSBOARD_ATTRIBUTE_DIFF_SIZE > 0
+		m_attributeDiff.clear();
+#endif
+	}
+
+	// Sends custom JSON with attributes to the ThingsBoard.
+	inline bool sendAttributeJSON(const char* json) {
+		return publishData("v1/devices/me/attributes", json);
+	}
+
+	//----------------------------------------------------------------------------
+	// Server-side RPC API
+
+	// Subscribes multiple RPC callbacks with given size
+	bool RPC_Subscribe(const std::vector<RPC_Callback>& callbacks) {
+		if (m_subscribedInstance)
+			return false;
+
+		if (!m_client.subscribe("v1/devices/me/rpc/request/+"))
+			return false;
+
+#ifdef THINGSBOARD_ENABLE_RPC_WORKER
+		if (!m_worker.start(&rpc_worker_main, this)) {
+			Logger::log("unable to start RPC worker");
+			return false;
+		}
+#endif
+
+		m_subscribedInstance = true;
+		m_rpcCallbacks.assign(callbacks.begin(), callbacks.end());
+		m_streamRPC = false;
+		for (const auto& callback : m_rpcCallbacks)
+			m_streamRPC |= static_cast<bool>(callback.m_streamCb);
+		return true;
+	}
+
+	inline bool RPC_Unsubscribe() {
+		m_subscribedInstance = false;
+		return m_client.unsubscribe("v1/devices/me/rpc/request/+");
+	}
+
+	inline bool RPC_Subscribed() {
+		return m_subscribedInstance;
+	}
+
+	// Sends response to the RPC request, previously passed to a deferred
+	// callback. Returns false if request is unknown or has timed out.
+	bool RPC_Respond(const RPC_Token& token, const RPC_Response& response) {
+		if (!m_pendingRPC.remove(token.m_id)) {
+			Logger::log("no pending RPC for the response");
+			return false;
+		}
+		return sendRPCResponse(token.m_id, response);
+	}
+
+	// Returns amount of RPC requests awaiting a deferred response.
+	inline size_t RPC_Pending() const {
+		return m_pendingRPC.size();
+	}
+
+	// Returns counters of the RPC response cache and duplicate suppression.
+	inline const RPC_Cache_Stats& RPC_Cache_Statistics() const {
+		return m_rpcStats;
+	}
+
+	//----------------------------------------------------------------------------
+	// Attributes API
+
+	// Subscribes multiple shared attribute callbacks. Updates pushed by the
+	// server are de-serialized once and passed to the callbacks, subscribed
+	// to any of the updated keys.
+	bool Shared_Attribute_Subscribe(const std::vector<Shared_Attribute_Callback>& callbacks) {
+		if (m_sharedAttributeSubscribed)
+			return false;
+
+		if (!m_client.subscribe("v1/devices/me/attributes"))
+			return false;
+
+		m_sharedAttributeSubscribed = true;
+		m_sharedAttributeCallbacks.assign(callbacks.begin(), callbacks.end());
+		return true;
+	}
+
+	inline bool Shared_Attribute_Unsubscribe() {
+		m_sharedAttributeSubscribed = false;
+		return m_client.unsubscribe("v1/devices/me/attributes");
+	}
+
+	// Requests values of client and shared attributes from the server and
+	// returns immediately. All keys are fetched in one message, and the
+	// callback is called from loop() upon response arrival or timeout.
+	// Several requests may be in flight at once, up to
+	// THINGSBOARD_MAX_ATTRIBUTE_REQUESTS. Returns false if request was not sent.
+	bool Attributes_Request(const char* const* client_keys, size_t client_count,
+		const char* const* shared_keys, size_t shared_count,
+		const Attribute_Request_Callback& cb, uint32_t timeout = THINGSBOARD_RPC_TIMEOUT) {
+		if (!cb || (!client_count && !shared_count))
+			return false;
+
+		char payload[PayloadSize] = "{";
+		size_t length = 1;
+		if (!appendAttributeKeys(payload, length, "clientKeys", client_keys, client_count)
+			|| !appendAttributeKeys(payload, length, "sharedKeys", shared_keys, shared_count)
+			|| length + 1 >= PayloadSize) {
+			Logger::log("too small buffer for attribute request");
+			return false;
+		}
+		payload[length++] = '}';
+		payload[length] = '\0';
+
+		if (!m_attributeResponseSubscribed) {
+			if (!m_client.subscribe("v1/devices/me/attributes/response/+"))
+				return false;
+			m_attributeResponseSubscribed = true;
+		}
+
+		const uint32_t requestId = ++m_requestId;
+		Attribute_Request_Callback* pending = m_attributeRequests.insert(requestId, timeout);
+		if (!pending) {
+			Logger::log("too many attribute requests in flight");
+			return false;
+		}
+		*pending = cb;
+
+		char topic[sizeof("v1/devices/me/attributes/request/") + 10];
+		snprintf(topic, sizeof(topic), "v1/devices/me/attributes/request/%lu", (unsigned long)requestId);
+
+		if (!m_client.publish(topic, payload)) {
+			m_attributeRequests.remove(requestId);
+			return false;
+		}
+		return true;
+	}
+
+	// Requests values of client and shared attributes, given as arrays.
+	template <size_t ClientCount, size_t SharedCount>
+	inline bool Attributes_Request(const char* const (&client_keys)[ClientCount],
+		const char* const (&shared_keys)[SharedCount],
+		const Attribute_Request_Callback& cb, uint32_t timeout = THINGSBOARD_RPC_TIMEOUT) {
+		return Attributes_Request(client_keys, ClientCount, shared_keys, SharedCount, cb, timeout);
+	}
+
+	// Returns amount of attribute requests awaiting a response.
+	inline size_t Attributes_Requests_Pending() const {
+		return m_attributeRequests.size();
+	}
+
+#if THINGSBOARD_ATTRIBUTE_MIRROR_SIZE > 0
+	// Requests shared attributes, which are missing from the mirror or were
+	// updated more than max_age milliseconds ago, 0 requests missing only.
+	// Received values are passed to shared attribute callbacks. Returns true
+	// if request was sent, or if all values are up to date.
+	bool Shared_Attributes_Sync(const char* const* keys, size_t keys_count, uint32_t max_age = 0) {
+		const char* stale[MaxFieldsAmt];
+		size_t stale_count = 0;
+		for (size_t i = 0; i < keys_count; ++i) {
+			if (!m_attributeMirror.stale(keys[i], max_age))
+				continue;
+			if (stale_count >= MaxFieldsAmt) {
+				Logger::log("too much JSON fields passed");
+				return false;
+			}
+			stale[stale_count++] = keys[i];
+		}
+
+		if (!stale_count)
+			return true;
+
+		return Attributes_Request(nullptr, 0, stale, stale_count,
+			[this](const Attribute_Data& data, bool timeout) {
+				if (!timeout && m_sharedAttributeSubscribed)
+					dispatchSharedAttributes(data["shared"].template as<JsonObject>());
+			});
+	}
+
+	template <size_t KeysCount>
+	inline bool Shared_Attributes_Sync(const char* const (&keys)[KeysCount], uint32_t max_age = 0) {
+		return Shared_Attributes_Sync(keys, KeysCount, max_age);
+	}
+
+	// Returns last known value of shared attribute, serialized to JSON, and
+	// optionally sequence of its last change. Returns nullptr if unknown.
+	inline const char* Shared_Attribute_Value(const char* key, uint32_t* sequence = nullptr) const {
+		return m_attributeMirror.value(key, sequence);
+	}
+#endif
+
+	//----------------------------------------------------------------------------
+	// Client-side RPC API
+
+	// Sends RPC request with optional parameters to the server and returns
+	// immediately. Callback is called from loop() upon response arrival or
+	// timeout. Several requests may be in flight at once, up to
+	// THINGSBOARD_MAX_CLIENT_RPC. Returns false if request was not sent.
+	bool RPC_Request(const char* methodName, const RPC_Request_Callback& cb,
+		const Telemetry* params = nullptr, size_t params_count = 0,
+		uint32_t timeout = THINGSBOARD_RPC_TIMEOUT) {
+		if (!methodName || !cb)
+			return false;
+
+		if (MaxFieldsAmt < params_count) {
+			Logger::log("too much JSON fields passed");
+			return false;
+		}
+
+		if (!m_clientRPCSubscribed) {
+			if (!m_client.subscribe("v1/devices/me/rpc/response/+"))
+				return false;
+			m_clientRPCSubscribed = true;
+		}
+
+		StaticJsonDocument<JSON_OBJECT_SIZE(2) + JSON_OBJECT_SIZE(MaxFieldsAmt)> jsonBuffer;
+		JsonObject object = jsonBuffer.template to<JsonObject>();
+		object["method"] = methodName;
+		JsonVariant paramsObj = object.createNestedObject("params");
+
+		for (size_t i = 0; i < params_count; ++i) {
+			if (!params[i].serializeKeyval(paramsObj)) {
+				Logger::log("unable to serialize data");
+				return false;
+			}
+		}
+
+		if (measureJson(jsonBuffer) > PayloadSize - 1) {
+			Logger::log("too small buffer for JSON data");
+			return false;
+		}
+
+		const uint32_t requestId = ++m_requestId;
+		RPC_Request_Callback* pending = m_clientRPC.insert(requestId, timeout);
+		if (!pending) {
+			Logger::log("too many client-side RPC requests in flight");
+			return false;
+		}
+		*pending = cb;
+
+		char payload[PayloadSize];
+		serializeJson(object, payload, sizeof(payload));
+		char topic[sizeof("v1/devices/me/rpc/request/") + 10];
+		snprintf(topic, sizeof(topic), "v1/devices/me/rpc/request/%lu", (unsigned long)requestId);
+
+		if (!m_client.publish(topic, payload)) {
+			m_clientRPC.remove(requestId);
+			return false;
+		}
+		return true;
+	}
+
+	// Returns amount of client-side RPC requests awaiting a response.
+	inline size_t RPC_Requests_Pending() const {
+		return m_clientRPC.size();
+	}
+
+#ifdef THINGSBOARD_ENABLE_GATEWAY
+	//----------------------------------------------------------------------------
+	// Gateway API
+
+	// Informs the server that sub-device is connected to the gateway, so the
+	// server starts sending its RPC requests and attribute updates. Device is
+	// created by the server, if it does not exist, optionally with given type.
+	bool Gateway_Connect(const char* device, const char* type = nullptr) {
+		if (!device)
+			return false;
+
+		StaticJsonDocument<JSON_OBJECT_SIZE(2)> jsonBuffer;
+		jsonBuffer["device"] = device;
+		if (type)
+			jsonBuffer["type"] = type;
+		return publishJson("v1/gateway/connect", jsonBuffer);
+	}
+
+	// Informs the server that sub-device is disconnected from the gateway.
+	bool Gateway_Disconnect(const char* device) {
+		if (!device)
+			return false;
+
+		StaticJsonDocument<JSON_OBJECT_SIZE(1)> jsonBuffer;
+		jsonBuffer["device"] = device;
+		return publishJson("v1/gateway/disconnect", jsonBuffer);
+	}
+
+	// Sends telemetry of the sub-device. If THINGSBOARD_GATEWAY_BATCH is
+	// defined, telemetry is queued and sent together with telemetry of other
+	// sub-devices.
+	template<typename T> bool Gateway_Send_Telemetry(const char* device, const char* key, const T& value) {
+		const Telemetry t(key, value);
+		return sendGatewayData(device, &t, 1);
+	}
+
+	// Sends aggregated telemetry of the sub-device.
+	inline bool Gateway_Send_Telemetry(const char* device, const Telemetry* data, size_t data_count) {
+		return sendGatewayData(device, data, data_count);
+	}
+
+	// Sends attribute of the sub-device.
+	template<typename T> bool Gateway_Send_Attribute(const char* device, const char* attrName, const T& value) {
+		const Attribute a(attrName, value);
+		return sendGatewayData(device, &a, 1, false);
+	}
+
+	// Sends aggregated attributes of the sub-device.
+	inline bool Gateway_Send_Attributes(const char* device, const Attribute* data, size_t data_count) {
+		return sendGatewayData(device, data, data_count, false);
+	}
+
+	// Subscribes callback for RPC requests to connected sub-devices, which
+	// have no route. Response returned by the callback is sent back to the server.
+	bool Gateway_RPC_Subscribe(const Gateway_RPC_Callback& cb) {
+		if (m_gatewayRPC || !cb)
+			return false;
+
+		if (!subscribeGatewayRPC())
+			return false;
+
+		m_gatewayRPC = cb;
+		return true;
+	}
+
+	// Stops receiving RPC requests to sub-devices. Routes are kept, and are
+	// subscribed again by the next route or connect().
+	inline bool Gateway_RPC_Unsubscribe() {
+		m_gatewayRPC = Gateway_RPC_Callback();
+		m_gatewayRPCSubscribed = false;
+		return m_client.unsubscribe("v1/gateway/rpc");
+	}
+
+#if THINGSBOARD_GATEWAY_DEVICES > 0
+	// Routes RPC requests to the sub-device to its methods. Methods array may
+	// be shared by sub-devices of the same kind, and must outlive the route,
+	// as well as the device name. Routes survive reconnects.
+	bool Gateway_RPC_Route(const char* device, const Gateway_RPC_Method* methods, size_t count) {
+		if (!device || !methods)
+			return false;
+
+		if (!m_gatewayRoutes.add(device, methods, count)) {
+			Logger::log("gateway RPC routing table is full");
+			return false;
+		}
+		return subscribeGatewayRPC();
+	}
+
+	template<size_t Count>
+	inline bool Gateway_RPC_Route(const char* device, const Gateway_RPC_Method (&methods)[Count]) {
+		return Gateway_RPC_Route(device, methods, Count);
+	}
+
+	// Removes route of the sub-device, e.g. after Gateway_Disconnect()
+	inline bool Gateway_RPC_Unroute(const char* device) {
+		return device && m_gatewayRoutes.remove(device);
+	}
+#endif
+
+	// Subscribes callback for shared attribute updates of connected sub-devices.
+	bool Gateway_Shared_Attribute_Subscribe(const Gateway_Attribute_Callback& cb) {
+		if (m_gatewayAttributes || !cb)
+			return false;
+
+		if (!m_client.subscribe("v1/gateway/attributes"))
+			return false;
+
+		m_gatewayAttributes = cb;
+		return true;
+	}
+
+	inline bool Gateway_Shared_Attribute_Unsubscribe() {
+		m_gatewayAttributes = Gateway_Attribute_Callback();
+		return m_client.unsubscribe("v1/gateway/attributes");
+	}
+
+#ifdef THINGSBOARD_GATEWAY_BATCH
+	// Sends queued telemetry of sub-devices now. Called from loop() once the
+	// batch is old enough. Returns false if it was not sent, keeping it queued.
+	bool Gateway_Flush() {
+		if (m_gatewayBatch.empty())
+			return true;
+		if (!publishData("v1/gateway/telemetry", m_gatewayBatch.payload()))
+			return false;
+		m_gatewayBatch.clear();
+		return true;
+	}
+#endif
+#endif
+
+#ifdef THINGSBOARD_ENABLE_PROVISIONING
+	//----------------------------------------------------------------------------
+	// Provisioning API
+
+	// Connects with the access token, cached in the storage set by
+	// setStorage(). Without a cached token, or if the server rejects it, the
+	// device is provisioned first with the key and secret of its device
+	// profile, and the issued token is cached, so a fleet can be flashed with
+	// one image and each device is provisioned once. Device name may be
+	// nullptr to let the server generate it.
+	bool Provision_Connect(const char* host, const char* deviceName,
+		const char* provisionKey, const char* provisionSecret, uint16_t port = 1883) {
+		if (!host || !provisionKey || !provisionSecret)
+			return false;
+
+		char token[THINGSBOARD_PROVISION_TOKEN_SIZE];
+		if (loadAccessToken(token)) {
+			if (connect(host, token, port))
+				return true;
+
+			// Other failures are network ones, so the token is kept
+			const int state = m_client.state();
+			if (state != MQTT_STATE_BAD_CREDENTIALS && state != MQTT_STATE_UNAUTHORIZED)
+				return false;
+			Logger::log("cached access token rejected, provisioning again");
+		}
+
+		if (!provision(host, deviceName, provisionKey, provisionSecret, port, token))
+			return false;
+
+		if (!m_storage || !m_storage->save("tb_token", token, strlen(token) + 1))
+			Logger::log("unable to cache access token");
+		return connect(host, token, port);
+	}
+
+	// Drops the cached access token, so the device is provisioned again by
+	// the next Provision_Connect()
+	inline bool Provision_Forget() {
+		return m_storage && m_storage->save("tb_token", "", 1);
+	}
+#endif
+
+#ifdef THINGSBOARD_ENABLE_OTA
+	//----------------------------------------------------------------------------
+	// Firmware update API
+
+	// Checks firmware assigned to the device, and if its title or version
+	// differs from the current one, downloads it into the sink. Up to window
+	// chunks are requested ahead, written in order and verified on the fly.
+	// Update is driven by loop(), callback is called once it ends. Current
+	// title, version and the sink must live until then.
+	bool OTA_Start(const char* current_title, const char* current_version, OTA_Sink& sink,
+		const OTA_Callback& cb, size_t chunk_size = THINGSBOARD_OTA_CHUNK_SIZE,
+		uint8_t window = THINGSBOARD_OTA_WINDOW) {
+		if (m_ota.state != OTA_IDLE) {
+			Logger::log("firmware update is already running");
+			return false;
+		}
+
+		if (!chunk_size)
+			chunk_size = PayloadSize;
+		if (!current_title || !current_version || !cb || !window || chunk_size > PayloadSize) {
+			Logger::log("invalid firmware update parameters");
+			return false;
+		}
+
+		static const char* const firmwareKeys[] = {
+			"fw_title", "fw_version", "fw_size", "fw_checksum", "fw_checksum_algorithm"
+		};
+
+		m_ota.state = OTA_CHECKING;
+		m_ota.title = current_title;
+		m_ota.version = current_version;
+		m_ota.sink = &sink;
+		m_ota.sinkBegun = false;
+		m_ota.cb = cb;
+		m_ota.chunkSize = chunk_size;
+		m_ota.window = window;
+		if (!Attributes_Request(nullptr, 0, firmwareKeys, 5,
+			[this](const Attribute_Data& data, bool timeout) { otaCheck(data, timeout); })) {
+			m_ota.state = OTA_IDLE;
+			return false;
+		}
+		return true;
+	}
+
+	// Stops running firmware update, discarding the image
+	inline void OTA_Abort() {
+		if (m_ota.state != OTA_IDLE)
+			otaFail("aborted");
+	}
+
+	// Returns true if firmware update is running
+	inline bool OTA_Running() const {
+		return m_ota.state != OTA_IDLE;
+	}
+
+	// Returns amount of firmware bytes written so far
+	inline size_t OTA_Downloaded() const {
+		return m_ota.state == OTA_DOWNLOADING ? m_ota.nextWrite * m_ota.chunkSize : 0;
+	}
+#endif
+
+private:
+	// Routes incoming MQTT message to its handler by topic
+	void on_message(char* topic, uint8_t* payload, uint32_t length) {
+#ifdef THINGSBOARD_ENABLE_OTA
+		if (!strncmp(topic, "v2/fw/response/", sizeof("v2/fw/response/") - 1)) {
+			process_ota_chunk(topic, payload, length);
+			return;
+		}
+#endif
+		if (!strncmp(topic, "v1/devices/me/rpc/request/", sizeof("v1/devices/me/rpc/request/") - 1)) {
+			if (m_subscribedInstance)
+				process_message(topic, payload, length);
+		}
+		else if (!strncmp(topic, "v1/devices/me/rpc/response/", sizeof("v1/devices/me/rpc/response/") - 1)) {
+			process_rpc_response(topic, payload, length);
+		}
+		else if (!strncmp(topic, "v1/devices/me/attributes/response/", sizeof("v1/devices/me/attributes/response/") - 1)) {
+			process_attribute_response(topic, payload, length);
+		}
+		else if (!strcmp(topic, "v1/devices/me/attributes")) {
+			if (m_sharedAttributeSubscribed)
+				process_shared_attribute_message(payload, length);
+		}
+#ifdef THINGSBOARD_ENABLE_GATEWAY
+		else if (!strcmp(topic, "v1/gateway/rpc")) {
+			if (m_gatewayRPCSubscribed)
+				process_gateway_rpc(payload, length);
+		}
+		else if (!strcmp(topic, "v1/gateway/attributes")) {
+			if (m_gatewayAttributes)
+				process_gateway_attributes(payload, length);
+		}
+#endif
+#ifdef THINGSBOARD_ENABLE_PROVISIONING
+		else if (!strcmp(topic, "/provision/response")) {
+			if (m_provisionToken)
+				process_provision_response(payload, length);
+		}
+#endif
+	}
+
+	// Resumes subscriptions and transfers of the previous connection, once
+	// the connection started by Connect_Begin() is established
+	void finishConnect() {
+		if (!m_connectPending || m_client.connecting())
+			return;
+		m_connectPending = false;
+		if (!m_client.connected())
+			return;
+
+#ifdef THINGSBOARD_ENABLE_OTA
+		// Download is resumed from the next chunk to be written
+		if (m_ota.state == OTA_DOWNLOADING) {
+			m_client.subscribe("v2/fw/response/+/chunk/+");
+			m_ota.nextRequest = m_ota.nextWrite;
+			m_ota.lastProgress = millis();
+			otaRequestChunks();
+		}
+#endif
+#if defined(THINGSBOARD_ENABLE_GATEWAY) && THINGSBOARD_GATEWAY_DEVICES > 0
+		// Routed sub-devices keep receiving RPC requests
+		if (m_gatewayRoutes.size())
+			subscribeGatewayRPC();
+#endif
+#if THINGSBOARD_QOS1_WINDOW > 0
+		// Messages unacknowledged by the previous session are sent again
+		m_outbox.requeue();
+		sendOutbox();
+#endif
+	}
+
+#ifdef THINGSBOARD_ENABLE_PROVISIONING
+	// Loads the cached access token. Returns false if there is none.
+	bool loadAccessToken(char (&token)[THINGSBOARD_PROVISION_TOKEN_SIZE]) {
+		if (!m_storage)
+			return false;
+		const size_t size = m_storage->load("tb_token", token, sizeof(token));
+		return size > 1 && size <= sizeof(token) && token[size - 1] == '\0';
+	}
+
+	// Exchanges the provision key and secret for the access token, written
+	// into the token buffer. Waits for the response in place, as there is
+	// nothing else the device can do until it has credentials.
+	bool provision(const char* host, const char* deviceName, const char* provisionKey,
+		const char* provisionSecret, uint16_t port, char (&token)[THINGSBOARD_PROVISION_TOKEN_SIZE]) {
+		m_client.setServer(host, port);
+		if (!m_client.connect("TbProvision", "provision", nullptr)) {
+			Logger::log("unable to connect for provisioning");
+			return false;
+		}
+
+		StaticJsonDocument<JSON_OBJECT_SIZE(3)> jsonBuffer;
+		if (deviceName)
+			jsonBuffer["deviceName"] = deviceName;
+		jsonBuffer["provisionDeviceKey"] = provisionKey;
+		jsonBuffer["provisionDeviceSecret"] = provisionSecret;
+
+		// Request is serialized straight into the buffer of the MQTT client,
+		// as key, secret and name together may not fit into PayloadSize
+		const size_t length = measureJson(jsonBuffer);
+		token[0] = '\0';
+		m_provisionToken = token;
+		if (!m_client.subscribe("/provision/response") || !m_client.publish("/provision", length,
+			[&jsonBuffer](uint8_t* data, size_t size) { serializeJson(jsonBuffer, reinterpret_cast<char*>(data), size); })) {
+			Logger::log("unable to send provisioning request");
+		}
+		else {
+			const uint32_t start = millis();
+			while (m_provisionToken && m_client.loop()) {
+				if (millis() - start >= THINGSBOARD_PROVISION_TIMEOUT) {
+					Logger::log("provisioning timed out");
+					break;
+				}
+			}
+		}
+		m_provisionToken = nullptr;
+
+		// Server closes the connection after the response anyway
+		m_client.disconnect();
+		return token[0] != '\0';
+	}
+
+	// Processes provisioning response:
+	// {"status":"SUCCESS","credentialsType":"ACCESS_TOKEN","credentialsValue":"token"}
+	void process_provision_response(uint8_t* payload, uint32_t length) {
+		char* token = m_provisionToken;
+		m_provisionToken = nullptr;
+
+		StaticJsonDocument<JSON_OBJECT_SIZE(4)> jsonBuffer;
+		if (deserializeJson(jsonBuffer, payload, length)) {
+			Logger::log("unable to de-serialize provision response");
+			return;
+		}
+
+		const char* status = jsonBuffer["status"];
+		if (!status || strcmp(status, "SUCCESS")) {
+			const char* error = jsonBuffer["errorMsg"];
+			Logger::log("provisioning failed:");
+			Logger::log(error ? error : status ? status : "no status");
+			return;
+		}
+
+		// Only access token credentials are supported
+		const char* type = jsonBuffer["credentialsType"];
+		const char* value = jsonBuffer["credentialsValue"];
+		if (!type || strcmp(type, "ACCESS_TOKEN") || !value) {
+			Logger::log("provisioned credentials are not an access token");
+			return;
+		}
+		if (strlen(value) >= THINGSBOARD_PROVISION_TOKEN_SIZE) {
+			Logger::log("too long provisioned access token");
+			return;
+		}
+		strcpy(token, value);
+	}
+#endif
+
+#ifdef THINGSBOARD_ENABLE_GATEWAY
+	// Processes RPC request to the sub-device:
+	// {"device":"A","data":{"id":1,"method":"m","params":{}}}
+	void process_gateway_rpc(uint8_t* payload, uint32_t length) {
+		StaticJsonDocument<JSON_OBJECT_SIZE(2) + JSON_OBJECT_SIZE(3) + JSON_OBJECT_SIZE(MaxFieldsAmt)> jsonBuffer;
+		if (deserializeJson(jsonBuffer, payload, length)) {
+			Logger::log("unable to de-serialize gateway RPC");
+			return;
+		}
+
+		const char* device = jsonBuffer["device"];
+		const JsonVariant data = jsonBuffer["data"];
+		const char* methodName = data["method"];
+		if (!device || !methodName) {
+			Logger::log("gateway RPC device or method is nullptr");
+			return;
+		}
+
+		Logger::log("received gateway RPC:");
+		Logger::log(methodName);
+#if THINGSBOARD_GATEWAY_DEVICES > 0
+		const Gateway_RPC_Method* method = m_gatewayRoutes.find(device, methodName);
+#else
+		const Gateway_RPC_Method* method = nullptr;
+#endif
+		RPC_Response r;
+		if (method)
+			r = method->m_cb(device, data["params"]);
+		else if (m_gatewayRPC)
+			r = m_gatewayRPC(device, methodName, data["params"]);
+		else
+			Logger::log("no gateway RPC route for the method");
+		sendGatewayRPCResponse(device, data["id"].template as<uint32_t>(), r);
+	}
+
+	// Subscribes to RPC requests to sub-devices once, for routes and callback
+	bool subscribeGatewayRPC() {
+		if (m_gatewayRPCSubscribed)
+			return true;
+		if (!m_client.subscribe("v1/gateway/rpc"))
+			return false;
+		m_gatewayRPCSubscribed = true;
+		return true;
+	}
+
+	// Publishes response to the RPC request to the sub-device:
+	// {"device":"A","id":1,"data":{}}
+	bool sendGatewayRPCResponse(const char* device, uint32_t requestId, const RPC_Response& r) {
+		StaticJsonDocument<JSON_OBJECT_SIZE(3) + JSON_OBJECT_SIZE(1)> jsonBuffer;
+		jsonBuffer["device"] = device;
+		jsonBuffer["id"] = requestId;
+		JsonVariant data = jsonBuffer.createNestedObject("data");
+		if (!r.serializeKeyval(data)) {
+			Logger::log("unable to serialize data");
+			return false;
+		}
+		return publishJson("v1/gateway/rpc", jsonBuffer);
+	}
+
+	// Processes shared attribute update of the sub-device:
+	// {"device":"A","data":{"key":"value"}}
+	void process_gateway_attributes(uint8_t* payload, uint32_t length) {
+		StaticJsonDocument<JSON_OBJECT_SIZE(2) + JSON_OBJECT_SIZE(MaxFieldsAmt)> jsonBuffer;
+		if (deserializeJson(jsonBuffer, payload, length)) {
+			Logger::log("unable to de-serialize gateway attributes");
+			return;
+		}
+
+		const char* device = jsonBuffer["device"];
+		if (!device) {
+			Logger::log("gateway attributes device is nullptr");
+			return;
+		}
+		m_gatewayAttributes(device, jsonBuffer["data"].template as<JsonObject>());
+	}
+
+	// Sends telemetry or attributes of the sub-device:
+	// {"A":[{"key":"value"}]} or {"A":{"key":"value"}}
+	bool sendGatewayData(const char* device, const Telemetry* data, size_t data_count, bool telemetry = true) {
+		if (!device)
+			return false;
+
+		if (MaxFieldsAmt < data_count) {
+			Logger::log("too much JSON fields passed");
+			return false;
+		}
+
+#ifdef THINGSBOARD_GATEWAY_BATCH
+		if (telemetry)
+			return batchGatewayTelemetry(device, data, data_count);
+#endif
+
+		StaticJsonDocument<JSON_OBJECT_SIZE(1) + JSON_ARRAY_SIZE(1) + JSON_OBJECT_SIZE(MaxFieldsAmt)> jsonBuffer;
+		JsonVariant object = telemetry
+			? jsonBuffer.createNestedArray(device).createNestedObject()
+			: jsonBuffer.createNestedObject(device);
+
+		for (size_t i = 0; i < data_count; ++i) {
+			if (!data[i].serializeKeyval(object)) {
+				Logger::log("unable to serialize data");
+				return false;
+			}
+		}
+
+		if (measureJson(jsonBuffer) > PayloadSize - 1) {
+			Logger::log("too small buffer for JSON data");
+			return false;
+		}
+
+		char payload[PayloadSize];
+		serializeJson(jsonBuffer, payload, sizeof(payload));
+		return publishData(telemetry ? "v1/gateway/telemetry" : "v1/gateway/attributes", payload);
+	}
+
+#ifdef THINGSBOARD_GATEWAY_BATCH
+	// Queues telemetry of the sub-device, sending the batch first if the
+	// telemetry does not fit into it
+	bool batchGatewayTelemetry(const char* device, const Telemetry* data, size_t data_count) {
+		StaticJsonDocument<JSON_OBJECT_SIZE(MaxFieldsAmt)> jsonBuffer;
+		JsonVariant object = jsonBuffer.template to<JsonObject>();
+		for (size_t i = 0; i < data_count; ++i) {
+			if (!data[i].serializeKeyval(object)) {
+				Logger::log("unable to serialize data");
+				return false;
+			}
+		}
+
+		if (measureJson(jsonBuffer) > PayloadSize - 1) {
+			Logger::log("too small buffer for JSON data");
+			return false;
+		}
+
+		// Telemetry is serialized straight into the batch
+		const size_t length = measureJson(jsonBuffer);
+		const auto write = [&jsonBuffer](char* data, size_t size) {
+			serializeJson(jsonBuffer, data, size);
+		};
+		if (m_gatewayBatch.append(device, length, write))
+			return true;
+
+		if (!Gateway_Flush())
+			return false;
+		if (!m_gatewayBatch.append(device, length, write)) {
+			Logger::log("too small buffer for JSON data");
+			return false;
+		}
+		return true;
+	}
+#endif
+#endif
+
+	// Serializes JSON document into the buffer of PayloadSize and publishes it
+	bool publishJson(const char* topic, const JsonDocument& jsonBuffer) {
+		if (measureJson(jsonBuffer) > PayloadSize - 1) {
+			Logger::log("too small buffer for JSON data");
+			return false;
+		}
+
+		char payload[PayloadSize];
+		serializeJson(jsonBuffer, payload, sizeof(payload));
+		return m_client.publish(topic, payload);
+	}
+
+	// Returns request id, which is the last level of the topic
+	static uint32_t topic_request_id(const char* topic) {
+		const char* idStr = strrchr(topic, '/');
+		return idStr ? strtoul(idStr + 1, nullptr, 10) : 0;
+	}
+
+	// Processes response to the client-side RPC request
+	void process_rpc_response(char* topic, uint8_t* payload, uint32_t length) {
+		const uint32_t requestId = topic_request_id(topic);
+		RPC_Request_Callback* pending = m_clientRPC.find(requestId);
+		if (!pending) {
+			Logger::log("no pending client-side RPC for the response");
+			return;
+		}
+
+		// Callback is released first, so it can send the next request
+		const RPC_Request_Callback cb = *pending;
+		m_clientRPC.remove(requestId);
+
+		StaticJsonDocument<JSON_OBJECT_SIZE(MaxFieldsAmt)> jsonBuffer;
+		DeserializationError error = deserializeJson(jsonBuffer, payload, length);
+
+		if (error) {
+			Logger::log("unable to de-serialize RPC response");
+			cb(RPC_Data(), false);
+			return;
+		}
+
+		cb(jsonBuffer.template as<JsonVariant>(), false);
+	}
+
+	// Sends single key-value in a generic way.
+	template<typename T>
+	bool sendKeyval(const char* key, T value, bool telemetry = true) {
+		Telemetry t(key, value);
+		if (!telemetry && !attributeChanged(t))
+			return true;
+
+		StaticJsonDocument<JSON_OBJECT_SIZE(1)>jsonBuffer;
+		JsonVariant object = jsonBuffer.template to<JsonVariant>();
+
+		if (!t.serializeKeyval(object)) {
+			Logger::log("unable to serialize data");
+			return false;
+		}
+
+		if (measureJson(jsonBuffer) > PayloadSize - 1) {
+			Logger::log("too small buffer for JSON data");
+			return false;
+		}
+
+		char payload[PayloadSize];
+		serializeJson(object, payload, sizeof(payload));
+		if (!telemetry) {
+			if (!sendAttributeJSON(payload))
+				return false;
+			rememberAttributes(&t, 1);
+			return true;
+		}
+
+		if (!sendTelemetryJson(payload))
+			return false;
+		cacheTelemetry(&t, 1);
+		return true;
+	}
+
+	// Returns true if attribute value differs from the last published one
+	inline bool attributeChanged(const Telemetry& data) const {
+#if THINGSBOARD_ATTRIBUTE_DIFF_SIZE > 0
+		return !data.m_key || m_attributeDiff.changed(data.m_key, data.hashValue());
+#else
+		(void)data;
+		return true;
+#endif
+	}
+
+	// Remembers last published attribute values
+	inline void rememberAttributes(const Telemetry* data, size_t data_count) {
+#if THINGSBOARD_ATTRIBUTE_DIFF_SIZE > 0
+		for (size_t i = 0; i < data_count; ++i) {
+			if (data[i].m_key)
+				m_attributeDiff.store(data[i].m_key, data[i].hashValue());
+		}
+#else
+		(void)data;
+		(void)data_count;
+#endif
+	}
+
+	// Remembers last sent telemetry values
+	inline void cacheTelemetry(const Telemetry* data, size_t data_count) {
+#if THINGSBOARD_TELEMETRY_CACHE_SIZE > 0
+		for (size_t i = 0; i < data_count; ++i)
+			m_telemetryCache.update(data[i]);
+#else
+		(void)data;
+		(void)data_count;
+#endif
+	}
+
+	// Processes RPC message
+	void process_message(char* topic, uint8_t* payload, uint32_t length) {
+		// Request id is the last topic level: v1/devices/me/rpc/request/$id
+		const uint32_t requestId = topic_request_id(topic);
+
+#if THINGSBOARD_RPC_DEDUP_SIZE > 0
+		if (m_recentRPC.contains(requestId)) {
+			Logger::log("dropped redelivered RPC");
+			++m_rpcStats.duplicates;
+			return;
+		}
+		// Requests, which were not dispatched, may be delivered again
+		if (dispatchRPC(requestId, payload, length))
+			m_recentRPC.remember(requestId);
+#else
+		dispatchRPC(requestId, payload, length);
+#endif
+	}
+
+	// Calls RPC callback for the request. Returns true if the request was
+	// answered, deferred or queued for the worker.
+	bool dispatchRPC(uint32_t requestId, uint8_t* payload, uint32_t length) {
+		if (m_streamRPC && process_stream_message(requestId, payload, length))
+			return true;
+
+#ifdef THINGSBOARD_ENABLE_RPC_WORKER
+		// Payload is copied before de-serialization modifies it in place
+		RPC_Job job;
+		const bool offload = length < sizeof(job.payload);
+		if (offload) {
+			memcpy(job.payload, payload, length);
+			job.length = length;
+		}
+#endif
+
+		StaticJsonDocument<JSON_OBJECT_SIZE(MaxFieldsAmt)> jsonBuffer;
+		DeserializationError error = deserializeJson(jsonBuffer, payload, length);
+
+		if (error) {
+			Logger::log("unable to de-serialize RPC");
+			return false;
+		}
+
+		const JsonObject& data = jsonBuffer.template as<JsonObject>();
+		const char* methodName = data["method"];
+
+		if (methodName) {
+			Logger::log("received RPC:");
+			Logger::log(methodName);
+		}
+		else {
+			Logger::log("RPC method is nullptr");
+			return false;
+		}
+
+		RPC_Response r;
+		for (const auto& m_rpcCallback : m_rpcCallbacks) {
+			if ((m_rpcCallback.m_cb || m_rpcCallback.m_deferredCb) && !strcmp(m_rpcCallback.m_name, methodName)) {
+				Logger::log("calling RPC:");
+				Logger::log(methodName);
+
+				// Do not inform client, if parameter field is missing for some reason
+				if (!data.containsKey("params"))
+					Logger::log("no parameters passed with RPC, passing nullptr JSON");
+
+				if (m_rpcCallback.m_deferredCb) {
+					// Response is sent later through RPC_Respond()
+					const char** pending = m_pendingRPC.insert(requestId, THINGSBOARD_RPC_TIMEOUT);
+					if (!pending) {
+						// Client is told instead of waiting for the timeout
+						Logger::log("rejected RPC, too many pending requests");
+						char payloadr[PayloadSize] = { 0 };
+						renderRPCError("too many pending RPC requests", payloadr);
+						publishRPCResponse(requestId, payloadr);
+						return false;
+					}
+					*pending = m_rpcCallback.m_name;
+					m_rpcCallback.m_deferredCb(data["params"], RPC_Token(requestId));
+					return true;
+				}
+
+#if THINGSBOARD_RPC_CACHE_SIZE > 0
+				const uint32_t cacheTtl = m_rpcCallback.m_cacheTtl;
+				uint32_t requestHash = 0;
+				if (cacheTtl) {
+					// Method and minified params identify the request, regardless
+					// of whitespace. Order of keys in params still matters.
+					FNV1a_Writer writer(fnv1a_hash(methodName, strlen(methodName)));
+					serializeJson(data["params"], writer);
+					requestHash = writer.hash();
+					const char* cached = m_rpcCache.find(requestHash);
+					if (cached) {
+						Logger::log("RPC answered from cache");
+						++m_rpcStats.hits;
+						publishRPCResponse(requestId, cached);
+						return true;
+					}
+					++m_rpcStats.misses;
+				}
+#endif
+
+#ifdef THINGSBOARD_ENABLE_RPC_WORKER
+				// Executed in place, if the request does not fit into the job
+				// or the worker is too busy
+				if (offload && !m_rpcCallback.m_inLoop) {
+					job.id = requestId;
+					job.cb = m_rpcCallback.m_cb;
+#if THINGSBOARD_RPC_CACHE_SIZE > 0
+					job.hash = requestHash;
+					job.cacheTtl = cacheTtl;
+#endif
+					if (m_rpcJobs.push(job)) {
+						m_worker.notify();
+						return true;
+					}
+					Logger::log("RPC worker queue is full");
+				}
+#endif
+
+				// Getting non-existing field from JSON should automatically set JSONVariant to nullptr
+				r = m_rpcCallback.m_cb(data["params"]);
+
+#if THINGSBOARD_RPC_CACHE_SIZE > 0
+				if (cacheTtl) {
+					char payloadr[PayloadSize] = { 0 };
+					if (!serializeRPCResponse(r, payloadr))
+						return true;
+					m_rpcCache.store(requestHash, cacheTtl, payloadr);
+					publishRPCResponse(requestId, payloadr);
+					return true;
+				}
+#endif
+				break;
+			}
+		}
+
+		sendRPCResponse(requestId, r);
+		return true;
+	}
+
+#ifdef THINGSBOARD_ENABLE_OTA
+	// Starts download if firmware assigned to the device differs from the
+	// current one
+	void otaCheck(const Attribute_Data& data, bool timeout) {
+		if (m_ota.state != OTA_CHECKING)
+			return;
+		if (timeout || data.isNull()) {
+			otaFail("no firmware information");
+			return;
+		}
+
+		const JsonVariant shared = data["shared"];
+		const char* title = shared["fw_title"];
+		const char* version = shared["fw_version"];
+		if (!title || !version) {
+			Logger::log("no firmware assigned");
+			otaFinish(OTA_UP_TO_DATE);
+			return;
+		}
+		if (!strcmp(title, m_ota.title) && !strcmp(version, m_ota.version)) {
+			Logger::log("firmware is up to date");
+			otaFinish(OTA_UP_TO_DATE);
+			return;
+		}
+
+		m_ota.size = shared["fw_size"].template as<uint32_t>();
+		if (!m_ota.size) {
+			otaFail("empty firmware");
+			return;
+		}
+		if (!m_ota.checksum.begin(shared["fw_checksum_algorithm"], shared["fw_checksum"])) {
+			otaFail("unsupported checksum algorithm");
+			return;
+		}
+		if (!m_client.subscribe("v2/fw/response/+/chunk/+")) {
+			otaFail("unable to subscribe to firmware chunks");
+			return;
+		}
+
+		m_ota.chunkCount = (m_ota.size + m_ota.chunkSize - 1) / m_ota.chunkSize;
+		m_ota.nextWrite = 0;
+		m_ota.savedWrite = 0;
+		if (!otaResume() && !m_ota.sink->begin(m_ota.size)) {
+			otaFail("unable to begin firmware write");
+			return;
+		}
+
+		Logger::log("downloading firmware:");
+		Logger::log(version);
+		m_ota.sinkBegun = true;
+		m_ota.state = OTA_DOWNLOADING;
+		m_ota.requestId = ++m_requestId;
+		m_ota.nextRequest = m_ota.nextWrite;
+		m_ota.retries = 0;
+		m_ota.gapFrom = 0;
+		m_ota.lastProgress = millis();
+		sendTelemetry("fw_state", "DOWNLOADING");
+		otaRequestChunks();
+	}
+
+	// Requests chunks ahead of the next chunk to be written, up to window
+	void otaRequestChunks() {
+		char size[11];
+		snprintf(size, sizeof(size), "%lu", (unsigned long)m_ota.chunkSize);
+
+		while (m_ota.nextRequest < m_ota.chunkCount && m_ota.nextRequest - m_ota.nextWrite < m_ota.window) {
+			char topic[sizeof("v2/fw/request//chunk/") + 20];
+			snprintf(topic, sizeof(topic), "v2/fw/request/%lu/chunk/%lu",
+				(unsigned long)m_ota.requestId, (unsigned long)m_ota.nextRequest);
+			// Requests, which were not sent, are repeated upon timeout
+			if (!m_client.publish(topic, size))
+				break;
+			++m_ota.nextRequest;
+		}
+	}
+
+	// Processes firmware chunk: v2/fw/response/$id/chunk/$n
+	void process_ota_chunk(char* topic, uint8_t* payload, uint32_t length) {
+		if (m_ota.state != OTA_DOWNLOADING)
+			return;
+
+		char* next = nullptr;
+		const uint32_t requestId = strtoul(topic + sizeof("v2/fw/response/") - 1, &next, 10);
+		if (requestId != m_ota.requestId || strncmp(next, "/chunk/", sizeof("/chunk/") - 1))
+			return;
+		const uint32_t chunk = strtoul(next + sizeof("/chunk/") - 1, nullptr, 10);
+
+		// Chunks are written in order. Chunk after a gap means the missing
+		// one was lost or overtaken, so chunks from the gap on are requested
+		// again right away, once per gap. Chunks, which are already written,
+		// are duplicates of requests sent again.
+		if (chunk != m_ota.nextWrite) {
+			if (chunk > m_ota.nextWrite && m_ota.gapFrom != m_ota.nextWrite + 1) {
+				Logger::log("firmware chunk out of order, requesting again");
+				m_ota.gapFrom = m_ota.nextWrite + 1;
+				m_ota.nextRequest = m_ota.nextWrite;
+				otaRequestChunks();
+			}
+			return;
+		}
+
+		const size_t offset = chunk * m_ota.chunkSize;
+		const size_t expected = m_ota.size - offset < m_ota.chunkSize ? m_ota.size - offset : m_ota.chunkSize;
+		if (length != expected) {
+			otaFail("wrong firmware chunk size");
+			return;
+		}
+
+		m_ota.checksum.update(payload, length);
+
+		// Last chunk is written only if the image is verified, so a corrupted
+		// image is never finalized
+		const bool last = chunk + 1 == m_ota.chunkCount;
+		if (last && !m_ota.checksum.verify()) {
+			otaFail("checksum mismatch");
+			return;
+		}
+		if (!m_ota.sink->write(payload, length)) {
+			otaFail("unable to write firmware");
+			return;
+		}
+
+		++m_ota.nextWrite;
+		m_ota.retries = 0;
+		m_ota.lastProgress = millis();
+
+		if (!last) {
+			if (m_storage && (m_ota.nextWrite - m_ota.savedWrite) * m_ota.chunkSize >= THINGSBOARD_OTA_SAVE_INTERVAL)
+				otaSaveProgress();
+			otaRequestChunks();
+			return;
+		}
+
+		m_ota.sinkBegun = false;
+		if (!m_ota.sink->end(true)) {
+			otaFail("unable to finish firmware write");
+			return;
+		}
+		Logger::log("firmware downloaded and verified");
+		otaForgetProgress();
+		sendTelemetry("fw_state", "DOWNLOADED");
+		sendTelemetry("fw_state", "VERIFIED");
+		otaFinish(OTA_UPDATED);
+	}
+
+	// Discards the image and reports the failure to the server. If the failure
+	// is resumable and the progress is saved, the image is kept, so the
+	// download can be resumed by the next update.
+	void otaFail(const char* error, bool resumable = false) {
+		Logger::log("firmware update failed:");
+		Logger::log(error);
+		if (m_ota.sinkBegun) {
+			m_ota.sinkBegun = false;
+			if (!resumable || !m_ota.savedWrite) {
+				m_ota.sink->end(false);
+				otaForgetProgress();
+			}
+		}
+		const Telemetry state[2] = { { "fw_state", "FAILED" }, { "fw_error", error } };
+		sendTelemetry(state, 2);
+		otaFinish(OTA_FAILED);
+	}
+
+	// Resumes download of the same image, interrupted by a reboot, from the
+	// saved progress. Returns false if there is nothing to resume.
+	bool otaResume() {
+		if (!m_storage)
+			return false;
+
+		OTA_Progress progress;
+		if (m_storage->load("tb_ota", &progress, sizeof(progress)) != sizeof(progress)
+			|| progress.magic != OTA_Progress_Magic || progress.size != m_ota.size
+			|| progress.chunkSize != m_ota.chunkSize || progress.nextWrite >= m_ota.chunkCount
+			|| !progress.checksum.sameImage(m_ota.checksum)
+			|| progress.sinkStateLength > sizeof(progress.sinkState)
+			|| !m_ota.sink->resume(m_ota.size, progress.sinkState, progress.sinkStateLength))
+			return false;
+
+		Logger::log("resuming firmware download");
+		m_ota.nextWrite = progress.nextWrite;
+		m_ota.savedWrite = progress.nextWrite;
+		m_ota.checksum = progress.checksum;
+		return true;
+	}
+
+	// Saves download progress, so it can be resumed after a reboot
+	void otaSaveProgress() {
+		OTA_Progress progress;
+		progress.sinkStateLength = m_ota.sink->saveState(progress.sinkState, sizeof(progress.sinkState));
+		// Sink does not support resuming
+		if (!progress.sinkStateLength)
+			return;
+
+		progress.magic = OTA_Progress_Magic;
+		progress.size = m_ota.size;
+		progress.chunkSize = m_ota.chunkSize;
+		progress.nextWrite = m_ota.nextWrite;
+		progress.checksum = m_ota.checksum;
+		if (m_storage->save("tb_ota", &progress, sizeof(progress)))
+			m_ota.savedWrite = m_ota.nextWrite;
+		else
+			Logger::log("unable to save firmware download progress");
+	}
+
+	// Drops saved download progress, once the image is finished or discarded
+	void otaForgetProgress() {
+		if (!m_storage || !m_ota.savedWrite)
+			return;
+		// Blob of a different size is never loaded as the progress
+		const uint32_t none = 0;
+		m_storage->save("tb_ota", &none, sizeof(none));
+		m_ota.savedWrite = 0;
+	}
+
+	// Ends the update and calls the callback
+	void otaFinish(OTA_Result result) {
+		if (m_ota.state == OTA_DOWNLOADING)
+			m_client.unsubscribe("v2/fw/response/+/chunk/+");
+		m_ota.state = OTA_IDLE;
+
+		// Callback is released first, so it can start the next update
+		const OTA_Callback cb = m_ota.cb;
+		m_ota.cb = OTA_Callback();
+		cb(result);
+	}
+#endif
+
+	// Processes response to the attribute request
+	void process_attribute_response(char* topic, uint8_t* payload, uint32_t length) {
+		const uint32_t requestId = topic_request_id(topic);
+		Attribute_Request_Callback* pending = m_attributeRequests.find(requestId);
+		if (!pending) {
+			Logger::log("no pending attribute request for the response");
+			return;
+		}
+
+		// Callback is released first, so it can send the next request
+		const Attribute_Request_Callback cb = *pending;
+		m_attributeRequests.remove(requestId);
+
+		StaticJsonDocument<JSON_OBJECT_SIZE(2) + 2 * JSON_OBJECT_SIZE(MaxFieldsAmt)> jsonBuffer;
+		DeserializationError error = deserializeJson(jsonBuffer, payload, length);
+
+		if (error) {
+			Logger::log("unable to de-serialize attribute response");
+			cb(Attribute_Data(), false);
+			return;
+		}
+
+		mirrorSharedAttributes(jsonBuffer["shared"].template as<JsonObject>());
+		saveSharedAttributes();
+		cb(jsonBuffer.template as<JsonVariant>(), false);
+	}
+
+	// Appends "name":"key1,key2" to the attribute request payload. Returns
+	// false if payload does not fit into the buffer.
+	static bool appendAttributeKeys(char* payload, size_t& length, const char* name,
+		const char* const* keys, size_t keys_count) {
+		if (!keys_count)
+			return true;
+
+		int written = snprintf(payload + length, PayloadSize - length, "%s\"%s\":\"",
+			length > 1 ? "," : "", name);
+		if (written < 0 || static_cast<size_t>(written) >= PayloadSize - length)
+			return false;
+		length += written;
+
+		for (size_t i = 0; i < keys_count; ++i) {
+			written = snprintf(payload + length, PayloadSize - length, i ? ",%s" : "%s", keys[i]);
+			if (written < 0 || static_cast<size_t>(written) >= PayloadSize - length)
+				return false;
+			length += written;
+		}
+
+		if (length + 1 >= PayloadSize)
+			return false;
+		payload[length++] = '"';
+		payload[length] = '\0';
+		return true;
+	}
+
+	// Processes shared attribute update
+	void process_shared_attribute_message(uint8_t* payload, uint32_t length) {
+		StaticJsonDocument<JSON_OBJECT_SIZE(MaxFieldsAmt)> jsonBuffer;
+		DeserializationError error = deserializeJson(jsonBuffer, payload, length);
+
+		if (error) {
+			Logger::log("unable to de-serialize shared attributes");
+			return;
+		}
+
+		const JsonObject& data = jsonBuffer.template as<JsonObject>();
+		mirrorSharedAttributes(data);
+#if THINGSBOARD_ATTRIBUTE_COALESCE > 0
+		// Mirror is saved with the merged update, not for every message
+		coalesceSharedAttributes(data);
+#else
+		saveSharedAttributes();
+		dispatchSharedAttributes(data);
+#endif
 	}
 
-	// Sends custom JSON telemetry string to the ThingsBoard.
-	inline bool sendTelemetryJson(const char* json) {
-		return m_client.publish("v1/devices/me/telemetry", json);
-	}
+#if THINGSBOARD_ATTRIBUTE_COALESCE > 0
+	// Merges shared attribute update into the pending one, newer values win.
+	// Deleted keys are collected into a single "deleted" list and their older
+	// values are dropped, while a key set again is taken out of the list.
+	// Pending update is kept serialized, since the MQTT client reuses its
+	// receive buffer.
+	void coalesceSharedAttributes(const JsonObject& data) {
+		StaticJsonDocument<JSON_OBJECT_SIZE(2 * MaxFieldsAmt) + JSON_ARRAY_SIZE(2 * MaxFieldsAmt) + PayloadSize> merged;
+		if (!m_coalescedLength || deserializeJson(merged, static_cast<const char*>(m_coalesced), m_coalescedLength))
+			merged.template to<JsonObject>();
+		mergeSharedAttributes(merged.template as<JsonObject>(), data);
 
-	//----------------------------------------------------------------------------
-	// Attribute API
+		if (merged.size() > MaxFieldsAmt || merged["deleted"].size() > MaxFieldsAmt
+			|| measureJson(merged) > PayloadSize - 1) {
+			// Merged update does not fit, so the pending one is passed first
+			flushSharedAttributes();
+			if (measureJson(data) > PayloadSize - 1) {
+				saveSharedAttributes();
+				dispatchSharedAttributes(data);
+				return;
+			}
+			merged.clear();
+			mergeSharedAttributes(merged.template to<JsonObject>(), data);
+		}
 
-	// Sends attribute with given name and value.
-	template<typename T> bool sendAttribute(const char* attrName, const T& value) {
-		return sendKeyval(attrName, value, false);
+		if (!m_coalescedLength)
+			m_coalescedSince = millis();
+		m_coalescedLength = serializeJson(merged, m_coalesced, sizeof(m_coalesced));
 	}
 
-	inline bool sendAttribute(const char* attrName, const String& value) {
-		return sendAttribute(attrName, value.c_str());
-	}
+	// Applies shared attribute update to the merged one
+	static void mergeSharedAttributes(const JsonObject& merged, const JsonObject& data) {
+		for (JsonPair kv : data) {
+			const char* key = kv.key().c_str();
+			if (strcmp(key, "deleted") || !kv.value().template is<JsonArray>()) {
+				merged[key] = kv.value();
+				forgetDeletedAttribute(merged, key);
+				continue;
+			}
 
-	// Sends aggregated attributes to the ThingsBoard.
-	inline bool sendAttributes(const Attribute* data, size_t data_count) {
-		return sendDataArray(data, data_count, false);
+			JsonArray deleted = merged["deleted"].template as<JsonArray>();
+			if (deleted.isNull())
+				deleted = merged.createNestedArray("deleted");
+			for (const JsonVariant& name : kv.value().template as<JsonArray>()) {
+				const char* deletedKey = name.template as<const char*>();
+				if (!deletedKey)
+					continue;
+				merged.remove(deletedKey);
+				if (deletedIndex(deleted, deletedKey) == deleted.size())
+					deleted.add(deletedKey);
+			}
+		}
 	}
 
-	// Sends custom JSON with attributes to the ThingsBoard.
-	inline bool sendAttributeJSON(const char* json) {
-		return m_client.publish("v1/devices/me/attributes", json);
+	// Takes key out of the "deleted" list of the merged update, removing the
+	// list once it is empty
+	static void forgetDeletedAttribute(const JsonObject& merged, const char* key) {
+		JsonArray deleted = merged["deleted"].template as<JsonArray>();
+		if (deleted.isNull())
+			return;
+		const size_t index = deletedIndex(deleted, key);
+		if (index == deleted.size())
+			return;
+		deleted.remove(index);
+		if (!deleted.size())
+			merged.remove("deleted");
 	}
 
-	//----------------------------------------------------------------------------
-	// Server-side RPC API
-
-	// Subscribes multiple RPC callbacks with given size
-	bool RPC_Subscribe(const std::vector<RPC_Callback>& callbacks) {
-		if (m_subscribedInstance)
-			return false;
+	// Returns position of key in the "deleted" list, or its size if missing
+	static size_t deletedIndex(const JsonArray& deleted, const char* key) {
+		size_t index = 0;
+		for (const JsonVariant& name : deleted) {
+			const char* deletedKey = name.template as<const char*>();
+			if (deletedKey && !strcmp(deletedKey, key))
+				break;
+			++index;
+		}
+		return index;
+	}
 
-		if (!m_client.subscribe("v1/devices/me/rpc/request/+"))
-			return false;
+	// Passes pending merged shared attribute update to callbacks
+	void flushSharedAttributes() {
+		if (!m_coalescedLength)
+			return;
 
-		m_subscribedInstance = true;
-		m_rpcCallbacks.assign(callbacks.begin(), callbacks.end());
+		StaticJsonDocument<JSON_OBJECT_SIZE(MaxFieldsAmt) + JSON_ARRAY_SIZE(MaxFieldsAmt)> jsonBuffer;
+		DeserializationError error = deserializeJson(jsonBuffer, m_coalesced, m_coalescedLength);
+		m_coalescedLength = 0;
+		saveSharedAttributes();
 
-		m_client.setCallback([&](char* topic, uint8_t* payload, uint32_t length) {
-			if (m_subscribedInstance)
-				process_message(topic, payload, length);
-			});
+		if (error) {
+			Logger::log("unable to de-serialize shared attributes");
+			return;
+		}
 
-		return true;
+		dispatchSharedAttributes(jsonBuffer.template as<JsonObject>());
 	}
+#endif
 
-	inline bool RPC_Unsubscribe() {
-		m_subscribedInstance = false;
-		return m_client.unsubscribe("v1/devices/me/rpc/request/+");
+	// Stores shared attribute values in the mirror
+	void mirrorSharedAttributes(const JsonObject& data) {
+#if THINGSBOARD_ATTRIBUTE_MIRROR_SIZE > 0
+		for (JsonPair kv : data) {
+			// Deleted attributes are pushed as {"deleted":["key1","key2"]}
+			if (!strcmp(kv.key().c_str(), "deleted") && kv.value().template is<JsonArray>()) {
+				for (const JsonVariant& key : kv.value().template as<JsonArray>()) {
+					const char* name = key.template as<const char*>();
+					if (name)
+						m_attributeMirror.remove(name);
+				}
+				continue;
+			}
+			if (!m_attributeMirror.update(kv.key().c_str(), kv.value()))
+				Logger::log("unable to mirror shared attribute");
+		}
+#else
+		(void)data;
+#endif
 	}
 
-	inline bool RPC_Subscribed() {
-		return m_subscribedInstance;
+	// Saves the mirror of shared attributes, if it changed
+	void saveSharedAttributes() {
+#if THINGSBOARD_ATTRIBUTE_MIRROR_SIZE > 0
+		if (m_storage && m_attributeMirror.dirty() && !m_attributeMirror.save(*m_storage))
+			Logger::log("unable to save shared attributes");
+#endif
 	}
 
-private:
-	// Sends single key-value in a generic way.
-	template<typename T>
-	bool sendKeyval(const char* key, T value, bool telemetry = true) {
-		Telemetry t(key, value);
-		StaticJsonDocument<JSON_OBJECT_SIZE(1)>jsonBuffer;
-		JsonVariant object = jsonBuffer.template to<JsonVariant>();
+	// Passes shared attribute values to callbacks, subscribed to their keys
+	void dispatchSharedAttributes(const JsonObject& data) {
+		// Keys of the update are hashed once and matched against hashes of
+		// subscribed keys, computed when callbacks were constructed
+		const char* keys[MaxFieldsAmt];
+		uint32_t hashes[MaxFieldsAmt];
+		JsonObject::iterator members[MaxFieldsAmt];
+		size_t count = 0;
+		for (JsonObject::iterator it = data.begin(); it != data.end() && count < MaxFieldsAmt; ++it) {
+			keys[count] = (*it).key().c_str();
+			hashes[count] = fnv1a_hash(keys[count], strlen(keys[count]));
+			members[count] = it;
+			++count;
+		}
 
-		if (!t.serializeKeyval(object)) {
-			Logger::log("unable to serialize data");
-			return false;
+		for (const auto& callback : m_sharedAttributeCallbacks) {
+			if (!callback.m_cb)
+				continue;
+
+			JsonObject::iterator resolved[THINGSBOARD_SHARED_ATTRIBUTE_KEYS];
+			bool matched = !callback.m_keys;
+			for (size_t i = 0; i < callback.m_keysCount; ++i) {
+				resolved[i] = data.end();
+				for (size_t j = 0; j < count; ++j) {
+					if (callback.m_hashes[i] == hashes[j] && !strcmp(callback.m_keys[i], keys[j])) {
+						resolved[i] = members[j];
+						matched = true;
+						break;
+					}
+				}
+			}
+
+			if (matched)
+				callback.m_cb(Shared_Attribute_Data(data, callback.m_keys, resolved, callback.m_keysCount));
 		}
+	}
 
-		if (measureJson(jsonBuffer) > PayloadSize - 1) {
-			Logger::log("too small buffer for JSON data");
+	// Processes RPC message with a streaming callback. Returns false if there
+	// is no streaming callback for the method, leaving payload intact.
+	bool process_stream_message(uint32_t requestId, uint8_t* payload, uint32_t length) {
+		// Payload is scanned without decoding strings until the callback is
+		// found, so it can still be de-serialized as usual
+		JSON_Pull_Parser parser(reinterpret_cast<char*>(payload), length);
+		parser.m_decode = false;
+		if (!parser.next() || parser.event() != JSON_Pull_Parser::EVENT_BEGIN_OBJECT)
 			return false;
+
+		const RPC_Callback* callback = nullptr;
+		JSON_Pull_Parser params;
+		bool hasParams = false;
+		while (parser.next() && parser.depth() > 0) {
+			if (parser.keyEquals("method")) {
+				for (const auto& rpcCallback : m_rpcCallbacks) {
+					if (rpcCallback.m_streamCb && parser.stringEquals(rpcCallback.m_name)) {
+						callback = &rpcCallback;
+						break;
+					}
+				}
+				if (!callback)
+					return false;
+				if (hasParams)
+					break;
+			}
+			else if (parser.keyEquals("params")) {
+				// Params may precede method, then parsing is resumed here
+				// once the method is known
+				params = parser;
+				hasParams = true;
+				if (callback)
+					break;
+			}
+			parser.skip();
 		}
 
-		char payload[PayloadSize];
-		serializeJson(object, payload, sizeof(payload));
-		return telemetry ? sendTelemetryJson(payload) : sendAttributeJSON(payload);
+		if (!callback)
+			return false;
+
+		Logger::log("calling RPC:");
+		Logger::log(callback->m_name);
+		if (!hasParams)
+			Logger::log("no parameters passed with RPC, passing null");
+
+		params.m_decode = true;
+		params.decodeString();
+		params.enterScope();
+		const RPC_Response r = callback->m_streamCb(params);
+		if (params.error())
+			Logger::log("malformed RPC params");
+		sendRPCResponse(requestId, r);
+		return true;
 	}
 
-	// Processes RPC message
-	void process_message(char* topic, uint8_t* payload, uint32_t length) {
-		StaticJsonDocument<JSON_OBJECT_SIZE(MaxFieldsAmt)> jsonBuffer;
-		DeserializationError error = deserializeJson(jsonBuffer, payload, length);
+#ifdef THINGSBOARD_ENABLE_RPC_WORKER
+	// Worker thread main loop, executing queued RPC callbacks
+	static void rpc_worker_main(void* arg) {
+		ThingsBoardSized* self = static_cast<ThingsBoardSized*>(arg);
+		RPC_Job job;
+		RPC_Job_Result result;
 
-		if (error) {
-			Logger::log("unable to de-serialize RPC");
-			return;
+		while (self->m_worker.wait()) {
+			while (self->m_rpcJobs.pop(job)) {
+				result.id = job.id;
+#if THINGSBOARD_RPC_CACHE_SIZE > 0
+				result.hash = job.hash;
+				result.cacheTtl = job.cacheTtl;
+#endif
+				// Errors are logged by the network loop, since the logger
+				// may write to the same port as the network client
+				StaticJsonDocument<JSON_OBJECT_SIZE(MaxFieldsAmt)> jsonBuffer;
+				if (deserializeJson(jsonBuffer, job.payload, job.length)) {
+					result.error = "unable to de-serialize RPC";
+				}
+				else {
+					const JsonObject& data = jsonBuffer.template as<JsonObject>();
+					result.error = renderRPCResponse(job.cb(data["params"]), result.payload);
+				}
+				if (result.error)
+					renderRPCError(result.error, result.payload);
+
+				while (!self->m_rpcResults.push(result)) {
+					self->m_worker.pause();
+				}
+			}
 		}
+	}
+#endif
 
-		const JsonObject& data = jsonBuffer.template as<JsonObject>();
-		const char* methodName = data["method"];
+	// Serializes response to the RPC request into the buffer of PayloadSize.
+	// Returns error message, nullptr on success. Does not log, so it can be
+	// called by the RPC worker.
+	static const char* renderRPCResponse(const RPC_Response& r, char* payloadr) {
+		StaticJsonDocument<JSON_OBJECT_SIZE(1)> respBuffer;
+		JsonVariant resp_obj = respBuffer.template to<JsonVariant>();
 
-		if (methodName) {
-			Logger::log("received RPC:");
-			Logger::log(methodName);
-		}
-		else {
-			Logger::log("RPC method is nullptr");
-			return;
-		}
+		if (!r.serializeKeyval(resp_obj))
+			return "unable to serialize data";
+		if (measureJson(respBuffer) > PayloadSize - 1)
+			return "too small buffer for JSON data";
 
-		RPC_Response r;
-		for (const auto& m_rpcCallback : m_rpcCallbacks) {
-			if (m_rpcCallback.m_cb && !strcmp(m_rpcCallback.m_name, methodName)) {
-				Logger::log("calling RPC:");
-				Logger::log(methodName);
+		serializeJson(resp_obj, payloadr, PayloadSize);
+		return nullptr;
+	}
 
-				// Do not inform client, if parameter field is missing for some reason
-				if (!data.containsKey("params"))
-					Logger::log("no parameters passed with RPC, passing nullptr JSON");
+	// Serializes error response {"error":"..."} into the buffer of PayloadSize
+	static void renderRPCError(const char* error, char* payloadr) {
+		StaticJsonDocument<JSON_OBJECT_SIZE(1)> respBuffer;
+		respBuffer["error"] = error;
+		serializeJson(respBuffer, payloadr, PayloadSize);
+	}
 
-				// Getting non-existing field from JSON should automatically set JSONVariant to nullptr
-				r = m_rpcCallback.m_cb(data["params"]);
-				break;
-			}
+	// Serializes response to the RPC request into the buffer of PayloadSize
+	static bool serializeRPCResponse(const RPC_Response& r, char* payloadr) {
+		const char* error = renderRPCResponse(r, payloadr);
+		if (error) {
+			Logger::log(error);
+			return false;
 		}
+		return true;
+	}
 
+	// Publishes response to the RPC request with given id
+	bool sendRPCResponse(uint32_t requestId, const RPC_Response& r) {
 		// Fill in response
 		char payloadr[PayloadSize] = { 0 };
-		StaticJsonDocument<JSON_OBJECT_SIZE(1)> respBuffer;
-		JsonVariant resp_obj = respBuffer.template to<JsonVariant>();
+		if (!serializeRPCResponse(r, payloadr))
+			return false;
 
-		if (!r.serializeKeyval(resp_obj)) {
-			Logger::log("unable to serialize data");
-			return;
-		}
+		return publishRPCResponse(requestId, payloadr);
+	}
 
-		if (measureJson(respBuffer) > PayloadSize - 1) {
+	// Publishes telemetry or attributes. At QoS 1 the message is stored until
+	// acknowledged, even while offline, and false means the outbox is full.
+	bool publishData(const char* topic, const char* payload) {
+#if THINGSBOARD_QOS1_WINDOW > 0
+		const size_t length = strlen(payload);
+		if (length > PayloadSize - 1) {
 			Logger::log("too small buffer for JSON data");
+			return false;
+		}
+		if (!m_outbox.push(topic, payload, length)) {
+			Logger::log("QoS 1 outbox is full");
+			return false;
+		}
+		sendOutbox();
+		return true;
+#else
+		return m_client.publish(topic, payload);
+#endif
+	}
+
+#if THINGSBOARD_QOS1_WINDOW > 0
+	// Sends stored messages, as long as the window has room
+	void sendOutbox() {
+		if (!m_client.connected())
 			return;
+
+		// Server may accept fewer messages in flight than the window
+		while (auto m = m_outbox.next(m_client.receiveMaximum())) {
+			// Message sent before is marked as a duplicate, and keeps its id
+			const bool dup = m->packetId;
+			if (!dup)
+				m->packetId = m_client.nextPacketId();
+			if (!m_client.publish(m->topic, reinterpret_cast<const uint8_t*>(m->payload), m->length, m->packetId, dup)) {
+				Logger::log("unable to publish QoS 1 message");
+				return;
+			}
+			m_outbox.sent(*m);
 		}
+	}
+#endif
 
-		serializeJson(resp_obj, payloadr, sizeof(payloadr));
-		String responseTopic = String(topic);
-		responseTopic.replace("request", "response");
+	// Publishes serialized response to the RPC request with given id
+	bool publishRPCResponse(uint32_t requestId, const char* payloadr) {
+		char responseTopic[sizeof("v1/devices/me/rpc/response/") + 10];
+		snprintf(responseTopic, sizeof(responseTopic), "v1/devices/me/rpc/response/%lu", (unsigned long)requestId);
 		Logger::log("response:");
 		Logger::log(payloadr);
-		m_client.publish(responseTopic.c_str(), payloadr);
+		return m_client.publish(responseTopic, payloadr);
 	}
 
 	// Sends array of attributes or telemetry to ThingsBoard
@@ -378,13 +5774,21 @@ private:
 		StaticJsonDocument<JSON_OBJECT_SIZE(MaxFieldsAmt)> jsonBuffer;
 		JsonVariant object = jsonBuffer.template to<JsonVariant>();
 
+		// Unchanged attributes are not published again
+		size_t changed_count = 0;
 		for (size_t i = 0; i < data_count; ++i) {
+			if (!telemetry && !attributeChanged(data[i]))
+				continue;
 			if (!data[i].serializeKeyval(object)) {
 				Logger::log("unable to serialize data");
 				return false;
 			}
+			++changed_count;
 		}
 
+		if (!changed_count && data_count)
+			return true;
+
 		if (measureJson(jsonBuffer) > PayloadSize - 1) {
 			Logger::log("too small buffer for JSON data");
 			return false;
@@ -392,12 +5796,150 @@ private:
 
 		char payload[PayloadSize];
 		serializeJson(object, payload, sizeof(payload));
-		return telemetry ? sendTelemetryJson(payload) : sendAttributeJSON(payload);
+		if (!telemetry) {
+			if (!sendAttributeJSON(payload))
+				return false;
+			rememberAttributes(data, data_count);
+			return true;
+		}
+
+		if (!sendTelemetryJson(payload))
+			return false;
+		cacheTelemetry(data, data_count);
+		return true;
 	}
 
-	PubSubClient m_client;              		// PubSub MQTT client instance.
+	MQTT_Client<PayloadSize + THINGSBOARD_MQTT_HEADER_SIZE, Logger> m_client;	// MQTT client instance.
+	bool m_connectPending;						// Is connection started by Connect_Begin() pending?
+#if THINGSBOARD_QOS1_WINDOW > 0
+	MQTT_Outbox<PayloadSize, THINGSBOARD_QOS1_OUTBOX, THINGSBOARD_QOS1_WINDOW> m_outbox;	// QoS 1 messages until acknowledged
+#endif
 	std::vector<RPC_Callback> m_rpcCallbacks;   // RPC callbacks array	
 	bool m_subscribedInstance;					// Are we subscribed to RPC?
+	bool m_streamRPC;							// Is there any streaming RPC callback?
+	std::vector<Shared_Attribute_Callback> m_sharedAttributeCallbacks;	// Shared attribute callbacks array
+	bool m_sharedAttributeSubscribed;			// Are we subscribed to shared attribute updates?
+	Pending_Table<Attribute_Request_Callback, THINGSBOARD_MAX_ATTRIBUTE_REQUESTS> m_attributeRequests;	// Attribute requests in flight
+	bool m_attributeResponseSubscribed;			// Are we subscribed to attribute responses?
+	Persistent_Storage* m_storage;				// Storage for data, surviving reboots
+#if THINGSBOARD_ATTRIBUTE_MIRROR_SIZE > 0
+	Attribute_Mirror<THINGSBOARD_ATTRIBUTE_MIRROR_SIZE> m_attributeMirror;	// Last known shared attribute values
+#endif
+#if THINGSBOARD_ATTRIBUTE_DIFF_SIZE > 0
+	Attribute_Diff<THINGSBOARD_ATTRIBUTE_DIFF_SIZE> m_attributeDiff;	// Hashes of last published client attributes
+#endif
+#if THINGSBOARD_ATTRIBUTE_COALESCE > 0
+	uint32_t m_coalescedSince;					// Time of the first update merged into the pending one
+	size_t m_coalescedLength;					// Length of the pending update, 0 if none
+	char m_coalesced[PayloadSize];				// Pending merged update, serialized
+#endif
+	Pending_Table<const char*, THINGSBOARD_MAX_PENDING_RPC> m_pendingRPC;	// Deferred RPC requests, value is method name
+	Pending_Table<RPC_Request_Callback, THINGSBOARD_MAX_CLIENT_RPC> m_clientRPC;	// Client-side RPC requests in flight
+	bool m_clientRPCSubscribed;					// Are we subscribed to client-side RPC responses?
+	uint32_t m_requestId;						// Id of the last request sent to the server
+	RPC_Cache_Stats m_rpcStats;					// RPC cache counters
+#if THINGSBOARD_TELEMETRY_CACHE_SIZE > 0
+	Telemetry_Cache<THINGSBOARD_TELEMETRY_CACHE_SIZE> m_telemetryCache;	// Last sent telemetry values
+	char m_telemetryCacheResponse[PayloadSize];	// Response of Telemetry_Cache_RPC()
+#endif
+#if THINGSBOARD_RPC_DEDUP_SIZE > 0
+	Recent_Ids<THINGSBOARD_RPC_DEDUP_SIZE> m_recentRPC;	// Ids of last received RPC requests
+#endif
+#if THINGSBOARD_RPC_CACHE_SIZE > 0
+	RPC_Response_Cache<PayloadSize, THINGSBOARD_RPC_CACHE_SIZE> m_rpcCache;	// Responses of idempotent methods
+#endif
+
+#ifdef THINGSBOARD_ENABLE_OTA
+	// Stage of the firmware update
+	enum OTA_State {
+		OTA_IDLE,
+		OTA_CHECKING,                       // Firmware attributes are requested
+		OTA_DOWNLOADING,                    // Chunks are requested and written
+	};
+
+	// Firmware update in progress
+	struct OTA_Session {
+		OTA_State state;                    // Stage of the update
+		const char* title;                  // Current firmware title
+		const char* version;                // Current firmware version
+		OTA_Sink* sink;                     // Destination of the image
+		bool sinkBegun;                     // Was writing into the sink started?
+		OTA_Callback cb;                    // Callback to call once the update ends
+		size_t chunkSize;                   // Size of a chunk in bytes
+		uint8_t window;                     // Maximum amount of chunk requests in flight
+		uint32_t requestId;                 // Id of chunk requests
+		size_t size;                        // Size of the image in bytes
+		uint32_t chunkCount;                // Amount of chunks in the image
+		uint32_t nextWrite;                 // Index of the next chunk to write
+		uint32_t nextRequest;               // Index of the next chunk to request
+		uint32_t lastProgress;              // Time of the last written chunk
+		uint8_t retries;                    // Amount of timeouts since the last written chunk
+		uint32_t gapFrom;                   // Chunk requested again upon a gap, plus one, 0 if none
+		OTA_Checksum checksum;              // Checksum of the chunks written so far
+		uint32_t savedWrite;                // Index of the next chunk to write in the saved progress, 0 if none
+	};
+
+	// Download progress, saved to resume the download after a reboot
+	struct OTA_Progress {
+		uint32_t magic;                                 // Layout of the blob
+		uint32_t size;                                  // Size of the image in bytes
+		uint32_t chunkSize;                             // Size of a chunk in bytes
+		uint32_t nextWrite;                             // Index of the next chunk to write
+		OTA_Checksum checksum;                          // Checksum of the chunks written
+		uint32_t sinkStateLength;                       // Size of the sink state
+		uint8_t sinkState[THINGSBOARD_OTA_SINK_STATE];  // State needed to resume the sink
+	};
+
+	// Identifies layout of the saved progress
+	static constexpr uint32_t OTA_Progress_Magic = 0x54424F00UL ^ THINGSBOARD_OTA_SINK_STATE;
+
+	OTA_Session m_ota;							// Firmware update in progress
+#endif
+
+#ifdef THINGSBOARD_ENABLE_GATEWAY
+	Gateway_RPC_Callback m_gatewayRPC;			// Callback for RPC to unrouted sub-devices, empty if not subscribed
+	bool m_gatewayRPCSubscribed;				// Subscribed to RPC of sub-devices
+#if THINGSBOARD_GATEWAY_DEVICES > 0
+	Gateway_RPC_Routes<THINGSBOARD_GATEWAY_DEVICES> m_gatewayRoutes;	// Methods of sub-devices, by device
+#endif
+	Gateway_Attribute_Callback m_gatewayAttributes;	// Callback for attributes of sub-devices, empty if not subscribed
+#ifdef THINGSBOARD_GATEWAY_BATCH
+	Gateway_Batch<PayloadSize, THINGSBOARD_GATEWAY_BATCH_DEVICES> m_gatewayBatch;	// Queued telemetry of sub-devices
+#endif
+#endif
+
+#ifdef THINGSBOARD_ENABLE_PROVISIONING
+	char* m_provisionToken;						// Buffer for the token while provisioning, nullptr otherwise
+#endif
+
+#ifdef THINGSBOARD_ENABLE_RPC_WORKER
+	// RPC request, queued for the worker
+	struct RPC_Job {
+		uint32_t id;                        // RPC request id
+		RPC_Callback::processFn cb;         // Callback to call
+#if THINGSBOARD_RPC_CACHE_SIZE > 0
+		uint32_t hash;                      // Hash of the raw request
+		uint32_t cacheTtl;                  // Response lifetime in cache, 0 if not cached
+#endif
+		size_t length;                      // Length of the payload
+		char payload[PayloadSize];          // Raw RPC request
+	};
+
+	// Serialized RPC response, queued for the network loop
+	struct RPC_Job_Result {
+		uint32_t id;                        // RPC request id
+#if THINGSBOARD_RPC_CACHE_SIZE > 0
+		uint32_t hash;                      // Hash of the raw request
+		uint32_t cacheTtl;                  // Response lifetime in cache, 0 if not cached
+#endif
+		const char* error;                  // Error to log, payload is the error response then
+		char payload[PayloadSize];          // Serialized response
+	};
+
+	RPC_Worker_Thread m_worker;                                             // Thread executing RPC callbacks
+	SPSC_Queue<RPC_Job, THINGSBOARD_RPC_WORKER_QUEUE> m_rpcJobs;            // Network loop to worker
+	SPSC_Queue<RPC_Job_Result, THINGSBOARD_RPC_WORKER_QUEUE> m_rpcResults;  // Worker to network loop
+#endif
 };
 
 #ifndef ESP8266
@@ -411,9 +5953,12 @@ public:
 		const char* host, uint16_t port = 80)
 		:m_client(client, host, port)
 		, m_host(host)
-		, m_token(access_token)
 		, m_port(port)
-	{ }
+		, m_token(access_token)
+	{
+		// Connection is reused by the following requests
+		m_client.connectionKeepAlive();
+	}
 
 	// Destroys ThingsBoardHttpSized class with network client.
 	inline ~ThingsBoardHttpSized() { }
@@ -447,12 +5992,12 @@ public:
 
 		bool rc = true;
 		String path = String("/api/v1/") + m_token + "/telemetry";
-		if (!m_client.post(path, "application/json", json) ||
-			(m_client.responseStatusCode() != HTTP_SUCCESS)) {
+		if (m_client.post(path, "application/json", json) != HTTP_SUCCESS ||
+			(m_client.responseStatusCode() != 200)) {
 			rc = false;
 		}
 
-		m_client.stop();
+		endRequest(rc);
 		return rc;
 	}
 
@@ -485,16 +6030,258 @@ public:
 
 		bool rc = true;
 		String path = String("/api/v1/") + m_token + "/attributes";
-		if (!m_client.post(path, "application/json", json)
-			|| (m_client.responseStatusCode() != HTTP_SUCCESS)) {
+		if (m_client.post(path, "application/json", json) != HTTP_SUCCESS
+			|| (m_client.responseStatusCode() != 200)) {
 			rc = false;
 		}
 
-		m_client.stop();
+		endRequest(rc);
 		return rc;
 	}
 
+#ifdef THINGSBOARD_ENABLE_OTA
+	//----------------------------------------------------------------------------
+	// Firmware update API
+
+	// Checks firmware assigned to the device, and if its title or version
+	// differs from the current one, downloads it into the sink. Chunks are
+	// requested one by one over the same connection, streamed into the sink
+	// and verified on the fly. Blocks until the update ends.
+	OTA_Result OTA_Update(const char* current_title, const char* current_version,
+		OTA_Sink& sink, size_t chunk_size = THINGSBOARD_OTA_HTTP_CHUNK_SIZE) {
+		if (!current_title || !current_version || !chunk_size || !m_token) {
+			Logger::log("invalid firmware update parameters");
+			return OTA_FAILED;
+		}
+
+		char info[THINGSBOARD_OTA_HTTP_INFO_SIZE];
+		String path = String("/api/v1/") + m_token
+			+ "/attributes?sharedKeys=fw_title,fw_version,fw_size,fw_checksum,fw_checksum_algorithm";
+		if (!readResponse(path, info, sizeof(info)))
+			return otaFail(nullptr, "no firmware information");
+
+		StaticJsonDocument<JSON_OBJECT_SIZE(1) + JSON_OBJECT_SIZE(5)> jsonBuffer;
+		if (deserializeJson(jsonBuffer, info))
+			return otaFail(nullptr, "unable to de-serialize firmware information");
+
+		const JsonVariant shared = jsonBuffer["shared"];
+		const char* title = shared["fw_title"];
+		const char* version = shared["fw_version"];
+		if (!title || !version) {
+			Logger::log("no firmware assigned");
+			return OTA_UP_TO_DATE;
+		}
+		if (!strcmp(title, current_title) && !strcmp(version, current_version)) {
+			Logger::log("firmware is up to date");
+			return OTA_UP_TO_DATE;
+		}
+
+		const size_t size = shared["fw_size"].template as<uint32_t>();
+		if (!size)
+			return otaFail(nullptr, "empty firmware");
+		OTA_Checksum checksum;
+		if (!checksum.begin(shared["fw_checksum_algorithm"], shared["fw_checksum"]))
+			return otaFail(nullptr, "unsupported checksum algorithm");
+		if (!sink.begin(size))
+			return otaFail(nullptr, "unable to begin firmware write");
+
+		Logger::log("downloading firmware:");
+		Logger::log(version);
+		sendTelemetry("fw_state", "DOWNLOADING");
+
+		const String firmware = String("/api/v1/") + m_token + "/firmware?title=" + urlEncode(title)
+			+ "&version=" + urlEncode(version) + "&size=" + String((unsigned long)chunk_size) + "&chunk=";
+		const size_t chunkCount = (size + chunk_size - 1) / chunk_size;
+		for (size_t chunk = 0; chunk < chunkCount; ++chunk) {
+			const size_t offset = chunk * chunk_size;
+			const size_t expected = size - offset < chunk_size ? size - offset : chunk_size;
+			size_t written = 0;
+			uint8_t retries = 0;
+
+			for (;;) {
+				const Chunk_Status status = otaDownloadChunk(firmware + String((unsigned long)chunk),
+					expected, written, checksum, sink);
+				if (status == CHUNK_DONE)
+					break;
+				if (status == CHUNK_FAILED)
+					return otaFail(&sink, "unable to write firmware");
+				if (++retries > THINGSBOARD_OTA_RETRIES)
+					return otaFail(&sink, "download failed");
+				Logger::log("firmware chunk request failed, retrying");
+			}
+		}
+
+		if (!checksum.verify())
+			return otaFail(&sink, "checksum mismatch");
+		if (!sink.end(true))
+			return otaFail(nullptr, "unable to finish firmware write");
+
+		Logger::log("firmware downloaded and verified");
+		sendTelemetry("fw_state", "DOWNLOADED");
+		sendTelemetry("fw_state", "VERIFIED");
+		return OTA_UPDATED;
+	}
+#endif
+
 private:
+	// Finishes reading the response, so the connection is kept alive for the
+	// next request. Connection is closed if the request failed.
+	void endRequest(bool success) {
+		if (!success || m_client.skipResponseHeaders() != HTTP_SUCCESS || m_client.contentLength() < 0) {
+			m_client.stop();
+			return;
+		}
+
+		const uint32_t start = millis();
+		while (!m_client.endOfBodyReached()) {
+			if (!m_client.connected() || millis() - start >= static_cast<uint32_t>(HttpClient::kHttpResponseTimeout)) {
+				m_client.stop();
+				return;
+			}
+			m_client.read();
+		}
+	}
+
+#ifdef THINGSBOARD_ENABLE_OTA
+	// Outcome of a firmware chunk download
+	enum Chunk_Status {
+		CHUNK_DONE,                 // Chunk is written
+		CHUNK_RETRY,                // Request failed, chunk is to be requested again
+		CHUNK_FAILED,               // Chunk could not be written
+	};
+
+	// Returns the string percent-encoded, so it can be passed in a query
+	static String urlEncode(const char* str) {
+		static const char hex[] = "0123456789ABCDEF";
+		String encoded;
+		char part[16];
+		size_t length = 0;
+		for (; *str; ++str) {
+			const uint8_t c = *str;
+			if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9')
+				|| c == '-' || c == '.' || c == '_' || c == '~') {
+				part[length++] = c;
+			}
+			else {
+				part[length++] = '%';
+				part[length++] = hex[c >> 4];
+				part[length++] = hex[c & 0x0F];
+			}
+			// Encoded characters are appended in parts, not one by one
+			if (length > sizeof(part) - 4) {
+				part[length] = '\0';
+				encoded += part;
+				length = 0;
+			}
+		}
+		part[length] = '\0';
+		encoded += part;
+		return encoded;
+	}
+
+	// Sends GET request, returns true if the server responded with success,
+	// leaving the response body to be read
+	bool getRequest(const String& path) {
+		if (!m_client.connected() && !m_client.connect(m_host, m_port)) {
+			Logger::log("connect to server failed");
+			return false;
+		}
+
+		if (m_client.get(path) != HTTP_SUCCESS || m_client.responseStatusCode() != 200
+			|| m_client.skipResponseHeaders() != HTTP_SUCCESS) {
+			m_client.stop();
+			return false;
+		}
+		return true;
+	}
+
+	// Reads whole response body into the buffer as a string
+	bool readResponse(const String& path, char* buffer, size_t size) {
+		if (!getRequest(path))
+			return false;
+
+		const int length = m_client.contentLength();
+		if (length < 0 || static_cast<size_t>(length) > size - 1) {
+			Logger::log("too small buffer for JSON data");
+			m_client.stop();
+			return false;
+		}
+
+		int received = 0;
+		uint32_t lastProgress = millis();
+		while (received < length) {
+			const int part = m_client.available() ? m_client.read(reinterpret_cast<uint8_t*>(buffer) + received, length - received) : 0;
+			if (part > 0) {
+				received += part;
+				lastProgress = millis();
+			}
+			else if (!m_client.connected() || millis() - lastProgress >= THINGSBOARD_OTA_TIMEOUT) {
+				m_client.stop();
+				return false;
+			}
+		}
+		buffer[length] = '\0';
+		return true;
+	}
+
+	// Downloads firmware chunk into the sink. Bytes of the chunk, written by
+	// a previous attempt, are skipped, so a failed attempt can be repeated.
+	Chunk_Status otaDownloadChunk(const String& path, size_t expected, size_t& written,
+		OTA_Checksum& checksum, OTA_Sink& sink) {
+		if (!getRequest(path))
+			return CHUNK_RETRY;
+		if (m_client.contentLength() != static_cast<int>(expected)) {
+			Logger::log("wrong firmware chunk size");
+			m_client.stop();
+			return CHUNK_RETRY;
+		}
+
+		uint8_t buffer[THINGSBOARD_OTA_HTTP_BUFFER];
+		size_t received = 0;
+		uint32_t lastProgress = millis();
+		while (received < expected) {
+			size_t part = expected - received;
+			if (part > sizeof(buffer))
+				part = sizeof(buffer);
+			// Read stops at the first byte, which was not written yet
+			if (received < written && part > written - received)
+				part = written - received;
+
+			const int length = m_client.available() ? m_client.read(buffer, part) : 0;
+			if (length <= 0) {
+				if (!m_client.connected() || millis() - lastProgress >= THINGSBOARD_OTA_TIMEOUT) {
+					m_client.stop();
+					return CHUNK_RETRY;
+				}
+				continue;
+			}
+
+			if (received >= written) {
+				checksum.update(buffer, length);
+				if (!sink.write(buffer, length)) {
+					m_client.stop();
+					return CHUNK_FAILED;
+				}
+				written += length;
+			}
+			received += length;
+			lastProgress = millis();
+		}
+		return CHUNK_DONE;
+	}
+
+	// Discards the image, if the sink is given, and reports the failure to the server
+	OTA_Result otaFail(OTA_Sink* sink, const char* error) {
+		Logger::log("firmware update failed:");
+		Logger::log(error);
+		if (sink)
+			sink->end(false);
+		const Telemetry state[2] = { { "fw_state", "FAILED" }, { "fw_error", error } };
+		sendTelemetry(state, 2);
+		return OTA_FAILED;
+	}
+#endif
+
 	// Sends array of attributes or telemetry to ThingsBoard
 	bool sendDataArray(const Telemetry* data, size_t data_count, bool telemetry = true) {
 		if (MaxFieldsAmt < data_count) {
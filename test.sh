@@ -52,10 +52,12 @@ do_link
 
 # `|| true`` added to ignore an error if a lib is already installed
 
-"${ARDUINO_CLI}" lib install PubSubClient || true
 "${ARDUINO_CLI}" lib install WiFiEsp || true
 "${ARDUINO_CLI}" lib install ArduinoJson || true
 "${ARDUINO_CLI}" lib install TinyGSM || true
 "${ARDUINO_CLI}" lib install ArduinoHttpClient || true
 
 do_test
+
+# Host tests, built against the ArduinoJson installed above
+extras/test/run.sh